@@ -0,0 +1,428 @@
+//
+// AC-3, E-AC-3, TrueHD and DTS sync frame parsing, directly from the bitstream
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "avcp.h"
+#include "bitreader.h"
+#include "audioparse.h"
+
+/* channels implied by the AC-3/E-AC-3 acmod field (excluding LFE). 1+1 'dual mono' counts as two */
+static const unsigned int acmodChannels[8] = { 2, 1, 2, 3, 3, 4, 4, 5 };
+
+/* channels added by each E-AC-3 dependent substream chanmap location, beyond the 5.1 an
+ * independent substream can carry. Location 0 is the MSB; locations 0-4 and 15 (L, C, R,
+ * Ls, Rs and LFE) replace channels already present, so they don't add to the count */
+static const unsigned int chanmapExtraChannels[16] = {
+    0, 0, 0, 0, 0,  /* L, C, R, Ls, Rs */
+    2,              /* Lc/Rc pair */
+    2,              /* Lrs/Rrs pair */
+    1,              /* Cs */
+    1,              /* Ts */
+    2,              /* Lsd/Rsd pair */
+    2,              /* Lw/Rw pair */
+    2,              /* Vhl/Vhr pair */
+    1,              /* Vhc */
+    2,              /* Lts/Rts pair */
+    1,              /* LFE2 */
+    0               /* LFE */
+};
+
+/* channels represented by each bit of a TrueHD channel_arrangement (bit 0 is L/R) */
+static const unsigned int truehdChannels[13] = {
+    2, 1, 1, 2, 2, 2, 2, 1, 1, 2, 2, 1, 1
+};
+#define kTrueHDLFE  (1 << 2)
+
+/* channels implied by the DTS core AMODE field */
+static const unsigned int dtsChannels[16] = {
+    1, 2, 2, 2, 2, 3, 3, 4, 4, 5, 6, 6, 6, 7, 8, 8
+};
+
+/* E-AC-3 number of audio blocks per frame, indexed by numblkscod */
+static const unsigned int eac3Blocks[4] = { 1, 2, 3, 6 };
+
+/**
+ * @brief parse an AC-3 bsi(), as per ATSC A/52 section 5.4.2
+ */
+static void parseAC3( tBitReader * reader, tAudioParameters * params )
+{
+    skipBits( reader, 16 );     /* syncword */
+    skipBits( reader, 16 );     /* crc1 */
+    skipBits( reader, 2 );      /* fscod */
+    skipBits( reader, 6 );      /* frmsizecod */
+    skipBits( reader, 5 );      /* bsid */
+    skipBits( reader, 3 );      /* bsmod */
+
+    unsigned int acmod = readBits( reader, 3 );
+    if ( (acmod & 0x01) && acmod != 0x01 )
+    {
+        skipBits( reader, 2 );  /* cmixlev */
+    }
+    if ( acmod & 0x04 )
+    {
+        skipBits( reader, 2 );  /* surmixlev */
+    }
+    if ( acmod == 0x02 )
+    {
+        skipBits( reader, 2 );  /* dsurmod */
+    }
+    unsigned int lfeon = readBit( reader );
+
+    if ( !reader->overrun )
+    {
+        params->lfe      = lfeon;
+        params->channels = acmodChannels[acmod] + lfeon;
+    }
+}
+
+/**
+ * @brief parse an E-AC-3 bsi(), as per ATSC A/52 annex E, section E.1.2.2
+ * @return the frame size in bytes, so the caller can step to the next substream
+ */
+static size_t parseEAC3( tBitReader * reader, tAudioParameters * params )
+{
+    skipBits( reader, 16 );                         /* syncword */
+    unsigned int strmtyp     = readBits( reader, 2 );
+    unsigned int substreamid = readBits( reader, 3 );
+    size_t       frameSize   = (readBits( reader, 11 ) + 1) * 2;
+    unsigned int fscod       = readBits( reader, 2 );
+    unsigned int numblkscod  = (fscod == 0x03) ? 0x03 : readBits( reader, 2 );
+    if ( fscod == 0x03 )
+    {
+        skipBits( reader, 2 );                      /* fscod2 */
+    }
+    unsigned int blocks = eac3Blocks[numblkscod];
+    unsigned int acmod  = readBits( reader, 3 );
+    unsigned int lfeon  = readBit( reader );
+
+    skipBits( reader, 5 );                          /* bsid */
+    skipBits( reader, 5 );                          /* dialnorm */
+    if ( readBit( reader ))                         /* compre */
+    {
+        skipBits( reader, 8 );
+    }
+    if ( acmod == 0x00 )
+    {
+        skipBits( reader, 5 );                      /* dialnorm2 */
+        if ( readBit( reader ))                     /* compr2e */
+        {
+            skipBits( reader, 8 );
+        }
+    }
+
+    if ( strmtyp == 0x01 )                          /* dependent substream */
+    {
+        /* only count each dependent substream once, however many frames we see */
+        if ( readBit( reader ) && !(params->seen & (1 << substreamid)) )   /* chanmape */
+        {
+            unsigned int chanmap = readBits( reader, 16 );
+            for ( unsigned int location = 0; location < 16; ++location )
+            {
+                if ( chanmap & (0x8000 >> location) )
+                {
+                    params->channels += chanmapExtraChannels[location];
+                }
+            }
+            params->seen |= 1 << substreamid;
+            ++params->substreams;
+        }
+        return frameSize;
+    }
+
+    /* an independent substream. We only care about the first program */
+    if ( substreamid != 0 )
+    {
+        return frameSize;
+    }
+    if ( params->channels == 0 )
+    {
+        params->lfe      = lfeon;
+        params->channels = acmodChannels[acmod] + lfeon;
+    }
+
+    if ( readBit( reader ))                         /* mixmdate */
+    {
+        if ( acmod > 0x02 )
+        {
+            skipBits( reader, 2 );                  /* dmixmod */
+        }
+        if ( (acmod & 0x01) && acmod > 0x02 )
+        {
+            skipBits( reader, 6 );                  /* ltrtcmixlev, lorocmixlev */
+        }
+        if ( acmod & 0x04 )
+        {
+            skipBits( reader, 6 );                  /* ltrtsurmixlev, lorosurmixlev */
+        }
+        if ( lfeon && readBit( reader ))            /* lfemixlevcode */
+        {
+            skipBits( reader, 5 );
+        }
+        if ( strmtyp == 0x00 )
+        {
+            if ( readBit( reader ))                 /* pgmscle */
+            {
+                skipBits( reader, 6 );
+            }
+            if ( acmod == 0x00 && readBit( reader ))    /* pgmscl2e */
+            {
+                skipBits( reader, 6 );
+            }
+            if ( readBit( reader ))                 /* extpgmscle */
+            {
+                skipBits( reader, 6 );
+            }
+            switch ( readBits( reader, 2 ))         /* mixdef */
+            {
+            case 0x01: skipBits( reader, 5 ); break;
+            case 0x02: skipBits( reader, 12 ); break;
+            case 0x03: skipBits( reader, (readBits( reader, 5 ) + 2) * 8 ); break;
+            default: break;
+            }
+            if ( acmod < 0x02 )
+            {
+                for ( unsigned int i = 0; i < (acmod ? 1 : 2); ++i )
+                {
+                    if ( readBit( reader ))         /* paninfoe */
+                    {
+                        skipBits( reader, 14 );
+                    }
+                }
+            }
+            if ( readBit( reader ))                 /* frmmixcfginfoe */
+            {
+                for ( unsigned int blk = 0; blk < blocks; ++blk )
+                {
+                    if ( blocks == 1 || readBit( reader ))
+                    {
+                        skipBits( reader, 5 );      /* blkmixcfginfo */
+                    }
+                }
+            }
+        }
+    }
+
+    if ( readBit( reader ))                         /* infomdate */
+    {
+        skipBits( reader, 5 );                      /* bsmod, copyrightb, origbs */
+        if ( acmod == 0x02 )
+        {
+            skipBits( reader, 4 );                  /* dsurmod, dheadphonmod */
+        }
+        if ( acmod >= 0x06 )
+        {
+            skipBits( reader, 2 );                  /* dsurexmod */
+        }
+        if ( readBit( reader ))                     /* audprodie */
+        {
+            skipBits( reader, 8 );
+        }
+        if ( acmod == 0x00 && readBit( reader ))    /* audprodi2e */
+        {
+            skipBits( reader, 8 );
+        }
+        if ( fscod < 0x03 )
+        {
+            skipBits( reader, 1 );                  /* sourcefscod */
+        }
+    }
+
+    if ( strmtyp == 0x00 && numblkscod != 0x03 )
+    {
+        skipBits( reader, 1 );                      /* convsync */
+    }
+    if ( strmtyp == 0x02 )
+    {
+        if ( numblkscod == 0x03 || readBit( reader ))   /* blkid */
+        {
+            skipBits( reader, 6 );                  /* frmsizecod */
+        }
+    }
+
+    if ( readBit( reader ))                         /* addbsie */
+    {
+        unsigned int addbsil = readBits( reader, 6 );
+        /* the LSB of the first addbsi byte is flag_ec3_extension_type_a, which signals JOC (i.e. Atmos) */
+        unsigned int addbsi = readBits( reader, 8 );
+        if ( !reader->overrun && addbsil >= 1 && (addbsi & 0x01) )
+        {
+            params->objects = 1;
+        }
+    }
+
+    return frameSize;
+}
+
+/**
+ * @brief parse a TrueHD major_sync_info(), starting at the format_sync
+ */
+static void parseTrueHD( tBitReader * reader, tAudioParameters * params )
+{
+    skipBits( reader, 32 );                         /* format_sync */
+    skipBits( reader, 8 );                          /* audio_sampling_frequency, reserved */
+    skipBits( reader, 4 );                          /* 6ch/8ch multichannel types */
+    unsigned int arrangement6ch = readBits( reader, 5 );
+    skipBits( reader, 2 );                          /* 8ch_multichannel_type */
+    unsigned int arrangement8ch = readBits( reader, 13 );
+    skipBits( reader, 16 );                         /* major_sync_info_signature */
+    skipBits( reader, 16 );                         /* flags */
+    skipBits( reader, 16 );                         /* reserved */
+    skipBits( reader, 1 );                          /* variable_rate */
+    skipBits( reader, 15 );                         /* peak_data_rate */
+    unsigned int substreams = readBits( reader, 4 );
+
+    if ( reader->overrun )
+    {
+        return;
+    }
+
+    /* use the richest presentation that's signalled */
+    unsigned int arrangement = (arrangement8ch != 0) ? arrangement8ch : arrangement6ch;
+    unsigned int channels = 0;
+    for ( unsigned int bit = 0; bit < 13; ++bit )
+    {
+        if ( arrangement & (1 << bit) )
+        {
+            channels += truehdChannels[bit];
+        }
+    }
+
+    params->channels   = channels;
+    params->lfe        = (arrangement & kTrueHDLFE) != 0;
+    params->substreams = substreams;
+    /* the fourth substream carries the 16-channel presentation, which is only used for Atmos */
+    params->objects    = (substreams >= 4);
+}
+
+/**
+ * @brief parse a DTS core frame header, as per ETSI TS 102 114 section 5.3.1
+ */
+static void parseDTS( tBitReader * reader, tAudioParameters * params )
+{
+    skipBits( reader, 32 );                         /* SYNC */
+    skipBits( reader, 1 + 5 + 1 + 7 + 14 );         /* FTYPE, SHORT, CPF, NBLKS, FSIZE */
+    unsigned int amode = readBits( reader, 6 );
+    skipBits( reader, 4 + 5 + 1 + 1 + 1 + 1 + 1 );  /* SFREQ, RATE, MIX, DYNF, TIMEF, AUXF, HDCD */
+    unsigned int extAudioId = readBits( reader, 3 );
+    unsigned int extAudio   = readBit( reader );
+    skipBits( reader, 1 );                          /* ASPF */
+    unsigned int lff = readBits( reader, 2 );
+
+    if ( reader->overrun || amode >= 16 )
+    {
+        return;
+    }
+
+    params->lfe      = (lff == 1 || lff == 2);
+    params->channels = dtsChannels[amode] + params->lfe;
+    if ( extAudio && extAudioId == 0 )
+    {
+        ++params->channels;                         /* XCh adds a centre surround, i.e. 6.1 */
+    }
+}
+
+int parseAudioParameters( tAudioCodec codec, const uint8_t * data, size_t size, tAudioParameters * params )
+{
+    tBitReader reader;
+    int        found = 0;
+
+    if ( data == NULL )
+    {
+        return -1;
+    }
+
+    size_t i = 0;
+    while ( i + 4 <= size )
+    {
+        switch ( codec )
+        {
+        case audioCodecAC3:
+        case audioCodecEAC3:
+            if ( data[i] == 0x0B && data[i + 1] == 0x77 && i + 6 <= size )
+            {
+                /* bsid tells AC-3 (up to 10) and E-AC-3 (11 to 16) apart, regardless of the codec id */
+                unsigned int bsid = data[i + 5] >> 3;
+
+                initBitReader( &reader, &data[i], size - i );
+                if ( bsid <= 10 )
+                {
+                    parseAC3( &reader, params );
+                    return 0;   /* AC-3 frames are self-contained */
+                }
+                size_t frameSize = parseEAC3( &reader, params );
+                found = 1;
+                i += frameSize;
+                continue;
+            }
+            break;
+
+        case audioCodecTrueHD:
+            if ( data[i] == 0xF8 && data[i + 1] == 0x72 && data[i + 2] == 0x6F && data[i + 3] == 0xBA )
+            {
+                initBitReader( &reader, &data[i], size - i );
+                parseTrueHD( &reader, params );
+                return 0;
+            }
+            break;
+
+        case audioCodecDTS:
+            if ( data[i] == 0x7F && data[i + 1] == 0xFE && data[i + 2] == 0x80 && data[i + 3] == 0x01 )
+            {
+                initBitReader( &reader, &data[i], size - i );
+                parseDTS( &reader, params );
+                found = 1;
+                i += 4;
+                continue;
+            }
+            /* the DTS-HD extension substream follows the core */
+            if ( data[i] == 0x64 && data[i + 1] == 0x58 && data[i + 2] == 0x20 && data[i + 3] == 0x25 )
+            {
+                params->substreams = 1;
+                return found ? 0 : -1;
+            }
+            break;
+
+        default:
+            return -1;
+        }
+        ++i;
+    }
+
+    return found ? 0 : -1;
+}
+
+tChannelLayout audioLayout( const tAudioParameters * params )
+{
+    unsigned int channels = params->channels - (params->lfe ? 1 : 0);
+
+    if ( params->channels == 0 )
+    {
+        return layoutUnknown;
+    }
+
+    if ( params->lfe )
+    {
+        switch ( channels )
+        {
+        case 2:  return layout2dot1;
+        case 5:
+        case 6:  return layout5dot1;    /* round 6.1 down */
+        case 7:  return layout7dot1;
+        default: return (channels > 7) ? layout7dot1 : layoutUnknown;
+        }
+    }
+
+    switch ( channels )
+    {
+    case 1:  return layoutMono;
+    case 2:  return layoutStereo;
+    case 5:  return layout5dot0;
+    default: return layoutUnknown;
+    }
+}
@@ -0,0 +1,28 @@
+//
+// AC-3, E-AC-3, TrueHD and DTS sync frame parsing, directly from the bitstream
+//
+
+#ifndef AVCP_AUDIOPARSE_H
+#define AVCP_AUDIOPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "filemediainfo.h"
+
+typedef struct {
+    unsigned int  channels;         ///> total, including any LFE channels
+    int           lfe;              ///> an LFE channel is present
+    unsigned int  substreams;       ///> E-AC-3 dependent substreams, or TrueHD substreams
+    int           objects;          ///> object-based audio (i.e. Atmos) is present
+    unsigned int  seen;             ///> E-AC-3 dependent substream ids already counted
+} tAudioParameters;
+
+/* parse the sync frames in an audio packet, accumulating what they tell us in 'params'.
+ * Returns zero if at least one sync frame was recognised */
+int parseAudioParameters( tAudioCodec codec, const uint8_t * data, size_t size, tAudioParameters * params );
+
+/* map a channel count and LFE flag on to the nearest tChannelLayout */
+tChannelLayout audioLayout( const tAudioParameters * params );
+
+#endif //AVCP_AUDIOPARSE_H
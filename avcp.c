@@ -4,7 +4,7 @@
 	Copyright (c) 2019, Paul Chambers, All rights reserved.
 */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -15,17 +15,59 @@
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
+
+#include <libavutil/error.h>
 
 #include "argtable3.h"  /* used to parse command line options */
 
 #include "avcp.h"
 #include "filemediainfo.h"
+#include "fileops.h"
+#include "filestat.h"
+#include "filetable.h"
+#include "inodemap.h"
+#include "placement.h"
+#include "prefilter.h"
+#include "plan.h"
+#include "probecache.h"
+#include "probepool.h"
+#include "reaper.h"
+#include "recording.h"
+#include "reorder.h"
+#include "scheduler.h"
+#include "throttle.h"
+#include "tsscan.h"
 
 const char * gExecutableName;
 
-static tFileInfo * gFileInfoRoot = NULL;
-static tFileInfo * gTarget       = NULL;
+/* how far ahead of the next line due out a listing may get, when probes complete out of order */
+#define kReorderWindow  1024
+
+/* how many worker processes run the probes: one per CPU, or --jobs if that's more, within these */
+#define kMinProbeWorkers    4
+#define kMaxProbeWorkers    64
+
+/* the longest a probe may take over one file, in seconds, unless --deadline says otherwise */
+#define kProbeDeadline      60
+
+/* in the background, the most read per second, in MB, unless --read-limit says otherwise */
+#define kBackgroundLimit    32
+
+/* how many of the planned changes are made at once, unless --jobs says otherwise */
+#define kPlanWorkers        8
+
+/* files still being written are looked at again every so often, until they settle or this runs out */
+#define kDeferInterval      10
+#define kSettleSeconds      30
+
+static tFileTable * gFileTable = NULL;  /* written by the workers, under gResultLock */
+static tReorder   * gReorder   = NULL;   /* lsmode writes each line as soon as it can */
+static tFileInfo  * gTarget    = NULL;
+
+static pthread_mutex_t gResultLock = PTHREAD_MUTEX_INITIALIZER;
 
 typedef enum { lsmode, lnmode, cpmode } tAppMode;
 
@@ -33,10 +75,29 @@ typedef enum { lsmode, lnmode, cpmode } tAppMode;
 struct {
     const char * myName;
     tAppMode     mode;
+    unsigned int columns;       ///> tColumn flags, for a listing
+    unsigned int attributes;    ///> tAttribute flags, what the probe has to find out
     struct arg_lit  * help;
     struct arg_lit  * version;
     struct arg_lit  * link;
     struct arg_lit  * delete;
+    struct arg_lit  * scanErrors;
+    struct arg_lit  * noCache;
+    struct arg_lit  * noHint;
+    struct arg_lit  * timing;
+    struct arg_int  * jobs;
+    struct arg_lit  * physicalOrder;
+    struct arg_lit  * noIsolate;
+    struct arg_int  * prefetch;
+    struct arg_int  * deadline;
+    struct arg_lit  * retry;
+    struct arg_lit  * background;
+    struct arg_int  * readLimit;
+    struct arg_int  * settle;
+    struct arg_lit  * follow;
+    struct arg_lit  * dryRun;
+    struct arg_str  * language;
+    struct arg_str  * columnList;
     struct arg_file * config;
     struct arg_file * target;
     struct arg_file * file;
@@ -91,17 +152,34 @@ int checkTarget( const char * filename )
     {
         result = 0;
 
-        gTarget->next = NULL;
         gTarget->name = filename;
+        gTarget->fd   = -1;
 
-        if ( stat( filename, &gTarget->stat ) == 0 )
+        errno = statFile( AT_FDCWD, filename, &gTarget->stat );
+        if ( errno == 0 )
         {
-            /* file exists, see if we can write to it */
-            result = access( filename, W_OK );
+            /* file exists, see if we can write to it. If it's ours and has owner write
+             * permission, the mode bits already say so, without asking again */
+            if ( gTarget->stat.owner != geteuid() || (gTarget->stat.mode & S_IWUSR) == 0 )
+            {
+                result = access( filename, W_OK );
+            }
             if ( result != 0 )
             {
                 errorf( "unable to write to \'%s\'", filename );
             }
+            else if ( S_ISREG( gTarget->stat.mode ))
+            {
+                /* we'll need to know how good it is, to decide if it should be replaced */
+                probeMedia( gTarget, NULL, stageStreams, attrAll );
+                gTarget->stage = stageComplete;     /* the target isn't scanned for errors */
+                if ( gTarget->stat.links > 1 )
+                {
+                    /* a source that's another name for the target needn't be probed again */
+                    claimInode( gTarget, stageComplete );
+                    publishInode( gTarget );
+                }
+            }
         }
         else
         {
@@ -129,64 +207,350 @@ int checkTarget( const char * filename )
     return result;
 }
 
+/* the directory the previous file was in, kept open so files can be opened relative to it */
+static _Thread_local struct {
+    char * path;
+    int    fd;
+} gParent = { NULL, -1 };       /* one per worker thread */
+
+static void closeParent( void )
+{
+    if ( gParent.fd >= 0 )
+    {
+        close( gParent.fd );
+    }
+    free( gParent.path );
+    gParent.path = NULL;
+    gParent.fd   = -1;
+}
+
+/**
+ * @brief open a file relative to its parent directory, which stays open for the next file. Files
+ * are usually grouped by directory, so most of them only need their last path element resolved.
+ * @return the descriptor, or -1 with errno set
+ */
+static int openFile( const char * path )
+{
+    const int flags = O_RDONLY | O_NONBLOCK | O_CLOEXEC;    /* O_NONBLOCK, in case it's a FIFO */
+
+    const char * slash = strrchr( path, '/' );
+    if ( slash == NULL )
+    {
+        return openat( AT_FDCWD, path, flags );
+    }
+
+    size_t length = (slash == path) ? 1 : (size_t)(slash - path);     /* keep the slash of "/" */
+    if ( gParent.path == NULL || strncmp( gParent.path, path, length ) != 0 || gParent.path[length] != '\0' )
+    {
+        char * directory = strndup( path, length );
+        if ( directory == NULL )
+        {
+            return -1;
+        }
+
+        int fd = open( directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+        if ( fd < 0 )
+        {
+            int error = errno;
+            free( directory );
+            errno = error;
+            return -1;
+        }
+
+        closeParent();
+        gParent.path = directory;
+        gParent.fd   = fd;
+    }
+    return openat( gParent.fd, slash + 1, flags );
+}
+
+/* --timing: how long files took to process, split by how they were opened */
+typedef enum { timingHinted, timingProbed, timingSkipped, timingShared, timingCount } tTimingClass;
+
+static const char * timingClassNames[] =
+    {
+        [timingHinted]  = "opened with a format hint",
+        [timingProbed]  = "probed for their format",
+        [timingSkipped] = "not media",
+        [timingShared]  = "shared with another name for the same file"
+    };
+
+static struct {
+    unsigned long count;
+    double        seconds;
+} gTiming[timingCount];
+
+static void recordTiming( const tFileInfo * file, int shared, time_t seconds, long nanoseconds )
+{
+    tTimingClass class = timingSkipped;
+    double elapsed = seconds + nanoseconds / 1e9;
+
+    if ( shared )
+    {
+        class = timingShared;
+    }
+    else if ( file->container.stream.count > 0 )
+    {
+        class = file->container.hinted ? timingHinted : timingProbed;
+    }
+    pthread_mutex_lock( &gResultLock );
+    ++gTiming[class].count;
+    gTiming[class].seconds += elapsed;
+    pthread_mutex_unlock( &gResultLock );
+
+    fprintf( stderr, "%9.3f ms  %-6s  %s\n", elapsed * 1000,
+             (class == timingHinted) ? "hinted" : (class == timingProbed) ? "probed"
+                 : (class == timingShared) ? "shared" : "-", file->name );
+}
+
+static void reportTiming( void )
+{
+    for ( tTimingClass class = 0; class < timingCount; ++class )
+    {
+        if ( gTiming[class].count > 0 )
+        {
+            fprintf( stderr, "%lu files %s, averaging %.3f ms each\n", gTiming[class].count,
+                     timingClassNames[class], gTiming[class].seconds * 1000 / gTiming[class].count );
+        }
+    }
+    /* and what each group of attributes (and so each column of a listing) cost */
+    reportProbeCost( stderr );
+#ifndef NDEBUG
+    fprintf( stderr, "%lu allocations made by the probes\n", probeAllocations() );
+#endif
+}
+
+/* what a worker needs to know to process a file */
+typedef struct {
+    unsigned long sequence;
+    const char  * filename;
+    tFileStat     stat;
+    int           statResult;
+    int           fd;           ///> opened by the prefetch, if it's been done
+    tProbeStage   reached;      ///> how far it's already been examined, in an earlier round
+    tProbeStage   stage;        ///> how far to take it this time
+    int           settled;      ///> was deferred, and has since been seen not to change
+} tFileJob;
 
-int processFile( const char * filename )
+/* a file put off because it was still being written, to be looked at again later */
+typedef struct {
+    unsigned long sequence;
+    const char  * filename;
+    tFileStat     stat;
+} tDeferred;
+
+/* written by the workers, under gResultLock */
+static struct {
+    tDeferred   * file;
+    unsigned long count;
+    unsigned long size;
+} gDeferred;
+
+/* a source copied (or linked) beside the target as it was recorded, by --follow. Empty if none */
+static char          gStaged[PATH_MAX] = "";
+
+/* a listing takes files as they are, so its lines stay in the order they were given */
+static int           gDeferring  = 0;
+
+/**
+ * @brief put off examining a file that's still being written
+ * @return non-zero if it was, zero if it has to be examined now after all
+ */
+static int deferFile( unsigned long sequence, const char * filename, const tFileStat * stat )
+{
+    int deferred = 0;
+
+    pthread_mutex_lock( &gResultLock );
+    if ( gDeferred.count >= gDeferred.size )
+    {
+        unsigned long size = (gDeferred.size == 0) ? 16 : gDeferred.size * 2;
+        tDeferred * file = realloc( gDeferred.file, size * sizeof( tDeferred ));
+        if ( file != NULL )
+        {
+            gDeferred.file = file;
+            gDeferred.size = size;
+        }
+    }
+    if ( gDeferred.count < gDeferred.size )
+    {
+        tDeferred * entry = &gDeferred.file[ gDeferred.count++ ];
+        entry->sequence = sequence;
+        entry->filename = filename;
+        entry->stat     = *stat;
+        deferred = 1;
+    }
+    pthread_mutex_unlock( &gResultLock );
+
+    return deferred;
+}
+
+/* the record each file is examined into, kept for the thread's next file */
+static _Thread_local tFileInfo * gScratch = NULL;
+
+/**
+ * @brief release what a worker thread kept between files, as it finishes
+ */
+static void finishWorker( void )
+{
+    closeParent();
+    releaseProbeContext();
+    free( gScratch );
+    gScratch = NULL;
+}
+
+int processFile( const tFileJob * job )
 {
     int result = -1;
+    unsigned long sequence = job->sequence;
+    const char *  filename = job->filename;
 
     struct timespec start, stop;
+    const char * format = NULL;
+    tInodeClaim  claim  = inodeClaimed;
+    int          deferred = 0;
 
-    tFileInfo * file = calloc( 1, sizeof(tFileInfo) );
+    /* only a compact summary is kept once the file has been probed, so a scratch record will do */
+    if ( gScratch == NULL )
+    {
+        gScratch = malloc( sizeof(tFileInfo) );
+    }
+    tFileInfo * file = gScratch;
     if ( file != NULL )
     {
-        clock_gettime( CLOCK_REALTIME, &start );
+        memset( file, 0, sizeof(tFileInfo) );
+        clock_gettime( CLOCK_MONOTONIC, &start );
 
-        file->next = NULL;
+        /* the metadata was collected beforehand, in a batch with its neighbours */
         file->name = filename;
-        if ( stat( filename, &file->stat ) == 0 )
+        file->fd   = job->fd;   /* already open, if it was prefetched */
+        if ( job->statResult == 0 )
         {
+            file->stat = job->stat;
             result = 0;
         }
         else
         {
-            switch ( errno )
+            errno = job->statResult;
+            switch ( job->statResult )
             {
             case ENOENT:
                 errorf( "file \'%s\' is missing\n", filename );
                 result = 0;
                 break;
 
+            case EACCES:
+                errorf( "unable to read \'%s\'", filename );
+                result = 0;
+                break;
+
             default:
                 errorf( "unable to get info about \'%s\'", filename );
                 break;
             }
         }
 
-        if ( S_ISREG( file->stat.st_mode ))
+        if ( S_ISREG( file->stat.mode ))
         {
-            processMediaInfo( file );
-            // printMediaInfo( file );
-            // dumpMediaInfo( file );
+            if ( file->stat.links > 1 )
+            {
+                /* hardlinked, so it may already have been examined under another name */
+                claim = claimInode( file, job->stage );
+            }
 
-            tFileInfo * p = gFileInfoRoot;
-            if ( p == NULL)
+            if ( claim == inodeShared )
             {
-                gFileInfoRoot = file;
+                debugf( "'%s' is another name for a file already examined", filename );
+            }
+            /* don't spend a full probe on files that can't be media; their stream count stays zero */
+            else if ( isKnownNonMedia( &file->stat ))
+            {
+                /* no need to even open it */
+                debugf( "skipping '%s', already known not to be media", filename );
+                file->stage = stageComplete;
+            }
+            else if ( file->fd < 0 && (file->fd = openFile( filename )) < 0 )
+            {
+                /* open it once, and do everything else through the descriptor */
+                errorf( "unable to open \'%s\'", filename );
+                file->stage = stageComplete;
+            }
+            else if ( job->reached == stageNone && gDeferring
+                   && isBeingWritten( file->fd, &file->stat, job->settled )
+                   && deferFile( sequence, filename, &file->stat ))
+            {
+                /* probing it now would waste the I/O, and get the duration wrong */
+                debugf( "'%s' is still being written, so it'll be looked at later", filename );
+                deferred = 1;
+            }
+            else if ( job->reached >= stageStreams )
+            {
+                /* already probed in full in an earlier round; only the error scan is left */
+                int fd = file->fd;
+                pthread_mutex_lock( &gResultLock );
+                getFileInfo( gFileTable, sequence, file );
+                pthread_mutex_unlock( &gResultLock );
+                file->name = filename;
+                file->fd   = fd;
+            }
+            else if ( classifyFile( file->fd, filename, &format ) == contentNotMedia )
+            {
+                rememberNonMedia( &file->stat );
+                file->stage = stageComplete;
             }
             else
             {
-                while ( p != NULL && p->next != NULL)
+                /* nothing in the file itself to go on, so guess from its neighbours */
+                if ( format == NULL )
+                {
+                    format = directoryFormat( filename );
+                }
+                if ( gOption.noHint->count > 0 )
+                {
+                    format = NULL;
+                }
+
+                /* the error scan is a separate stage, so at most a full probe here */
+                tProbeStage stage = (job->stage > stageStreams) ? stageStreams : job->stage;
+                int probed = probeMedia( file, format, stage, gOption.attributes );
+                if ( probed == AVERROR_INVALIDDATA )
+                {
+                    /* ffmpeg doesn't recognise it, so there's no point in asking it again. One
+                     * that crashed the probe (kProbeCrashed) isn't remembered; a later ffmpeg may
+                     * cope. Nor is one that ran out of time (kProbeTimedOut); the disk may be faster */
+                    rememberNonMedia( &file->stat );
+                }
+                else if ( file->container.name.brief != NULL
+                       && (file->stage >= stageStreams || !file->container.hinted) )
+                {
+                    /* only once it's confirmed; a hinted header read takes the hint's word for it */
+                    learnDirectoryFormat( filename, file->container.name.brief );
+                }
+            }
+
+            /* only transport streams carry the continuity counters and PCRs we need */
+            if ( claim == inodeClaimed && file->stage == stageStreams )
+            {
+                if ( gOption.scanErrors->count == 0 || file->container.name.brief == NULL
+                  || strcmp( file->container.name.brief, "mpegts" ) != 0 )
                 {
-                    p = p->next;
+                    file->stage = stageComplete;    /* won't be scanned */
                 }
-                if ( p != NULL)
+                else if ( job->stage >= stageComplete )
                 {
-                    p->next = file;
+                    scanTransportStream( file );
+                    file->stage = stageComplete;
                 }
             }
+            // dumpMediaInfo( file );
+
+            if ( claim == inodeClaimed && file->stat.links > 1 )
+            {
+                /* before anything that might wait on the other names' progress */
+                publishInode( file );
+            }
         }
 
-        clock_gettime( CLOCK_REALTIME, &stop );
+        clock_gettime( CLOCK_MONOTONIC, &stop );
         if ( stop.tv_nsec < start.tv_nsec )
         {
             /* add a second to the nano part */
@@ -196,18 +560,385 @@ int processFile( const char * filename )
             stop.tv_sec  -= 1;
         }
 
-        file->duration.tv_nsec = stop.tv_nsec - start.tv_nsec;
-        file->duration.tv_sec  = stop.tv_sec  - start.tv_sec;
+        if ( gOption.timing->count > 0 )
+        {
+            recordTiming( file, claim == inodeShared, stop.tv_sec - start.tv_sec, stop.tv_nsec - start.tv_nsec );
+        }
+
+        if ( gOption.mode == lsmode )
+        {
+            /* nothing to rank, so list it and let it go, rather than hold on to it */
+            char line[PATH_MAX + 128];
+
+            if ( S_ISREG( file->stat.mode ))
+            {
+                formatMediaInfo( file, gOption.columns, line, sizeof( line ));
+                reorderSubmit( gReorder, sequence, line );
+            }
+            else
+            {
+                /* no listing for this one, but don't hold up the ones that follow */
+                reorderSubmit( gReorder, sequence, NULL );
+            }
+        }
+        else if ( S_ISREG( file->stat.mode ) && !deferred )
+        {
+            pthread_mutex_lock( &gResultLock );
+            int stored = storeFile( gFileTable, sequence, file );
+            pthread_mutex_unlock( &gResultLock );
+
+            if ( stored != 0 )
+            {
+                errorf( "unable to record \'%s\'", filename );
+                result = stored;
+            }
+        }
+
+        if ( file->fd >= 0 )
+        {
+            close( file->fd );
+        }
+    }
+    else
+    {
+        errno = ENOMEM;
+        errorf( "unable to examine '%s'", filename );
+        result = ENOMEM;
+
+        if ( job->fd >= 0 )
+        {
+            close( job->fd );
+        }
+        if ( gOption.mode == lsmode )
+        {
+            /* the lines after this one are waiting on it */
+            reorderSubmit( gReorder, sequence, NULL );
+        }
+    }
+    return result;
+}
+
+/* how much of the start of each file to ask for ahead of time. That's enough for the headers,
+ * and for avformat_find_stream_info() to find its first packets */
+#define kPrefetchBytes  (4 * 1024 * 1024)
+/* how many files ahead to prefetch, by default */
+#define kPrefetchDepth  4
+
+static int runFileJob( void * job )
+{
+    tFileJob * fileJob = job;
+
+    int result = processFile( fileJob );
+    free( fileJob );
+    return result;
+}
+
+/**
+ * @brief open a file that's coming up, and ask the kernel to start reading its first few MB
+ * into the page cache. The job keeps the descriptor, so the file is still only opened once
+ */
+static void prefetchFileJob( void * job )
+{
+    tFileJob * fileJob = job;
+
+    if ( fileJob->statResult == 0 && S_ISREG( fileJob->stat.mode ) && fileJob->fd < 0
+      && !isKnownNonMedia( &fileJob->stat ))
+    {
+        fileJob->fd = openFile( fileJob->filename );
+        if ( fileJob->fd >= 0 )
+        {
+            /* starts the reads, but doesn't wait for them */
+            posix_fadvise( fileJob->fd, 0, kPrefetchBytes, POSIX_FADV_WILLNEED );
+        }
+    }
+}
+
+/**
+ * @brief start the workers for a round of examining files
+ */
+static tScheduler * startScheduler( unsigned int jobs )
+{
+    tScheduler * scheduler = newScheduler( runFileJob, finishWorker, jobs, gOption.physicalOrder->count > 0 );
+    if ( scheduler != NULL )
+    {
+        /* while a file is examined, the next few are read in */
+        unsigned int depth = kPrefetchDepth;
+        if ( gOption.prefetch->count > 0 )
+        {
+            depth = gOption.prefetch->ival[0];
+        }
+        else if ( gOption.background->count > 0 || gOption.readLimit->count > 0 )
+        {
+            depth = 0;  /* read-ahead the kernel does for us can't be held to the limit */
+        }
+        setPrefetch( scheduler, prefetchFileJob, depth );
+    }
+    return scheduler;
+}
+
+/**
+ * @brief queue a file to be examined, from the stage it 'reached' in an earlier round, as far as 'stage'
+ */
+static int queueFile( tScheduler * scheduler, unsigned long sequence, const char * filename,
+                      const tFileStat * stat, int statResult, tProbeStage reached, tProbeStage stage,
+                      int settled )
+{
+    tFileJob * job = malloc( sizeof( tFileJob ));
+    if ( job == NULL )
+    {
+        return ENOMEM;
+    }
+    job->sequence   = sequence;
+    job->filename   = filename;
+    job->stat       = *stat;
+    job->statResult = statResult;
+    job->fd         = -1;
+    job->reached    = reached;
+    job->stage      = stage;
+    job->settled    = settled;
+
+    /* a file that couldn't be stat'd has no device, so it goes in device zero's queue */
+    dev_t    device   = (statResult == 0) ? stat->device : 0;
+    uint64_t position = 0;
+    if ( statResult == 0 && S_ISREG( stat->mode ) && isOrderedDevice( scheduler, device ))
+    {
+        /* if the filesystem can't say, it's just taken in turn with the rest */
+        physicalOffset( filename, &position );
+    }
+
+    int result = scheduleJob( scheduler, device, sequence, position, job );
+    if ( result != 0 )
+    {
+        free( job );
+    }
+    return result;
+}
+
+/**
+ * @brief whether file 'i' can no longer be the one put in place: something is known to be better,
+ * or as good and ahead of it (the target, or an earlier file, wins a tie)
+ */
+static int isOutranked( const tFileInfo * info, const unsigned char * present, unsigned long count, unsigned long i )
+{
+    int decided;
+
+    if ( S_ISREG( gTarget->stat.mode ) && compareStaged( gTarget, &info[i], &decided ) >= 0 && decided )
+    {
+        return 1;
+    }
+    for ( unsigned long j = 0; j < count; ++j )
+    {
+        if ( present[j] && j != i )
+        {
+            int diff = compareStaged( &info[j], &info[i], &decided );
+            if ( decided && (diff > 0 || (diff == 0 && j < i)) )
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief whether file 'i' has to be examined further before it can be ranked against the others
+ */
+static int isUndecided( const tFileInfo * info, const unsigned char * present, unsigned long count, unsigned long i )
+{
+    int decided = 1;
+
+    if ( info[i].stage >= stageComplete )
+    {
+        return 0;
+    }
+    /* examining it further won't settle a comparison with one whose probe gave up */
+    if ( S_ISREG( gTarget->stat.mode ) && gTarget->failure == failNone )
+    {
+        compareStaged( gTarget, &info[i], &decided );
+    }
+    for ( unsigned long j = 0; j < count && decided; ++j )
+    {
+        if ( present[j] && j != i && info[j].failure == failNone )
+        {
+            compareStaged( &info[j], &info[i], &decided );
+        }
+    }
+    return !decided;
+}
+
+/**
+ * @brief look again at the files put off because they were still being written, every
+ * kDeferInterval seconds, until they've settled or --settle runs out. Any that never settle are
+ * left out of the ranking
+ * @return zero, or an errno
+ */
+static int examineDeferred( unsigned int jobs, tProbeStage stage )
+{
+    int result = 0;
+    unsigned int waited = 0;
+    unsigned int settle = (gOption.settle->count > 0) ? (unsigned int)gOption.settle->ival[0] : kSettleSeconds;
+
+    while ( gDeferred.count > 0 && result == 0 )
+    {
+        /* the workers start a fresh list with any that are deferred again */
+        tDeferred   * list  = gDeferred.file;
+        unsigned long count = gDeferred.count;
+        memset( &gDeferred, 0, sizeof( gDeferred ));
+
+        if ( waited >= settle )
+        {
+            for ( unsigned long i = 0; i < count; ++i )
+            {
+                fprintf( stderr, "### '%s' is still being written, so it's been left out\n", list[i].filename );
+            }
+            free( list );
+            break;
+        }
+        unsigned int interval = ( settle - waited < kDeferInterval ) ? settle - waited : kDeferInterval;
+        debugf( "%lu files still being written, looking again in %u seconds", count, interval );
+        sleep( interval );
+        waited += interval;
+
+        tScheduler * scheduler = startScheduler( jobs );
+        if ( scheduler == NULL )
+        {
+            result = ENOMEM;
+        }
+        for ( unsigned long i = 0; i < count && result == 0; ++i )
+        {
+            tFileStat stat;
+            int statResult = statFile( AT_FDCWD, list[i].filename, &stat );
+            int settled    = ( statResult == 0 && !hasChanged( &list[i].stat, &stat ));
+
+            if ( statResult == 0 && !settled && deferFile( list[i].sequence, list[i].filename, &stat ))
+            {
+                /* it grew since last time, so there's no need to open it to know */
+                continue;
+            }
+            result = queueFile( scheduler, list[i].sequence, list[i].filename, &stat, statResult,
+                                stageNone, stage, settled );
+        }
+        if ( scheduler != NULL )
+        {
+            int finished = finishScheduler( scheduler );
+            if ( result == 0 )
+            {
+                result = finished;
+            }
+        }
+        free( list );
     }
     return result;
 }
 
+/**
+ * @brief find the file that should be put in place, examining the files a stage at a time -
+ * header, full probe, then error scan - and taking only those still in the running to the next.
+ * Often the cheap stages settle it; a 480p MPEG-2 source against a 1080p HEVC destination needs
+ * no more than the headers
+ * @return zero, or an errno. 'winner' is the table index of the best, or -1 if none beat the target
+ */
+static int rankFiles( unsigned int jobs, long * winner )
+{
+    int result = 0;
+    unsigned long count = fileCount( gFileTable );
+
+    *winner = -1;
+
+    /* the table only keeps a compact summary, so rank using scratch records */
+    tFileInfo     * info    = malloc( count * sizeof( tFileInfo ) + 1 );
+    unsigned char * present = malloc( count + 1 );
+    if ( info == NULL || present == NULL )
+    {
+        free( info );
+        free( present );
+        return ENOMEM;
+    }
+
+    do {
+        for ( unsigned long i = 0; i < count; ++i )
+        {
+            present[i] = (getFileInfo( gFileTable, i, &info[i] ) == 0);   /* not if it's not a regular file */
+        }
+        /* only those that could still win are worth examining further. Anything outranked stays
+         * 'present', as it may still rule out others */
+        unsigned char * running = malloc( count + 1 );
+        if ( running == NULL )
+        {
+            result = ENOMEM;
+            break;
+        }
+        unsigned long undecided = 0;
+        for ( unsigned long i = 0; i < count; ++i )
+        {
+            running[i] = present[i] && !isOutranked( info, present, count, i );
+        }
+        for ( unsigned long i = 0; i < count; ++i )
+        {
+            if ( running[i] && isUndecided( info, running, count, i ))
+            {
+                running[i] = 2;
+                ++undecided;
+            }
+            else if ( running[i] && info[i].failure == failNone )
+            {
+                /* one whose probe gave up stays in the running, but can't be put in place */
+                *winner = i;
+            }
+        }
+
+        if ( undecided > 0 )
+        {
+            debugf( "%lu files still in the running, examining them further", undecided );
+            *winner = -1;
+
+            tScheduler * scheduler = startScheduler( jobs );
+            if ( scheduler == NULL )
+            {
+                result = ENOMEM;
+            }
+            for ( unsigned long i = 0; i < count && result == 0; ++i )
+            {
+                if ( running[i] == 2 )
+                {
+                    result = queueFile( scheduler, i, info[i].name, &info[i].stat, 0,
+                                        info[i].stage, info[i].stage + 1, 0 );
+                }
+            }
+            if ( scheduler != NULL )
+            {
+                int finished = finishScheduler( scheduler );
+                if ( result == 0 )
+                {
+                    result = finished;
+                }
+            }
+        }
+        free( running );
+
+        if ( undecided == 0 )
+        {
+            break;
+        }
+    } while ( result == 0 );
+
+    free( info );
+    free( present );
+    return result;
+}
+
 int main( int argc, char *argv[] )
 {
     int result = 0;
 
     initMediaInfo();
 
+    gFileTable = newFileTable();
+    if ( gFileTable == NULL )
+    {
+        return ENOMEM;
+    }
+
     gOption.myName = strrchr( argv[0], '/' );
     /* If we found a slash, increment past it. If there's no slash, point at the full argv[0] */
     if ( gOption.myName++ == NULL)
@@ -236,6 +967,57 @@ int main( int argc, char *argv[] )
 
         gOption.delete  = arg_litn( "d", "delete", 0, 1, "remove the files that didn't win" ),
 
+        gOption.scanErrors = arg_litn( NULL, "scan-errors", 0, 1,
+                                       "read all of each transport stream, looking for reception errors" ),
+
+        gOption.noCache = arg_litn( NULL, "no-cache", 0, 1,
+                                    "neither use nor update the record of files known not to be media" ),
+
+        gOption.noHint = arg_litn( NULL, "no-hint", 0, 1,
+                                   "have ffmpeg probe every file for its format, rather than guessing it first" ),
+
+        gOption.timing = arg_litn( NULL, "timing", 0, 1,
+                                   "report how long each file took to examine, and the averages" ),
+
+        gOption.jobs = arg_intn( "j", "jobs", "<n>", 0, 1,
+                                 "files to examine at once on each device (default: 1 for a spinning disk, 4 for an SSD, 8 for a network share)" ),
+
+        gOption.physicalOrder = arg_litn( NULL, "physical-order", 0, 1,
+                                          "on spinning disks, examine files in the order they're laid out on the disk" ),
+
+        gOption.noIsolate = arg_litn( NULL, "no-isolate", 0, 1,
+                                      "examine files in this process, rather than in separate worker processes" ),
+
+        gOption.prefetch = arg_intn( NULL, "prefetch", "<n>", 0, 1,
+                                     "start reading the next <n> files while one is examined (default: 4, 0 is off)" ),
+
+        gOption.deadline = arg_intn( NULL, "deadline", "<seconds>", 0, 1,
+                                     "give up on a file that takes longer than this to examine (default: 60, 0 is no limit)" ),
+
+        gOption.retry = arg_litn( NULL, "retry", 0, 1,
+                                  "examine a file that ran out of time once more, in a different worker" ),
+
+        gOption.dryRun = arg_litn( "n", "dry-run", 0, 1,
+                                   "list what would be linked, copied and removed, without doing it" ),
+
+        gOption.follow = arg_litn( NULL, "follow", 0, 1,
+                                   "copy a source that's still being recorded as it's written, so it's in place moments after it finishes" ),
+
+        gOption.settle = arg_intn( NULL, "settle", "<seconds>", 0, 1,
+                                   "how long to wait for files still being written to finish (default: 30)" ),
+
+        gOption.background = arg_litn( NULL, "background", 0, 1,
+                                       "stay out of the way of other disk users: idle I/O priority, a read limit, and backing off under pressure" ),
+
+        gOption.readLimit = arg_intn( NULL, "read-limit", "<MB/s>", 0, 1,
+                                      "in the background, read no more than this (default: 32). Implies --background" ),
+
+        gOption.language = arg_strn( NULL, "language", "<code>", 0, 1,
+                                     "prefer audio in this language, e.g. 'eng' (the default)" ),
+
+        gOption.columnList = arg_strn( NULL, "columns", "<list>", 0, 1,
+                                       "list only these columns, e.g. 'duration,height'" ),
+
         gOption.target = arg_filen( "t", "target", "<file>", 0, 1,
                                 "specify a destination file." ),
 
@@ -282,6 +1064,95 @@ int main( int argc, char *argv[] )
             gOption.mode = lnmode;
         }
 
+        if ( gOption.language->count > 0 && setPreferredLanguage( gOption.language->sval[0] ) != 0 )
+        {
+            fprintf( stderr, "Error: %s- unrecognized language '%s'\n", gOption.myName, gOption.language->sval[0] );
+            result = 1;
+        }
+
+        /* ranking needs everything; a listing only what it shows */
+        gOption.columns    = columnAll;
+        gOption.attributes = attrAll;
+        if ( gOption.columnList->count > 0 )
+        {
+            if ( parseColumns( gOption.columnList->sval[0], &gOption.columns ) != 0 )
+            {
+                fprintf( stderr, "Error: %s- unrecognized column in '%s'\n", gOption.myName, gOption.columnList->sval[0] );
+                result = 1;
+            }
+            else if ( gOption.mode == lsmode )
+            {
+                gOption.attributes = columnAttributes( gOption.columns );
+            }
+        }
+        if ( gOption.scanErrors->count == 0 )
+        {
+            gOption.columns &= ~columnErrors;   /* nothing to fill it with */
+        }
+        setErrorScan( gOption.scanErrors->count > 0 );
+        if ( gOption.timing->count > 0 )
+        {
+            measureProbeCost();
+        }
+
+        /* set before the workers are forked, so they inherit it */
+        setProbeDeadline( kProbeDeadline );
+        if ( gOption.deadline->count > 0 )
+        {
+            if ( gOption.deadline->ival[0] < 0 )
+            {
+                fprintf( stderr, "Error: %s- --deadline can't be negative\n", gOption.myName );
+                result = 1;
+            }
+            else
+            {
+                setProbeDeadline( gOption.deadline->ival[0] );
+            }
+        }
+        retryTimedOutProbes( gOption.retry->count > 0 );
+
+        if ( gOption.background->count > 0 || gOption.readLimit->count > 0 )
+        {
+            unsigned long limit = kBackgroundLimit;
+            if ( gOption.readLimit->count > 0 )
+            {
+                if ( gOption.readLimit->ival[0] < 1 )
+                {
+                    fprintf( stderr, "Error: %s- --read-limit must be at least 1\n", gOption.myName );
+                    result = 1;
+                }
+                limit = gOption.readLimit->ival[0];
+            }
+            /* like the deadline, before the workers are forked */
+            if ( result == 0 && startThrottle( limit * 1024 * 1024 ) != 0 )
+            {
+                errorf( "unable to limit the read rate" );
+            }
+        }
+
+        /* the probes run in worker processes, so one that crashes only takes that file with it.
+         * What forks them is started now, before there are any other threads */
+        if ( result == 0 && gOption.noIsolate->count == 0 )
+        {
+            long workers = sysconf( _SC_NPROCESSORS_ONLN );
+            if ( gOption.jobs->count > 0 && gOption.jobs->ival[0] > workers )
+            {
+                workers = gOption.jobs->ival[0];
+            }
+            if ( workers < kMinProbeWorkers )
+            {
+                workers = kMinProbeWorkers;
+            }
+            if ( workers > kMaxProbeWorkers )
+            {
+                workers = kMaxProbeWorkers;
+            }
+            if ( startProbePool( workers ) != 0 )
+            {
+                debugf( "unable to start the probe workers, so examining files in this process" );
+            }
+        }
+
         /* ls mode doesn't use a target */
         if ( gOption.mode == lsmode )
         {
@@ -289,7 +1160,13 @@ int main( int argc, char *argv[] )
             {
                 fprintf(stderr, "Error: %s- the -t option is not compatible with ls mode\n", gOption.myName);
             }
-        } else {
+
+            gReorder = newReorder( stdout, kReorderWindow );
+            if ( gReorder == NULL )
+            {
+                result = ENOMEM;
+            }
+        } else if ( result == 0 ) {
             if ( gOption.target->count > 0 )
             {
                 /* the destination file was provided explicitly by the user */
@@ -305,30 +1182,166 @@ int main( int argc, char *argv[] )
             result = checkTarget( target );
         }
 
-        for ( int i = 0; i < count && result == 0; i++ )
+        /* only worth the wait when ranking; a listing is of the files as they are */
+        gDeferring = ( gOption.mode != lsmode );
+
+        /* copy the recording as it's made, so once it's finished, only the ranking is left to do */
+        if ( result == 0 && gOption.follow->count > 0 )
+        {
+            if ( gOption.mode == lsmode || count != 1 )
+            {
+                fprintf( stderr, "Error: %s- --follow needs a single source file, and a destination\n", gOption.myName );
+                result = 1;
+            }
+            else if ( gOption.dryRun->count > 0 )
+            {
+                fprintf( stderr, "Error: %s- --follow makes its copy as it goes, so can't be a dry run\n", gOption.myName );
+                result = 1;
+            }
+            else if ( followFile( gOption.file->filename[0], target, gOption.mode == lnmode,
+                                  gStaged, sizeof( gStaged )) == 0 )
+            {
+                gDeferring = 0;     /* it's been waited for already */
+            }
+            else
+            {
+                gStaged[0] = '\0';
+            }
+        }
+
+        /* without it, every file is simply probed */
+        if ( gOption.noCache->count == 0 && openProbeCache() != 0 )
         {
-            result = processFile( gOption.file->filename[i] );
+            debugf( "unable to load the cache of non-media files" );
         }
 
-        tFileInfo * file = gFileInfoRoot;
-        if (gOption.mode == lsmode )
+        unsigned int jobs = 0;
+        if ( gOption.jobs->count > 0 )
+        {
+            if ( gOption.jobs->ival[0] < 1 )
+            {
+                fprintf( stderr, "Error: %s- --jobs must be at least 1\n", gOption.myName );
+                result = 1;
+            }
+            jobs = gOption.jobs->ival[0];
+        }
+        if ( gOption.prefetch->count > 0 && gOption.prefetch->ival[0] < 0 )
+        {
+            fprintf( stderr, "Error: %s- --prefetch can't be negative\n", gOption.myName );
+            result = 1;
+        }
+        if ( gOption.settle->count > 0 && gOption.settle->ival[0] < 0 )
+        {
+            fprintf( stderr, "Error: %s- --settle can't be negative\n", gOption.myName );
+            result = 1;
+        }
+
+        /* a listing needs everything up front. Ranking starts with the headers, and only takes
+         * the files that are still in the running any further */
+        tProbeStage firstStage = (gOption.mode == lsmode) ? stageComplete : stageHeader;
+
+
+        /* each device gets its own queue, and workers to suit it */
+        tScheduler * scheduler = NULL;
+        if ( result == 0 )
         {
-            while ( file != NULL)
+            scheduler = startScheduler( jobs );
+            if ( scheduler == NULL )
             {
-                printMediaInfo( file );
-                // dumpMediaInfo( file );
+                result = ENOMEM;
+            }
+        }
 
-                file = file->next;
+        /* collect the metadata a batch at a time, so the requests can be in flight together */
+        for ( int first = 0; first < count && result == 0; first += kStatBatchSize )
+        {
+            tFileStat    stats[kStatBatchSize];
+            int          statResults[kStatBatchSize];
+            unsigned int batch = count - first;
+            if ( batch > kStatBatchSize )
+            {
+                batch = kStatBatchSize;
+            }
+            statFiles( &gOption.file->filename[first], batch, stats, statResults );
+
+            for ( unsigned int i = 0; i < batch && result == 0; i++ )
+            {
+                result = queueFile( scheduler, first + i, gOption.file->filename[first + i],
+                                    &stats[i], statResults[i], stageNone, firstStage, 0 );
             }
         }
-        else
+        closeFileStat();
+
+        if ( scheduler != NULL )
         {
-            /* cpmode and lnmode only differ in the linking vs. copying choice */
+            int finished = finishScheduler( scheduler );
+            if ( result == 0 )
+            {
+                result = finished;
+            }
         }
+
+        if ( result == 0 )
+        {
+            result = examineDeferred( jobs, firstStage );
+        }
+        free( gDeferred.file );
+
+        long winner = -1;
+        if ( gOption.mode != lsmode && result == 0 )
+        {
+            result = rankFiles( jobs, &winner );
+        }
+
+        closeProbeCache();
+        stopProbePool();
+        freeInodeMap();
+        finishWorker();     /* the target was examined on this thread */
+
+        if ( gOption.timing->count > 0 )
+        {
+            reportTiming();
+        }
+        reportThrottle( stderr );
+
+        if (gOption.mode == lsmode )
+        {
+            /* each line has already been written as its probe completed */
+            freeReorder( gReorder );
+        }
+        else if ( result == 0 )
+        {
+            /* decide everything first, so it can be looked over (--dry-run) before any of it's done.
+             * cpmode and lnmode only differ in the linking vs. copying choice */
+            tPlan * plan = newPlan();
+            unsigned int flags = ( gOption.mode == lnmode ) ? placeLink : 0;
+            if ( gOption.delete->count > 0 )
+            {
+                flags |= placeRemove;
+            }
+            result = ( plan != NULL ) ? planPlacement( gFileTable, winner, gTarget, gStaged, flags, plan ) : ENOMEM;
+            if ( result == 0 && gOption.dryRun->count > 0 )
+            {
+                printPlan( plan, stdout );
+            }
+            else if ( result == 0 )
+            {
+                result = executePlan( plan, (jobs > 0) ? jobs : kPlanWorkers );
+            }
+            freePlan( plan );
+        }
+        if ( gStaged[0] != '\0' )
+        {
+            discardStaged( gStaged );   /* never got as far as placing it */
+        }
+
+        /* the losers are reclaimed in the background, a step at a time */
+        startReaper();
     }
 
     /* release each non-null entry in argtable[] */
     arg_freetable( argtable, sizeof(argtable) / sizeof(argtable[0]) );
+    freeFileTable( gFileTable );
 
     return result;
 }
@@ -0,0 +1,79 @@
+//
+// Minimal MSB-first bit reader, shared by the bitstream header parsers
+//
+
+#ifndef AVCP_BITREADER_H
+#define AVCP_BITREADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const uint8_t * data;
+    size_t          size;       /* in bytes */
+    size_t          position;   /* in bits */
+    int             overrun;    /* set if we tried to read beyond the end */
+} tBitReader;
+
+static inline unsigned int readBit( tBitReader * reader )
+{
+    if ( reader->position >= reader->size * 8 )
+    {
+        reader->overrun = 1;
+        return 0;
+    }
+    unsigned int bit = (reader->data[ reader->position / 8 ] >> (7 - (reader->position % 8))) & 1;
+    ++reader->position;
+    return bit;
+}
+
+static inline uint32_t readBits( tBitReader * reader, unsigned int count )
+{
+    uint32_t value = 0;
+    while ( count-- > 0 )
+    {
+        value = (value << 1) | readBit( reader );
+    }
+    return value;
+}
+
+static inline void skipBits( tBitReader * reader, size_t count )
+{
+    reader->position += count;
+    if ( reader->position > reader->size * 8 )
+    {
+        reader->overrun = 1;
+    }
+}
+
+/* Exp-Golomb coded unsigned integer, ue(v) */
+static inline uint32_t readUE( tBitReader * reader )
+{
+    unsigned int leadingZeros = 0;
+    while ( readBit( reader ) == 0 && !reader->overrun )
+    {
+        if ( ++leadingZeros > 31 )
+        {
+            reader->overrun = 1;
+            return 0;
+        }
+    }
+    return ((1U << leadingZeros) - 1) + readBits( reader, leadingZeros );
+}
+
+/* Exp-Golomb coded signed integer, se(v) */
+static inline int32_t readSE( tBitReader * reader )
+{
+    uint32_t value = readUE( reader );
+    return (value & 1) ? (int32_t)((value + 1) / 2) : -(int32_t)(value / 2);
+}
+
+static inline void initBitReader( tBitReader * reader, const uint8_t * data, size_t size )
+{
+    reader->data     = data;
+    reader->size     = size;
+    reader->position = 0;
+    reader->overrun  = 0;
+}
+
+#endif //AVCP_BITREADER_H
@@ -6,15 +6,39 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 /* note: libavformat-dev is a dependency */
 #include <libavformat/avformat.h>
 #include <libavutil/dict.h>
 #include <libavutil/error.h>
+#include <libavutil/dovi_meta.h>
+#include <libavutil/mastering_display_metadata.h>
 
 #include "avcp.h"
 #include "filemediainfo.h"
+#include "nalparse.h"
+#include "audioparse.h"
+#include "throttle.h"
+
+/* how many packets to examine at the start of the file, looking for in-band headers */
+#define kMaxProbePackets    32
+/* how many audio packets with recognisable sync frames are enough */
+#define kMaxAudioPackets    2
+
+/* the demuxers and codecs libavformat hands out are const from FFmpeg 5, but before that it
+ * wanted them back without the qualifier */
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+#define mutableFormat( format )     (format)
+#define mutableCodec( codec )       (codec)
+#else
+#define mutableFormat( format )     ((AVInputFormat *)(format))
+#define mutableCodec( codec )       ((AVCodec **)(codec))
+#endif
 
 const char * frameRateTypeNames[] =
                    {
@@ -32,9 +56,42 @@ const char * scanTypeNames[] =
 
 const char * profileNames[] =
                    {
-                           [profileLevelUknown] = "Unknown",
-                           [profileLevelMain]   = "Main",
-                           [profileLevelHigh]   = "High"
+                           [profileLevelUknown]   = "Unknown",
+                           [profileLevelBaseline] = "Baseline",
+                           [profileLevelMain]     = "Main",
+                           [profileLevelMain10]   = "Main 10",
+                           [profileLevelHigh]     = "High",
+                           [profileLevelHigh10]   = "High 10",
+                           [profileLevelHigh422]  = "High 4:2:2",
+                           [profileLevelHigh444]  = "High 4:4:4"
+                   };
+
+const char * chromaFormatNames[] =
+                   {
+                           [chromaUnknown] = "Unknown",
+                           [chroma400]     = "4:0:0",
+                           [chroma420]     = "4:2:0",
+                           [chroma422]     = "4:2:2",
+                           [chroma444]     = "4:4:4"
+                   };
+
+const char * dynamicRangeNames[] =
+                   {
+                           [dynamicRangeSDR]         = "SDR",
+                           [dynamicRangeHLG]         = "HLG",
+                           [dynamicRangeHDR10]       = "HDR10",
+                           [dynamicRangeHDR10Plus]   = "HDR10+",
+                           [dynamicRangeDolbyVision] = "Dolby Vision"
+                   };
+
+/* abbreviated, for the single line summary. SDR is the norm, so it's left blank */
+const char * dynamicRangeBriefNames[] =
+                   {
+                           [dynamicRangeSDR]         = "",
+                           [dynamicRangeHLG]         = "HLG",
+                           [dynamicRangeHDR10]       = "HDR10",
+                           [dynamicRangeHDR10Plus]   = "HDR+",
+                           [dynamicRangeDolbyVision] = "DoVi"
                    };
 
 const char * layoutNames[] =
@@ -76,8 +133,41 @@ const char * languageKeys[] =
                    };
 
 
+static tLanguage gPreferredLanguage = languageEnglish;
+
+/* the parts of processMediaInfo() that --timing reports on */
+typedef enum {
+    costOpen,
+    costStreams,
+    costVideo,
+    costColour,
+    costPackets,
+    costAudio,
+    costCount
+} tCost;
+
+/* running totals, kept in memory shared with the probe worker processes (see probepool.c), so
+ * what they add up is seen here too */
+typedef struct {
+    struct {
+        atomic_ulong  count;
+        atomic_ullong nanoseconds;
+    } cost[costCount];
+    atomic_ulong allocations;
+} tProbeTotals;
+
+static tProbeTotals   gLocalTotals;
+static tProbeTotals * gTotals = &gLocalTotals;
+
 int initMediaInfo( void )
 {
+    /* before any worker processes are forked, so they inherit it */
+    void * shared = mmap( NULL, sizeof( tProbeTotals ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( shared != MAP_FAILED )
+    {
+        gTotals = shared;   /* zeroed, like gLocalTotals */
+    }
+
     // initialise libavformat
     // deprecated: av_register_all();
 
@@ -88,11 +178,100 @@ int initMediaInfo( void )
     return 0;
 }
 
-void printMediaInfo( tFileInfo * file )
+/* the columns a listing can be limited to, and what each needs probed */
+static const struct {
+    const char * name;
+    unsigned int column;
+    unsigned int attributes;
+    unsigned int width;     ///> of a column's text, including the separator
+} columnTable[] =
+    {
+        { "duration",   columnDuration,   attrContainer,          9 },
+        { "bitrate",    columnBitrate,    attrContainer,          8 },
+        { "video",      columnVideo,      attrVideo,              6 },
+        { "resolution", columnResolution, attrVideo,             12 },
+        { "width",      columnResolution, attrVideo,             12 },
+        { "height",     columnResolution, attrVideo,             12 },
+        { "framerate",  columnFrameRate,  attrVideo,             10 },
+        { "range",      columnRange,      attrVideo | attrColour, 6 },
+        { "audio",      columnAudio,      attrAudio,              6 },
+        { "channels",   columnChannels,   attrAudio,              7 },
+        { "language",   columnLanguage,   attrAudio,             10 },
+        { "errors",     columnErrors,     0,                     12 },
+        { NULL,         0,                0,                      0 }
+    };
+
+int parseColumns( const char * list, unsigned int * columns )
+{
+    *columns = 0;
+    while ( *list != '\0' )
+    {
+        size_t length = strcspn( list, "," );
+        int i;
+        for ( i = 0; columnTable[i].name != NULL; ++i )
+        {
+            if ( strlen( columnTable[i].name ) == length && strncasecmp( columnTable[i].name, list, length ) == 0 )
+            {
+                *columns |= columnTable[i].column;
+                break;
+            }
+        }
+        if ( columnTable[i].name == NULL )
+        {
+            return -1;
+        }
+        list += length;
+        if ( *list == ',' )
+        {
+            ++list;
+        }
+    }
+    return 0;
+}
+
+unsigned int columnAttributes( unsigned int columns )
+{
+    unsigned int attributes = 0;
+    for ( int i = 0; columnTable[i].name != NULL; ++i )
+    {
+        if ( columns & columnTable[i].column )
+        {
+            attributes |= columnTable[i].attributes;
+        }
+    }
+    return attributes;
+}
+
+int formatMediaInfo( const tFileInfo * file, unsigned int columns, char * buffer, size_t size )
 {
     if ( file->container.stream.count == 0 )
     {
-        printf( "%58c %s\n", ' ', file->name );
+        /* line the name up with those of the media files */
+        int width = 0;
+        for ( int i = 0; columnTable[i].name != NULL; ++i )
+        {
+            if ( columns & columnTable[i].column )
+            {
+                width += columnTable[i].width;
+                columns &= ~columnTable[i].column;  /* the aliases share a column */
+            }
+        }
+        /* one whose probe gave up says so, where the columns would be */
+        const char * note = "";
+        switch ( file->failure )
+        {
+        case failCrashed:
+            note = "(probe crashed)  ";
+            break;
+
+        case failTimedOut:
+            note = "(timed out)  ";
+            break;
+
+        default:
+            break;
+        }
+        return snprintf( buffer, size, "%*s%s\n", width, note, file->name );
     }
     else
     {
@@ -134,22 +313,58 @@ void printMediaInfo( tFileInfo * file )
         seconds = file->container.duration % 60;
         minutes = (file->container.duration / 60) % 60;
         hours   = file->container.duration / (60 * 60);
-        printf( "%2u:%02u:%02u %6.3f  %-5.5s %4u x %-4u @ %-7s %-5.5s %-6s %-8.8s  %s\n",
-                hours, minutes, seconds,
-                file->container.bitrate / (float)1000000,
-                file->video.codec.name.brief,
-                file->video.width,
-                file->video.height,
-                fpsStr,
-                file->audio.codec.name.brief,
-                layoutNames[ file->audio.channel.layout ],
-                languageNames[ file->audio.language ],
-                /* file->duration.tv_sec,
-                   file->duration.tv_nsec/1000, */
-                file->name );
+
+        /* each column adds to the line, in turn */
+        size_t length = 0;
+#define appendColumn( column, ... ) \
+        if ( (columns & (column)) && length < size ) \
+        { \
+            length += snprintf( &buffer[length], size - length, __VA_ARGS__ ); \
+        }
+
+        appendColumn( columnDuration,   "%2u:%02u:%02u ", hours, minutes, seconds );
+        appendColumn( columnBitrate,    "%6.3f  ", file->container.bitrate / (float)1000000 );
+        appendColumn( columnVideo,      "%-5.5s ", file->video.codec.name.brief );
+        appendColumn( columnResolution, "%4u x %-4u ", file->video.width, file->video.height );
+        appendColumn( columnFrameRate,  "@ %-7s ", fpsStr );
+        appendColumn( columnRange,      "%-5.5s ", dynamicRangeBriefNames[ file->video.hdr.range ] );
+        appendColumn( columnAudio,      "%-5.5s ", file->audio.codec.name.brief );
+        appendColumn( columnChannels,   "%-6s ", layoutNames[ file->audio.channel.layout ] );
+        appendColumn( columnLanguage,   "%-8.8s  ", languageNames[ file->audio.language ] );
+        /* a file that wasn't scanned (not a transport stream) keeps the column lined up */
+        if ( file->errors.packets > 0 && file->errors.perMinute < 1000 * 1000 )
+        {
+            appendColumn( columnErrors, "%7.2f/min ", file->errors.perMinute / (float)1000 );
+        }
+        else if ( file->errors.packets > 0 )
+        {
+            /* no room for the fraction, and however badly damaged, no wider than the column */
+            unsigned long perMinute = file->errors.perMinute / 1000;
+            appendColumn( columnErrors, "%7lu/min ", (perMinute > 9999999) ? 9999999 : perMinute );
+        }
+        else
+        {
+            appendColumn( columnErrors, "%11s ", "-" );
+        }
+#undef appendColumn
+
+        /* the name always ends the line */
+        if ( length < size )
+        {
+            length += snprintf( &buffer[length], size - length, "%s\n", file->name );
+        }
+        return length;
     }
 }
 
+void printMediaInfo( tFileInfo * file )
+{
+    char line[PATH_MAX + 128];
+
+    formatMediaInfo( file, columnAll, line, sizeof( line ));
+    fputs( line, stdout );
+}
+
 void dumpMediaInfo( tFileInfo * file )
 {
     if ( file->container.stream.count == 0 )
@@ -192,6 +407,19 @@ void dumpMediaInfo( tFileInfo * file )
             debugf( "%12s: %u.%03u", "fps", file->video.frameRate / 1000, file->video.frameRate % 1000 );
         }
         debugf( "%12s: %s", "scan type",   scanTypeNames[ file->video.scanType ] );
+        debugf( "%12s: %u bits, %s", "sampling", file->video.bitDepth, chromaFormatNames[ file->video.chromaFormat ] );
+        debugf( "%12s: %u/%u/%u", "colour", file->video.colour.primaries,
+                file->video.colour.transfer, file->video.colour.matrix );
+        debugf( "%12s: %s", "range", dynamicRangeNames[ file->video.hdr.range ] );
+        if ( file->video.hdr.doviProfile != 0 )
+        {
+            debugf( "%12s: %u", "DV profile", file->video.hdr.doviProfile );
+        }
+        if ( file->video.hdr.maxLuminance != 0 || file->video.hdr.maxCLL != 0 )
+        {
+            debugf( "%12s: %u cd/m2, MaxCLL %u, MaxFALL %u", "mastering", file->video.hdr.maxLuminance,
+                    file->video.hdr.maxCLL, file->video.hdr.maxFALL );
+        }
         debugf( "%12s: %s", "orientation", orientationNames[ file->video.orientation ] );
 
 
@@ -207,247 +435,1423 @@ void dumpMediaInfo( tFileInfo * file )
         debugf( "%12s: %u", "sample bits", file->audio.sample.length );
         debugf( "%12s: %d", "channels", file->audio.channel.count );
         debugf( "%12s: %s", "layout", layoutNames[ file->audio.channel.layout ] );
+        if ( file->audio.objects )
+        {
+            debugf( "%12s: %s", "objects", "yes (Atmos)" );
+        }
+
+        debugf( "_______________________" );
+        debugf( "Streams" );
+
+        for ( unsigned int i = 0; i < file->streams.count; ++i )
+        {
+            const tStreamInfo * stream = &file->streams.info[i];
+            if ( stream->type == streamTypeVideo )
+            {
+                debugf( "%12u: video, codec %u, %up, %u bps", stream->index,
+                        stream->codec, stream->height, stream->bitrate );
+            }
+            else
+            {
+                debugf( "%12u: audio, codec %u, %s%s, %s, %u bps, disposition 0x%02x", stream->index,
+                        stream->codec, layoutNames[ stream->layout ], stream->objects ? " + objects" : "",
+                        languageNames[ stream->language ], stream->bitrate, stream->disposition );
+            }
+        }
+
+        if ( file->errors.packets > 0 )
+        {
+            debugf( "_______________________" );
+            debugf( "Errors" );
+
+            debugf( "%12s: %lu", "packets",    file->errors.packets );
+            debugf( "%12s: %lu", "sync",       file->errors.sync );
+            debugf( "%12s: %lu", "transport",  file->errors.transport );
+            debugf( "%12s: %lu", "continuity", file->errors.continuity );
+            debugf( "%12s: %lu", "pcr",        file->errors.pcr );
+            debugf( "%12s: %lu.%03lu", "per minute",
+                    file->errors.perMinute / 1000, file->errors.perMinute % 1000 );
+        }
     }
 }
 
-int processMediaInfo( tFileInfo * file )
+/**
+ * @brief map a profile_idc taken directly from the SPS to our tProfileLevel
+ */
+static tProfileLevel mapProfile( tVideoCodec codec, const tVideoParameters * params )
 {
-    int result = 0;
-    AVFormatContext * formatContext = NULL;
-    enum AVMediaType mediaTypesPresent[AVMEDIA_TYPE_NB];
-    char             temp[256];
-
-    char * url;
-    unsigned int len = 5 + strlen( file->name ) + 1; /* add in the 'file:' and a trailing null */;
-    url = malloc( len );
+    if ( codec == videoCodecH264 )
+    {
+        switch ( params->profile )
+        {
+        case 66:  return profileLevelBaseline;
+        case 77:  return profileLevelMain;
+        case 100: return profileLevelHigh;
+        case 110: return profileLevelHigh10;
+        case 122: return profileLevelHigh422;
+        case 44:
+        case 244: return profileLevelHigh444;
+        default:  return profileLevelUknown;
+        }
+    }
+    else
+    {
+        switch ( params->profile )
+        {
+        case 1:  /* Main */
+        case 3:  return profileLevelMain; /* Main Still Picture */
+        case 2:  return profileLevelMain10;
+        case 4:  /* Format Range Extensions - distinguish them by what they actually use */
+            switch ( params->chromaFormat )
+            {
+            case chroma444: return profileLevelHigh444;
+            case chroma422: return profileLevelHigh422;
+            default:        return profileLevelMain10;
+            }
+        default: return profileLevelUknown;
+        }
+    }
+}
 
-    result = AVERROR_BUG;
-    if ( url != NULL)
+/**
+ * @brief override what libavformat guessed with what the sequence parameter set actually says
+ */
+static void applyVideoParameters( tFileInfo * file, const tVideoParameters * params )
+{
+    tProfileLevel profile = mapProfile( file->video.codec.id, params );
+    if ( profile != profileLevelUknown )
     {
-        snprintf( url, len, "file:%s", file->name );
-        result = avformat_open_input( &formatContext, url, NULL, NULL);
-        free( url );
+        file->video.codec.profile = profile;
+    }
+    file->video.codec.level  = params->level;
+    file->video.bitDepth     = params->bitDepth;
+    file->video.chromaFormat = params->chromaFormat;
 
-        switch ( result )
+    if ( params->scanType != scanUnknown )
+    {
+        file->video.scanType = params->scanType;
+    }
+    if ( params->frameRate != 0 )
+    {
+        file->video.frameRate = params->frameRate;
+        if ( params->fixedFrameRate )
         {
-        default:
-            av_strerror( result, temp, sizeof( temp ));
-            debugf( "error = %x: %s", result, temp );
-            break;
+            file->video.frameRateType = frameRateConstant;
+        }
+    }
 
-        case AVERROR_INVALIDDATA:
-            /* ffmpeg didn't recognize the file contents, so leave everything at zero. Elsewhere we
-             * use a container stream count of zero as the indication that it's not a media file */
-            break;
+    file->video.colour.primaries = params->primaries;
+    file->video.colour.transfer  = params->transfer;
+    file->video.colour.matrix    = params->matrix;
+}
 
-        case 0:
-            /* retrieve stream information */
-            if ( avformat_find_stream_info( formatContext, NULL) < 0 )
-            {
-                fprintf( stderr, "Could not find stream information\n" );
-                result = 1;
-            }
-            else
-            {
-                file->container.stream.count  = formatContext->nb_streams;
-                file->container.chapter.count = formatContext->nb_chapters;
-                file->container.bitrate       = formatContext->bit_rate;
-                file->container.duration      = formatContext->duration / AV_TIME_BASE;
+/**
+ * @brief a stream's side data of the given type, or NULL. It moved into the codec parameters in
+ * FFmpeg 6.1, and av_stream_get_side_data() went in 7
+ */
+static const uint8_t * streamSideData( const AVStream * stream, enum AVPacketSideDataType type, int * size )
+{
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT( 60, 15, 100 )
+    const AVPacketSideData * sideData = av_packet_side_data_get( stream->codecpar->coded_side_data,
+                                                                 stream->codecpar->nb_coded_side_data, type );
+    if ( sideData == NULL )
+    {
+        return NULL;
+    }
+    *size = sideData->size;
+    return sideData->data;
+#elif LIBAVFORMAT_VERSION_MAJOR >= 59
+    size_t length;
+    const uint8_t * data = av_stream_get_side_data( stream, type, &length );
+    *size = length;
+    return data;
+#else
+    return av_stream_get_side_data( stream, type, size );
+#endif
+}
 
-                if ( formatContext->iformat != NULL)
-                {
-                    file->container.name.brief = formatContext->iformat->name;
-                    file->container.name.full  = formatContext->iformat->long_name;
-                }
+/**
+ * @brief pick up the HDR metadata the demuxer found in the container (e.g. mkv, mp4, or a TS descriptor)
+ */
+static void readStreamSideData( AVStream * stream, tFileInfo * file, tHDRMetadata * hdr )
+{
+    int size;
 
-                for ( unsigned int i = 0; i < AVMEDIA_TYPE_NB; ++i )
-                {
-                    mediaTypesPresent[i] = 0;
-                }
-                for ( unsigned int streamIdx = 0;
-                      streamIdx < formatContext->nb_streams;
-                      streamIdx++ )
-                {
-                    enum AVMediaType mediaType = formatContext->streams[streamIdx]->codecpar->codec_type;
-                    if ( mediaType < 0 || mediaType > AVMEDIA_TYPE_NB )
-                    {
-                        mediaType = AVMEDIA_TYPE_NB;
-                    }
-                    ++mediaTypesPresent[mediaType];
-                }
+    const AVDOVIDecoderConfigurationRecord * dovi =
+            (const AVDOVIDecoderConfigurationRecord *)streamSideData( stream, AV_PKT_DATA_DOVI_CONF, &size );
+    if ( dovi != NULL && size >= (int)sizeof( AVDOVIDecoderConfigurationRecord ))
+    {
+        file->video.hdr.doviProfile = dovi->dv_profile;
+        hdr->doviRPU = dovi->rpu_present_flag;
+    }
 
-                file->video.streamCount = mediaTypesPresent[AVMEDIA_TYPE_VIDEO];
-                file->audio.streamCount = mediaTypesPresent[AVMEDIA_TYPE_AUDIO];
+    const AVMasteringDisplayMetadata * mastering =
+            (const AVMasteringDisplayMetadata *)streamSideData( stream, AV_PKT_DATA_MASTERING_DISPLAY_METADATA, &size );
+    if ( mastering != NULL && mastering->has_luminance && mastering->max_luminance.den != 0 )
+    {
+        hdr->maxLuminance = mastering->max_luminance.num / mastering->max_luminance.den;
+    }
 
-                /* * * video codec * * */
+    const AVContentLightMetadata * light =
+            (const AVContentLightMetadata *)streamSideData( stream, AV_PKT_DATA_CONTENT_LIGHT_LEVEL, &size );
+    if ( light != NULL )
+    {
+        hdr->maxCLL  = light->MaxCLL;
+        hdr->maxFALL = light->MaxFALL;
+    }
+}
 
-                AVCodec * videoDecoder;
-                file->video.streamIndex = av_find_best_stream( formatContext, AVMEDIA_TYPE_VIDEO,
-                                                               -1, -1,
-                                                               &videoDecoder, 0 );
+/**
+ * @brief decide where the video falls on the SDR -> Dolby Vision spectrum
+ */
+static void classifyDynamicRange( tFileInfo * file, const tHDRMetadata * hdr )
+{
+    file->video.hdr.range = dynamicRangeSDR;
 
-                AVStream * videoStreamContext = formatContext->streams[file->video.streamIndex];
+    switch ( file->video.colour.transfer )
+    {
+    case 16: /* SMPTE ST 2084 (PQ) */
+        file->video.hdr.range = hdr->hdr10Plus ? dynamicRangeHDR10Plus : dynamicRangeHDR10;
+        break;
 
-                if ( videoDecoder != NULL && videoStreamContext != NULL)
-                {
-                    file->video.codec.name.brief = videoDecoder->name;
-                    file->video.codec.name.full  = videoDecoder->long_name;
+    case 18: /* ARIB STD-B67 (HLG) */
+        file->video.hdr.range = dynamicRangeHLG;
+        break;
 
-                    AVCodecContext * videoCodecContext = avcodec_alloc_context3( videoDecoder );
-                    if ( videoCodecContext != NULL)
-                    {
-                        int ret = avcodec_parameters_to_context( videoCodecContext, videoStreamContext->codecpar );
-                        if ( ret >= 0 )
-                        {
-                            file->video.bitrate = videoCodecContext->bit_rate;
-
-                            /* map a subset of the AV_CODEC_IDs to an enum ordered by preference */
-                            switch ( videoCodecContext->codec_id )
-                            {
-                                 /* aka H.265 */
-                            case AV_CODEC_ID_HEVC:       file->video.codec.id = videoCodecH265; break;
-                                /* aka AVC, MPEG-4 Part 10 */
-                            case AV_CODEC_ID_H264:       file->video.codec.id = videoCodecH264; break;
-                            case AV_CODEC_ID_MPEG4:      file->video.codec.id = videoCodecMPEG4; break;
-                            case AV_CODEC_ID_MPEG2VIDEO: file->video.codec.id = videoCodecMPEG2; break;
-                                /* map all the less common video codecs to 'unknown' */
-                            default: file->video.codec.id = videoCodecUnknown; break;
-                            }
-
-                            file->video.codec.profile = profileLevelUknown;
-
-                            if ( videoCodecContext->codec_id != AV_CODEC_ID_NONE )
-                            {
-                                const char * profileName = avcodec_profile_name( videoCodecContext->codec_id,
-                                                                                 videoCodecContext->profile );
-                                if ( profileName != NULL)
-                                {
-                                    if ( strcasecmp( profileName, "main" ) == 0 )
-                                    {
-                                        file->video.codec.profile = profileLevelMain;
-                                    }
-                                    else if ( strcasecmp( profileName, "high" ) == 0 )
-                                    {
-                                        file->video.codec.profile = profileLevelHigh;
-                                    }
-
-                                    file->video.codec.level = videoCodecContext->level;
-                                }
-                            }
-
-                            file->video.width  = videoCodecContext->width;
-                            file->video.height = videoCodecContext->height;
-
-                            if ( file->video.width > file->video.height )
-                            {
-                                if (((file->video.width * 1000) / file->video.height) > 1500 )
-                                {
-                                    file->video.orientation = orientationLandscapeWide;
-                                }
-                                else
-                                {
-                                    file->video.orientation = orientationLandscape;
-                                }
-                            }
-                            else /* portrait orientation is still uncommon for video, but not unknown */
-                            {
-                                if ( ((file->video.height * 1000) / file->video.width) > 1500 )
-                                {
-                                    file->video.orientation = orientationPortraitTall;
-                                }
-                                else
-                                {
-                                    file->video.orientation = orientationPortrait;
-                                }
-                            }
-
-                            switch ( videoCodecContext->field_order )
-                            {
-                            case AV_FIELD_UNKNOWN:     file->video.scanType = scanUnknown; break;
-                            case AV_FIELD_PROGRESSIVE: file->video.scanType = scanProgressive; break;
-                            default: file->video.scanType = scanInterlaced; break;
-                            }
-
-                            file->video.frameRate = videoStreamContext->avg_frame_rate.num * 1000 /
-                                                    videoStreamContext->avg_frame_rate.den;
-                        }
-                    }
-                }
+    default:
+        break;
+    }
 
-                /* * * audio codec * * */
+    /* some Dolby Vision profiles carry a base layer that signals SDR or HLG - it's still DV */
+    if ( file->video.hdr.doviProfile != 0 || hdr->doviRPU )
+    {
+        file->video.hdr.range = dynamicRangeDolbyVision;
+    }
 
-                AVCodec * audioDecoder;
-                file->audio.streamIndex = av_find_best_stream( formatContext, AVMEDIA_TYPE_AUDIO,
-                                                               -1, -1,
-                                                               &audioDecoder, 0 );
-                AVStream * audioStreamContext = formatContext->streams[file->audio.streamIndex];
+    file->video.hdr.maxLuminance = hdr->maxLuminance;
+    file->video.hdr.maxCLL       = hdr->maxCLL;
+    file->video.hdr.maxFALL      = hdr->maxFALL;
+}
 
-                if ( audioDecoder != NULL && audioStreamContext != NULL)
-                {
-                    file->audio.codec.name.brief = audioDecoder->name;
-                    file->audio.codec.name.full  = audioDecoder->long_name;
+/**
+ * @brief should we bother looking for HDR SEI messages in the first few packets?
+ */
+static int wantHDRMetadata( tFileInfo * file, const tHDRMetadata * hdr )
+{
+    if ( file->video.codec.id != videoCodecH264 && file->video.codec.id != videoCodecH265 )
+    {
+        return 0;
+    }
+    if ( file->video.hdr.doviProfile != 0 )
+    {
+        return 0; /* already as good as it gets */
+    }
+    /* SEI can only turn PQ into HDR10+ or Dolby Vision, or add light levels to PQ/HLG */
+    switch ( file->video.colour.transfer )
+    {
+    case 16:
+        return !hdr->hdr10Plus;
 
-                    AVDictionaryEntry * lang = av_dict_get( audioStreamContext->metadata,
-                                                            "language", NULL, 0 );
-                    if ( lang != NULL)
-                    {
-                        int i = 0;
-                        while ( languageKeys[i] != NULL )
-                        {
-                            if ( strcasecmp( languageKeys[i], lang->value ) == 0)
-                            {
-                                file->audio.language = (tLanguage)i;
-                                break;
-                            }
-                            i++;
-                        }
-                    }
+    case 18:
+        return 1;
 
-                    AVCodecContext * audioCodecContext = avcodec_alloc_context3( audioDecoder );
-                    int ret = avcodec_parameters_to_context( audioCodecContext, audioStreamContext->codecpar );
-                    if ( ret >= 0 )
-                    {
-                        switch ( audioCodecContext->codec_id )
-                        {
-                        case AV_CODEC_ID_TRUEHD: file->audio.codec.id = audioCodecTrueHD; break;
-                        case AV_CODEC_ID_DTS:    file->audio.codec.id = audioCodecDTS; break;
-                        case AV_CODEC_ID_EAC3:   file->audio.codec.id = audioCodecEAC3; break;
-                        case AV_CODEC_ID_AC3:    file->audio.codec.id = audioCodecAC3; break;
-                        case AV_CODEC_ID_AAC:    file->audio.codec.id = audioCodecAAC; break;
-                        case AV_CODEC_ID_MP3:    file->audio.codec.id = audioCodecMP3; break;
-                        default:  file->audio.codec.id = audioCodecUnknown; break;
-                        }
+    default:
+        return 0;
+    }
+}
 
-                        file->audio.bitrate       = audioCodecContext->bit_rate;
-                        file->audio.sample.rate   = audioCodecContext->sample_rate;
-                        file->audio.sample.length = 8 * av_get_bytes_per_sample( audioCodecContext->sample_fmt);
-                        file->audio.channel.count = audioCodecContext->channels;
+/**
+ * @brief is the stream's audio codec one we can parse the sync frames of?
+ */
+static int wantAudioParameters( const tStreamInfo * stream )
+{
+    if ( stream->type != streamTypeAudio )
+    {
+        return 0;
+    }
 
-                        switch ( audioCodecContext->channel_layout )
-                        {
-                        case AV_CH_LAYOUT_MONO:         file->audio.channel.layout = layoutMono; break;
-                        case AV_CH_LAYOUT_STEREO:       file->audio.channel.layout = layoutStereo; break;
-                        case AV_CH_LAYOUT_2_1:          file->audio.channel.layout = layout2dot1; break;
+    switch ( (tAudioCodec)stream->codec )
+    {
+    case audioCodecAC3:
+    case audioCodecEAC3:
+    case audioCodecTrueHD:
+    case audioCodecDTS:
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief override libavformat's channel count and layout with what the sync frames say
+ */
+static void applyAudioParameters( tStreamInfo * stream, const tAudioParameters * params )
+{
+    stream->channels = params->channels;
+
+    tChannelLayout layout = audioLayout( params );
+    if ( layout != layoutUnknown )
+    {
+        stream->layout = layout;
+    }
+    stream->objects = params->objects;
+}
+
+/**
+ * @brief find the entry in file->streams for an AVStream index, or -1 if it isn't there
+ */
+static int findStream( const tFileInfo * file, int index )
+{
+    for ( unsigned int i = 0; i < file->streams.count; ++i )
+    {
+        if ( file->streams.info[i].index == index )
+        {
+            return i;
+        }
+    }
+    return -1;
+}
 
-                        case AV_CH_LAYOUT_5POINT0:
-                        case AV_CH_LAYOUT_5POINT0_BACK: file->audio.channel.layout = layout5dot0; break;
+#define kAVIOBufferSize     (64 * 1024)
 
-                        case AV_CH_LAYOUT_5POINT1:
-                        case AV_CH_LAYOUT_5POINT1_BACK: file->audio.channel.layout = layout5dot1; break;
+/* what a thread keeps between probes, so that from one file to the next it needn't allocate
+ * them again. libavformat still allocates its own AVFormatContext and AVIOContext per file */
+static _Thread_local struct {
+    uint8_t  * buffer;      ///> an AVIO buffer, free for the next file
+    int        size;
+    AVPacket * packet;      ///> for reading the first packets. Unreferenced between reads
+} gProbeContext;
 
-                        case AV_CH_LAYOUT_7POINT1:
-                        case AV_CH_LAYOUT_7POINT1_WIDE:
-                        case AV_CH_LAYOUT_7POINT1_WIDE_BACK: file->audio.channel.layout = layout7dot1; break;
+#ifndef NDEBUG
+/* the allocations made by the probe itself (libavformat's own aren't counted) */
+#define countAllocation()   atomic_fetch_add( &gTotals->allocations, 1 )
 
-                        default: file->audio.channel.layout = layoutUnknown; break;
-                        }
-                    }
+unsigned long probeAllocations( void )
+{
+    return atomic_load( &gTotals->allocations );
+}
+#else
+#define countAllocation()
+#endif
+
+/**
+ * @brief examine the first few packets of the streams, for what the headers didn't tell us.
+ * avformat_find_stream_info() has already buffered these packets, so it's cheap
+ */
+static void readFirstPackets( AVFormatContext * formatContext, tFileInfo * file,
+                              int needSPS, int needSEI, tHDRMetadata * hdr,
+                              int needAudio, tAudioParameters * audio )
+{
+    tVideoParameters params;
+    unsigned int lengthSize = 0;
+    unsigned int audioPackets[kMaxStreams];
+
+    if ( file->video.streamIndex >= 0 )
+    {
+        AVCodecParameters * codecpar = formatContext->streams[file->video.streamIndex]->codecpar;
+        lengthSize = nalLengthSize( file->video.codec.id, codecpar->extradata, codecpar->extradata_size );
+    }
+
+    /* count the audio streams we're still waiting on */
+    needAudio = 0;
+    for ( unsigned int i = 0; i < file->streams.count; ++i )
+    {
+        audioPackets[i] = 0;
+        needAudio += wantAudioParameters( &file->streams.info[i] );
+    }
+
+    /* the size of an AVPacket isn't part of the ABI, so it can't live on the stack */
+    if ( gProbeContext.packet == NULL )
+    {
+        gProbeContext.packet = av_packet_alloc();
+        countAllocation();
+        if ( gProbeContext.packet == NULL )
+        {
+            return;
+        }
+    }
+    AVPacket * packet = gProbeContext.packet;
+
+    for ( unsigned int i = 0; i < kMaxProbePackets && (needSPS || needSEI || needAudio > 0)
+                              && av_read_frame( formatContext, packet ) >= 0; ++i )
+    {
+        if ( packet->stream_index == file->video.streamIndex )
+        {
+            if ( needSPS && parseVideoParameters( file->video.codec.id, packet->data, packet->size, &params ) == 0 )
+            {
+                applyVideoParameters( file, &params );
+                needSPS = 0;
+                /* now we know the transfer characteristics, we can tell if the SEI are worth a look */
+                needSEI = wantHDRMetadata( file, hdr );
+            }
+
+            /* the static metadata SEI accompany the first IDR, so once we've seen some, we're done */
+            if ( needSEI && parseHDRMetadata( file->video.codec.id, lengthSize, packet->data, packet->size, hdr ))
+            {
+                needSEI = 0;
+            }
+        }
+        else
+        {
+            int slot = findStream( file, packet->stream_index );
+            if ( slot >= 0 && wantAudioParameters( &file->streams.info[slot] )
+              && audioPackets[slot] < kMaxAudioPackets )
+            {
+                /* a couple of packets is enough to see every E-AC-3 dependent substream */
+                if ( parseAudioParameters( file->streams.info[slot].codec, packet->data, packet->size,
+                                           &audio[slot] ) == 0
+                  && ++audioPackets[slot] >= kMaxAudioPackets )
+                {
+                    --needAudio;
                 }
             }
+        }
+        av_packet_unref( packet );
+    }
+}
 
-            avformat_close_input( &formatContext );
-            break;
+/**
+ * @brief map a subset of the AV_CODEC_IDs to an enum ordered by preference
+ */
+static tVideoCodec mapVideoCodec( enum AVCodecID codecId )
+{
+    switch ( codecId )
+    {
+    case AV_CODEC_ID_HEVC:       return videoCodecH265; /* aka H.265 */
+    case AV_CODEC_ID_H264:       return videoCodecH264; /* aka AVC, MPEG-4 Part 10 */
+    case AV_CODEC_ID_MPEG4:      return videoCodecMPEG4;
+    case AV_CODEC_ID_MPEG2VIDEO: return videoCodecMPEG2;
+        /* map all the less common video codecs to 'unknown' */
+    default:                     return videoCodecUnknown;
+    }
+}
+
+static tAudioCodec mapAudioCodec( enum AVCodecID codecId )
+{
+    switch ( codecId )
+    {
+    case AV_CODEC_ID_TRUEHD: return audioCodecTrueHD;
+    case AV_CODEC_ID_DTS:    return audioCodecDTS;
+    case AV_CODEC_ID_EAC3:   return audioCodecEAC3;
+    case AV_CODEC_ID_AC3:    return audioCodecAC3;
+    case AV_CODEC_ID_AAC:    return audioCodecAAC;
+    case AV_CODEC_ID_MP3:    return audioCodecMP3;
+    default:                 return audioCodecUnknown;
+    }
+}
+
+/**
+ * @brief a stream's channel layout, as a mask of AV_CH_* bits (zero if it's not that kind of
+ * layout), and its channel count. Both moved into 'ch_layout' in FFmpeg 5.1, and the old fields
+ * went in 7
+ */
+static uint64_t channelMask( const AVCodecParameters * codecpar, int * channels )
+{
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT( 59, 24, 100 )
+    *channels = codecpar->ch_layout.nb_channels;
+    return (codecpar->ch_layout.order == AV_CHANNEL_ORDER_NATIVE) ? codecpar->ch_layout.u.mask : 0;
+#else
+    *channels = codecpar->channels;
+    return codecpar->channel_layout;
+#endif
+}
+
+static tChannelLayout mapChannelLayout( uint64_t channelLayout )
+{
+    switch ( channelLayout )
+    {
+    case AV_CH_LAYOUT_MONO:         return layoutMono;
+    case AV_CH_LAYOUT_STEREO:       return layoutStereo;
+    case AV_CH_LAYOUT_2_1:          return layout2dot1;
+
+    case AV_CH_LAYOUT_5POINT0:
+    case AV_CH_LAYOUT_5POINT0_BACK: return layout5dot0;
+
+    case AV_CH_LAYOUT_5POINT1:
+    case AV_CH_LAYOUT_5POINT1_BACK: return layout5dot1;
+
+    case AV_CH_LAYOUT_7POINT1:
+    case AV_CH_LAYOUT_7POINT1_WIDE:
+    case AV_CH_LAYOUT_7POINT1_WIDE_BACK: return layout7dot1;
+
+    default: return layoutUnknown;
+    }
+}
+
+static tLanguage lookupLanguage( AVDictionary * metadata )
+{
+    AVDictionaryEntry * lang = av_dict_get( metadata, "language", NULL, 0 );
+    if ( lang != NULL )
+    {
+        for ( int i = 0; languageKeys[i] != NULL; i++ )
+        {
+            if ( strcasecmp( languageKeys[i], lang->value ) == 0 )
+            {
+                return (tLanguage)i;
+            }
         }
     }
+    return languageUnknown;
+}
+
+static uint8_t mapDisposition( int disposition )
+{
+    uint8_t result = 0;
+
+    if ( disposition & AV_DISPOSITION_DEFAULT )  result |= dispositionDefault;
+    if ( disposition & AV_DISPOSITION_ORIGINAL ) result |= dispositionOriginal;
+    if ( disposition & AV_DISPOSITION_DUB )      result |= dispositionDub;
+    if ( disposition & AV_DISPOSITION_COMMENT )  result |= dispositionCommentary;
+    if ( disposition & (AV_DISPOSITION_VISUAL_IMPAIRED | AV_DISPOSITION_HEARING_IMPAIRED) )
+    {
+        result |= dispositionImpaired;
+    }
+    return result;
+}
+
+/**
+ * @brief add a compact summary of an audio or video stream to file->streams
+ */
+static void collectStream( tFileInfo * file, AVStream * stream, unsigned int attributes )
+{
+    AVCodecParameters * codecpar = stream->codecpar;
+    int channels;
+
+    if ( file->streams.count >= kMaxStreams || stream->index > UINT8_MAX
+      || (stream->disposition & AV_DISPOSITION_ATTACHED_PIC) )
+    {
+        return;
+    }
+
+    tStreamInfo * info = &file->streams.info[ file->streams.count ];
+    memset( info, 0, sizeof( tStreamInfo ));
+
+    info->index       = stream->index;
+    info->language    = lookupLanguage( stream->metadata );
+    info->disposition = mapDisposition( stream->disposition );
+    info->bitrate     = (codecpar->bit_rate > UINT32_MAX) ? UINT32_MAX : codecpar->bit_rate;
+
+    switch ( codecpar->codec_type )
+    {
+    case AVMEDIA_TYPE_VIDEO:
+        info->type   = streamTypeVideo;
+        info->codec  = mapVideoCodec( codecpar->codec_id );
+        info->height = codecpar->height;
+        break;
+
+    case AVMEDIA_TYPE_AUDIO:
+        if ( (attributes & attrAudio) == 0 )
+        {
+            return;
+        }
+        info->type     = streamTypeAudio;
+        info->codec    = mapAudioCodec( codecpar->codec_id );
+        info->layout   = mapChannelLayout( channelMask( codecpar, &channels ));
+        info->channels = channels;
+        break;
+
+    default:
+        return; /* not interested in subtitles, data, etc. */
+    }
+
+    ++file->streams.count;
+}
+
+/**
+ * @brief populate file->audio from the stream chosen to represent it
+ */
+static void fillAudioInfo( tFileInfo * file, AVStream * stream, const tStreamInfo * info )
+{
+    AVCodecParameters * codecpar = stream->codecpar;
+    const AVCodec * decoder = avcodec_find_decoder( codecpar->codec_id );
+
+    file->audio.streamIndex = info->index;
+    if ( decoder != NULL )
+    {
+        file->audio.codec.name.brief = decoder->name;
+        file->audio.codec.name.full  = decoder->long_name;
+    }
+    else
+    {
+        file->audio.codec.name.brief = avcodec_get_name( codecpar->codec_id );
+        file->audio.codec.name.full  = file->audio.codec.name.brief;
+    }
+
+    file->audio.codec.id      = info->codec;
+    file->audio.language      = info->language;
+    file->audio.bitrate       = codecpar->bit_rate;
+    file->audio.sample.rate   = codecpar->sample_rate;
+    file->audio.sample.length = 8 * av_get_bytes_per_sample( codecpar->format );
+    file->audio.channel.count  = info->channels;
+    file->audio.channel.layout = info->layout;
+    file->audio.objects        = info->objects;
+}
+
+int setPreferredLanguage( const char * key )
+{
+    for ( int i = 0; languageKeys[i] != NULL; i++ )
+    {
+        if ( strcasecmp( languageKeys[i], key ) == 0 )
+        {
+            gPreferredLanguage = (tLanguage)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief rank two audio streams: > 0 if 'a' is better than 'b'
+ */
+static int compareAudioStreams( const tStreamInfo * a, const tStreamInfo * b )
+{
+    /* commentary and audio description tracks are never the 'main' audio */
+    int aSecondary = (a->disposition & (dispositionCommentary | dispositionImpaired)) != 0;
+    int bSecondary = (b->disposition & (dispositionCommentary | dispositionImpaired)) != 0;
+    if ( aSecondary != bSecondary )
+    {
+        return bSecondary - aSecondary;
+    }
+    if ( a->layout != b->layout )
+    {
+        return (int)a->layout - (int)b->layout;
+    }
+    if ( a->objects != b->objects )
+    {
+        return (int)a->objects - (int)b->objects;
+    }
+    if ( a->codec != b->codec )
+    {
+        return (int)a->codec - (int)b->codec;
+    }
+    if ( a->bitrate != b->bitrate )
+    {
+        return (a->bitrate > b->bitrate) ? 1 : -1;
+    }
+    return 0;
+}
+
+int bestAudioStream( const tFileInfo * file, tLanguage language )
+{
+    int best = -1;
+    int matched = 0;
+
+    /* only consider other languages if there's nothing in the one asked for */
+    for ( unsigned int i = 0; i < file->streams.count; ++i )
+    {
+        if ( file->streams.info[i].type == streamTypeAudio && file->streams.info[i].language == language )
+        {
+            matched = 1;
+            break;
+        }
+    }
+
+    for ( unsigned int i = 0; i < file->streams.count; ++i )
+    {
+        const tStreamInfo * stream = &file->streams.info[i];
+        if ( stream->type != streamTypeAudio || (matched && stream->language != language) )
+        {
+            continue;
+        }
+        if ( best < 0 )
+        {
+            best = i;
+        }
+        else
+        {
+            int diff = compareAudioStreams( stream, &file->streams.info[best] );
+            /* when they're equivalent, go with the one flagged as the default */
+            if ( diff > 0 || (diff == 0 && (stream->disposition & dispositionDefault)
+                                        && !(file->streams.info[best].disposition & dispositionDefault)) )
+            {
+                best = i;
+            }
+        }
+    }
+    return best;
+}
+
+/* an error density above this (in thousandths of an error per minute) marks a damaged recording */
+#define kMaxCleanErrorDensity  1000
+
+int compareMediaInfo( const tFileInfo * a, const tFileInfo * b )
+{
+    /* anything beats something that isn't a media file at all */
+    if ( (a->container.stream.count == 0) != (b->container.stream.count == 0) )
+    {
+        return (a->container.stream.count != 0) ? 1 : -1;
+    }
+
+    /* a clean recording beats a damaged one, whatever the resolution */
+    if ( a->errors.packets > 0 && b->errors.packets > 0 )
+    {
+        int aDamaged = a->errors.perMinute > kMaxCleanErrorDensity;
+        int bDamaged = b->errors.perMinute > kMaxCleanErrorDensity;
+        if ( aDamaged != bDamaged )
+        {
+            return bDamaged - aDamaged;
+        }
+    }
+
+    if ( a->video.height != b->video.height )
+    {
+        return (a->video.height > b->video.height) ? 1 : -1;
+    }
+    if ( a->video.scanType != b->video.scanType )
+    {
+        return (int)a->video.scanType - (int)b->video.scanType;
+    }
+    if ( a->video.hdr.range != b->video.hdr.range )
+    {
+        return (int)a->video.hdr.range - (int)b->video.hdr.range;
+    }
+
+    /* compare the audio each would actually be played with */
+    int aBest = bestAudioStream( a, gPreferredLanguage );
+    int bBest = bestAudioStream( b, gPreferredLanguage );
+    if ( (aBest < 0) != (bBest < 0) )
+    {
+        return (aBest >= 0) ? 1 : -1;
+    }
+    if ( aBest >= 0 )
+    {
+        int aMatches = a->streams.info[aBest].language == gPreferredLanguage;
+        int bMatches = b->streams.info[bBest].language == gPreferredLanguage;
+        if ( aMatches != bMatches )
+        {
+            return aMatches - bMatches;
+        }
+        int diff = compareAudioStreams( &a->streams.info[aBest], &b->streams.info[bBest] );
+        if ( diff != 0 )
+        {
+            return diff;
+        }
+    }
+
+    if ( a->video.codec.id != b->video.codec.id )
+    {
+        return (int)a->video.codec.id - (int)b->video.codec.id;
+    }
+    if ( a->video.bitDepth != b->video.bitDepth )
+    {
+        return (a->video.bitDepth > b->video.bitDepth) ? 1 : -1;
+    }
+    if ( a->video.frameRate != b->video.frameRate )
+    {
+        return (a->video.frameRate > b->video.frameRate) ? 1 : -1;
+    }
+    /* a longer recording of the same quality is probably the more complete one */
+    if ( a->container.duration != b->container.duration )
+    {
+        return (a->container.duration > b->container.duration) ? 1 : -1;
+    }
+    return 0;
+}
+
+static int gErrorScan = 0;
+
+void setErrorScan( int enabled )
+{
+    gErrorScan = enabled;
+}
+
+/**
+ * @brief whether a transport stream's error scan may yet change how it ranks
+ */
+static int errorsSettled( const tFileInfo * file )
+{
+    /* only transport streams are scanned, and the container is known once the header's read */
+    return !gErrorScan || file->stage >= stageComplete
+        || (file->container.name.brief != NULL && strcmp( file->container.name.brief, "mpegts" ) != 0);
+}
+
+/**
+ * @brief whether the resolution can be trusted yet. Containers with a real header (Matroska, MP4)
+ * give it before a full probe; a transport stream doesn't
+ */
+static int heightKnown( const tFileInfo * file )
+{
+    return file->stage >= stageStreams || (file->stage == stageHeader && file->video.height > 0);
+}
+
+/**
+ * @brief whether it's known yet if it's a media file at all
+ */
+static int mediaKnown( const tFileInfo * file )
+{
+    return file->stage >= stageStreams || (file->stage == stageHeader && file->container.stream.count > 0);
+}
+
+int compareStaged( const tFileInfo * a, const tFileInfo * b, int * decided )
+{
+    /* the keys are taken in the same order as compareMediaInfo(), stopping at the first one that
+     * can't be trusted yet for both files */
+    *decided = 0;
+
+    /* nothing more can be learnt about one whose probe gave up, but that doesn't make it worse */
+    if ( a->failure != failNone || b->failure != failNone )
+    {
+        return 0;
+    }
+    if ( !mediaKnown( a ) || !mediaKnown( b ) )
+    {
+        return 0;
+    }
+    if ( (a->container.stream.count == 0) != (b->container.stream.count == 0) )
+    {
+        *decided = 1;
+        return (a->container.stream.count != 0) ? 1 : -1;
+    }
+    if ( a->container.stream.count == 0 )
+    {
+        *decided = 1;   /* neither is media, and there's nothing more to find out */
+        return 0;
+    }
+
+    /* a file that will never be scanned takes the error density out of the running */
+    int aSettled = errorsSettled( a );
+    int bSettled = errorsSettled( b );
+    if ( !(aSettled && a->errors.packets == 0) && !(bSettled && b->errors.packets == 0) )
+    {
+        if ( !aSettled || !bSettled )
+        {
+            return 0;
+        }
+        int aDamaged = a->errors.perMinute > kMaxCleanErrorDensity;
+        int bDamaged = b->errors.perMinute > kMaxCleanErrorDensity;
+        if ( aDamaged != bDamaged )
+        {
+            *decided = 1;
+            return bDamaged - aDamaged;
+        }
+    }
+
+    if ( !heightKnown( a ) || !heightKnown( b ) )
+    {
+        return 0;
+    }
+    if ( a->video.height != b->video.height )
+    {
+        *decided = 1;
+        return (a->video.height > b->video.height) ? 1 : -1;
+    }
+
+    /* everything else needs a full probe */
+    if ( a->stage < stageStreams || b->stage < stageStreams )
+    {
+        return 0;
+    }
+    *decided = 1;
+    return compareMediaInfo( a, b );
+}
+
+/* --timing: what each part of processMediaInfo() costs, summed over every file */
+static const char * costNames[] =
+    {
+        [costOpen]    = "opening, and reading the stream info",
+        [costStreams] = "summarising the streams",
+        [costVideo]   = "video codec, resolution and frame rate",
+        [costColour]  = "colour and dynamic range",
+        [costPackets] = "reading the first packets, for colour or audio",
+        [costAudio]   = "audio codec, channels and language"
+    };
+
+static int gMeasureCost = 0;
+
+void measureProbeCost( void )
+{
+    gMeasureCost = 1;
+}
+
+void reportProbeCost( FILE * output )
+{
+    for ( tCost cost = 0; cost < costCount; ++cost )
+    {
+        unsigned long count = atomic_load( &gTotals->cost[cost].count );
+        if ( count > 0 )
+        {
+            fprintf( output, "%-50s %6lu files, averaging %.3f ms each\n", costNames[cost],
+                     count, atomic_load( &gTotals->cost[cost].nanoseconds ) / 1e6 / count );
+        }
+    }
+}
+
+/**
+ * @brief charge the time since 'mark' to one part of the probe, and start timing the next
+ */
+static void lapCost( double * costs, tCost cost, struct timespec * mark )
+{
+    if ( gMeasureCost )
+    {
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        costs[cost] += (now.tv_sec - mark->tv_sec) + (now.tv_nsec - mark->tv_nsec) / 1e9;
+        *mark = now;
+    }
+}
+
+/**
+ * @brief add one file's costs to the totals
+ */
+static void addCosts( const double * costs )
+{
+    if ( gMeasureCost )
+    {
+        for ( tCost cost = 0; cost < costCount; ++cost )
+        {
+            if ( costs[cost] > 0 )
+            {
+                atomic_fetch_add( &gTotals->cost[cost].count, 1 );
+                atomic_fetch_add( &gTotals->cost[cost].nanoseconds, (unsigned long long)(costs[cost] * 1e9) );
+            }
+        }
+    }
+}
+
+/* libavformat reads through this, rather than opening the file by name again */
+typedef struct {
+    int             fd;
+    int64_t         position;
+    int64_t         size;
+    struct timespec deadline;   ///> CLOCK_MONOTONIC. Zero for none
+} tFileReader;
+
+static unsigned int gDeadline = 0;
+
+void setProbeDeadline( unsigned int seconds )
+{
+    gDeadline = seconds;
+}
+
+unsigned int probeDeadline( void )
+{
+    return gDeadline;
+}
+
+static int pastDeadline( const tFileReader * reader )
+{
+    struct timespec now;
+
+    if ( reader->deadline.tv_sec == 0 )
+    {
+        return 0;
+    }
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ( now.tv_sec > reader->deadline.tv_sec
+          || (now.tv_sec == reader->deadline.tv_sec && now.tv_nsec >= reader->deadline.tv_nsec) );
+}
+
+/* libavformat polls this between (and during) its blocking operations; non-zero abandons them */
+static int interruptCallback( void * opaque )
+{
+    return pastDeadline( opaque );
+}
+
+/**
+ * @brief a buffer for a custom AVIOContext: the one left from the last file, or a new one
+ */
+static uint8_t * takeBuffer( int * size )
+{
+    uint8_t * buffer = gProbeContext.buffer;
+
+    if ( buffer != NULL )
+    {
+        *size = gProbeContext.size;
+        gProbeContext.buffer = NULL;
+    }
+    else
+    {
+        buffer = av_malloc( kAVIOBufferSize );
+        *size  = kAVIOBufferSize;
+        countAllocation();
+    }
+    return buffer;
+}
+
+/**
+ * @brief hang on to an AVIOContext's buffer for the next file. libavformat may have replaced the one
+ * it was given with one of a different size, but buffer_size always matches what's there now
+ */
+static void keepBuffer( AVIOContext * avio )
+{
+    if ( gProbeContext.buffer == NULL && avio->buffer != NULL )
+    {
+        gProbeContext.buffer = avio->buffer;
+        gProbeContext.size   = avio->buffer_size;
+        avio->buffer = NULL;
+    }
+    else
+    {
+        av_freep( &avio->buffer );
+    }
+}
+
+void releaseProbeContext( void )
+{
+    av_freep( &gProbeContext.buffer );
+    av_packet_free( &gProbeContext.packet );
+}
+
+static int readFileCallback( void * opaque, uint8_t * buffer, int size )
+{
+    tFileReader * reader = opaque;
+
+    /* the interrupt callback isn't consulted by every demuxer's read loop, but this always is */
+    if ( pastDeadline( reader ))
+    {
+        return AVERROR_EXIT;
+    }
+    /* pread(), as the descriptor is shared with the other readers of the file */
+    ssize_t count = pread( reader->fd, buffer, size, reader->position );
+    if ( count < 0 )
+    {
+        return AVERROR( errno );
+    }
+    if ( count == 0 )
+    {
+        return AVERROR_EOF;
+    }
+    reader->position += count;
+    throttleRead( count );
+    return count;
+}
+
+static int64_t seekFileCallback( void * opaque, int64_t offset, int whence )
+{
+    tFileReader * reader = opaque;
+
+    switch ( whence & ~AVSEEK_FORCE )
+    {
+    case AVSEEK_SIZE:
+        return reader->size;
+
+    case SEEK_SET:
+        break;
+
+    case SEEK_CUR:
+        offset += reader->position;
+        break;
+
+    case SEEK_END:
+        offset += reader->size;
+        break;
+
+    default:
+        return AVERROR( EINVAL );
+    }
+
+    if ( offset < 0 )
+    {
+        return AVERROR( EINVAL );
+    }
+    reader->position = offset;
+    return offset;
+}
+
+/**
+ * @brief open the file with the given demuxer (or probe for one, if it's NULL). If the file is
+ * already open, read through its descriptor, rather than have libavformat resolve the path again
+ */
+static int openFormat( AVFormatContext ** formatContext, const tFileInfo * file, tFileReader * reader,
+                       const AVInputFormat * format )
+{
+    if ( file->fd < 0 )
+    {
+        char url[PATH_MAX + 8];
+
+        snprintf( url, sizeof( url ), "file:%s", file->name );
+        *formatContext = avformat_alloc_context();
+        countAllocation();
+        if ( *formatContext == NULL )
+        {
+            return AVERROR( ENOMEM );
+        }
+        (*formatContext)->interrupt_callback.callback = interruptCallback;
+        (*formatContext)->interrupt_callback.opaque   = reader;
+        return avformat_open_input( formatContext, url, mutableFormat( format ), NULL );
+    }
+
+    AVIOContext * avio = NULL;
+    int size;
+    uint8_t * buffer = takeBuffer( &size );
+    if ( buffer != NULL )
+    {
+        avio = avio_alloc_context( buffer, size, 0, reader, readFileCallback, NULL, seekFileCallback );
+        countAllocation();
+    }
+    *formatContext = avformat_alloc_context();
+    countAllocation();
+    if ( avio == NULL || *formatContext == NULL )
+    {
+        avformat_free_context( *formatContext );
+        *formatContext = NULL;
+        avio_context_free( &avio );
+        av_free( buffer );
+        return AVERROR( ENOMEM );
+    }
+
+    reader->position = 0;
+    (*formatContext)->pb = avio;
+    (*formatContext)->interrupt_callback.callback = interruptCallback;
+    (*formatContext)->interrupt_callback.opaque   = reader;
+
+    int result = avformat_open_input( formatContext, file->name, mutableFormat( format ), NULL );
+    if ( result != 0 )
+    {
+        /* the format context has been freed, but custom I/O is left to us */
+        keepBuffer( avio );
+        avio_context_free( &avio );
+    }
+    return result;
+}
+
+static void closeFormat( AVFormatContext ** formatContext )
+{
+    AVIOContext * avio = NULL;
+
+    if ( ((*formatContext)->flags & AVFMT_FLAG_CUSTOM_IO) != 0 )
+    {
+        avio = (*formatContext)->pb;
+    }
+    avformat_close_input( formatContext );
+
+    if ( avio != NULL )
+    {
+        keepBuffer( avio );
+        avio_context_free( &avio );
+    }
+}
+
+/**
+ * @brief open the file and read its stream info. If there's a hint, try that demuxer first, so
+ * libavformat needn't score every demuxer it has against the file, and fall back to a full
+ * probe if it turns out to be wrong.
+ * @return 0 on success, 1 if the file was opened but has no stream info (it still needs closing),
+ * or an AVERROR code if it couldn't be opened
+ */
+static int openInput( AVFormatContext ** formatContext, tFileInfo * file, tFileReader * reader,
+                      const char * hint, tProbeStage stage )
+{
+    int result;
+
+    file->container.hinted = 0;
+    const AVInputFormat * format = (hint != NULL) ? av_find_input_format( hint ) : NULL;
+    if ( format != NULL )
+    {
+        result = openFormat( formatContext, file, reader, format );
+        if ( result == 0 && stage < stageStreams )
+        {
+            /* only the header was wanted. If the hint was wrong, a full probe will find out */
+            file->container.hinted = 1;
+            return 0;
+        }
+        if ( result == 0 )
+        {
+            /* a demuxer that's forced on a file it doesn't understand tends to 'succeed' with no streams */
+            if ( avformat_find_stream_info( *formatContext, NULL ) >= 0 && (*formatContext)->nb_streams > 0 )
+            {
+                file->container.hinted = 1;
+                return 0;
+            }
+            closeFormat( formatContext );
+        }
+        debugf( "not '%s' after all, probing '%s'", hint, file->name );
+    }
+
+    result = openFormat( formatContext, file, reader, NULL );
+    if ( result == 0 && stage >= stageStreams && avformat_find_stream_info( *formatContext, NULL ) < 0 )
+    {
+        result = 1;
+    }
+    return result;
+}
+
+int processMediaInfo( tFileInfo * file, const char * formatHint, tProbeStage stage, unsigned int attributes )
+{
+    int result = 0;
+    AVFormatContext * formatContext = NULL;
+    enum AVMediaType mediaTypesPresent[AVMEDIA_TYPE_NB + 1];
+    char             temp[256];
+    int              needSPS = 0;
+    tHDRMetadata     hdrMetadata;
+    tAudioParameters audioParameters[kMaxStreams];
+    double           costs[costCount] = { 0 };
+    struct timespec  mark;
+
+    memset( &hdrMetadata, 0, sizeof( hdrMetadata ));
+    memset( audioParameters, 0, sizeof( audioParameters ));
+
+    if ( gMeasureCost )
+    {
+        clock_gettime( CLOCK_MONOTONIC, &mark );
+    }
+
+    tFileReader reader = { .fd = file->fd, .position = 0, .size = file->stat.size };
+    if ( gDeadline > 0 )
+    {
+        clock_gettime( CLOCK_MONOTONIC, &reader.deadline );
+        reader.deadline.tv_sec += gDeadline;
+    }
+
+    result = openInput( &formatContext, file, &reader, formatHint, stage );
+    lapCost( costs, costOpen, &mark );
+
+    if ( result != 0 && pastDeadline( &reader ))
+    {
+        /* whatever libavformat made of being interrupted, the cause was the deadline */
+        if ( result == 1 )
+        {
+            closeFormat( &formatContext );
+        }
+        result = kProbeTimedOut;
+    }
+
+    /* if it couldn't be opened, there's nothing more to find out by trying harder */
+    file->stage   = (result == 0) ? stage : stageComplete;
+    file->failure = (result == kProbeTimedOut) ? failTimedOut : failNone;
+
+    switch ( result )
+    {
+    default:
+        av_strerror( result, temp, sizeof( temp ));
+        debugf( "error = %x: %s", result, temp );
+        break;
+
+    case kProbeTimedOut:
+        fprintf( stderr, "### Error: gave up on '%s' after %u seconds\n", file->name, gDeadline );
+        break;
+
+    case 1:
+        /* retrieving the stream information failed */
+        fprintf( stderr, "Could not find stream information\n" );
+        closeFormat( &formatContext );
+        break;
+
+    case AVERROR_INVALIDDATA:
+        /* ffmpeg didn't recognize the file contents, so leave everything at zero. Elsewhere we
+         * use a container stream count of zero as the indication that it's not a media file */
+        break;
+
+    case 0:
+        {
+            file->container.stream.count  = formatContext->nb_streams;
+            if ( attributes & attrContainer )
+            {
+                file->container.chapter.count = formatContext->nb_chapters;
+                file->container.bitrate       = formatContext->bit_rate;
+                file->container.duration      = formatContext->duration / AV_TIME_BASE;
+            }
+
+            if ( formatContext->iformat != NULL)
+            {
+                file->container.name.brief = formatContext->iformat->name;
+                file->container.name.full  = formatContext->iformat->long_name;
+            }
+
+            for ( unsigned int i = 0; i < AVMEDIA_TYPE_NB; ++i )
+            {
+                mediaTypesPresent[i] = 0;
+            }
+            for ( unsigned int streamIdx = 0;
+                  streamIdx < formatContext->nb_streams;
+                  streamIdx++ )
+            {
+                enum AVMediaType mediaType = formatContext->streams[streamIdx]->codecpar->codec_type;
+                if ( mediaType < 0 || mediaType > AVMEDIA_TYPE_NB )
+                {
+                    mediaType = AVMEDIA_TYPE_NB;
+                }
+                ++mediaTypesPresent[mediaType];
+
+                /* summarize the audio and video streams in the same pass */
+                collectStream( file, formatContext->streams[streamIdx], attributes );
+            }
+            lapCost( costs, costStreams, &mark );
+
+            file->video.streamCount = mediaTypesPresent[AVMEDIA_TYPE_VIDEO];
+            file->audio.streamCount = mediaTypesPresent[AVMEDIA_TYPE_AUDIO];
+
+            /* * * video codec * * */
+
+            const AVCodec * videoDecoder = NULL;
+            file->video.streamIndex = -1;
+            if ( attributes & (attrVideo | attrColour) )
+            {
+                file->video.streamIndex = av_find_best_stream( formatContext, AVMEDIA_TYPE_VIDEO,
+                                                               -1, -1,
+                                                               mutableCodec( &videoDecoder ), 0 );
+            }
+
+            AVStream * videoStreamContext = NULL;
+            if ( file->video.streamIndex >= 0 )
+            {
+                videoStreamContext = formatContext->streams[file->video.streamIndex];
+            }
+
+            if ( videoDecoder != NULL && videoStreamContext != NULL)
+            {
+                file->video.codec.name.brief = videoDecoder->name;
+                file->video.codec.name.full  = videoDecoder->long_name;
+
+                /* everything needed is in the stream's codec parameters, so no codec context is needed */
+                AVCodecParameters * videoParameters = videoStreamContext->codecpar;
+
+                file->video.bitrate = videoParameters->bit_rate;
+
+                file->video.codec.id = mapVideoCodec( videoParameters->codec_id );
+
+                file->video.codec.profile = profileLevelUknown;
+
+                if ( videoParameters->codec_id != AV_CODEC_ID_NONE )
+                {
+                    const char * profileName = avcodec_profile_name( videoParameters->codec_id,
+                                                                     videoParameters->profile );
+                    if ( profileName != NULL)
+                    {
+                        if ( strcasecmp( profileName, "main" ) == 0 )
+                        {
+                            file->video.codec.profile = profileLevelMain;
+                        }
+                        else if ( strcasecmp( profileName, "high" ) == 0 )
+                        {
+                            file->video.codec.profile = profileLevelHigh;
+                        }
+
+                        file->video.codec.level = videoParameters->level;
+                    }
+                }
+
+                file->video.width  = videoParameters->width;
+                file->video.height = videoParameters->height;
+
+                if ( file->video.width == 0 || file->video.height == 0 )
+                {
+                    file->video.orientation = orientationUnknown;   /* not in the header */
+                }
+                else if ( file->video.width > file->video.height )
+                {
+                    if (((file->video.width * 1000) / file->video.height) > 1500 )
+                    {
+                        file->video.orientation = orientationLandscapeWide;
+                    }
+                    else
+                    {
+                        file->video.orientation = orientationLandscape;
+                    }
+                }
+                else /* portrait orientation is still uncommon for video, but not unknown */
+                {
+                    if ( ((file->video.height * 1000) / file->video.width) > 1500 )
+                    {
+                        file->video.orientation = orientationPortraitTall;
+                    }
+                    else
+                    {
+                        file->video.orientation = orientationPortrait;
+                    }
+                }
+
+                switch ( videoParameters->field_order )
+                {
+                case AV_FIELD_UNKNOWN:     file->video.scanType = scanUnknown; break;
+                case AV_FIELD_PROGRESSIVE: file->video.scanType = scanProgressive; break;
+                default: file->video.scanType = scanInterlaced; break;
+                }
+
+                if ( videoStreamContext->avg_frame_rate.den != 0 )
+                {
+                    file->video.frameRate = videoStreamContext->avg_frame_rate.num * 1000 /
+                                            videoStreamContext->avg_frame_rate.den;
+                }
+
+                /* libavformat's view of the colour, refined below if we can parse the SPS */
+                file->video.bitDepth          = videoParameters->bits_per_raw_sample;
+                file->video.colour.primaries  = videoParameters->color_primaries;
+                file->video.colour.transfer   = videoParameters->color_trc;
+                file->video.colour.matrix     = videoParameters->color_space;
+
+                if ( attributes & attrColour )
+                {
+                    lapCost( costs, costVideo, &mark );
+                    readStreamSideData( videoStreamContext, file, &hdrMetadata );
+                    lapCost( costs, costColour, &mark );
+                }
+
+                tVideoParameters params;
+                if ( parseVideoParameters( file->video.codec.id,
+                                           videoParameters->extradata,
+                                           videoParameters->extradata_size,
+                                           &params ) == 0 )
+                {
+                    applyVideoParameters( file, &params );
+                }
+                else
+                {
+                    needSPS = ( file->video.codec.id == videoCodecH264
+                             || file->video.codec.id == videoCodecH265 );
+                }
+            }
+        }
+
+        if ( file->video.streamIndex >= 0 )
+        {
+            lapCost( costs, costVideo, &mark );
+        }
+
+        /* beyond the header, the packets have to be read */
+        if ( file->container.stream.count > 0 && stage >= stageStreams )
+        {
+            /* if there was no extradata, look for the SPS in-band, at the start of the first access units */
+            int needSEI   = ( file->video.streamIndex >= 0 && (attributes & attrColour)
+                           && wantHDRMetadata( file, &hdrMetadata ));
+            int needAudio = 0;
+            for ( unsigned int i = 0; i < file->streams.count; ++i )
+            {
+                needAudio |= wantAudioParameters( &file->streams.info[i] );
+            }
+            if ( needSPS || needSEI || needAudio )
+            {
+                readFirstPackets( formatContext, file, needSPS, needSEI, &hdrMetadata,
+                                  needAudio, audioParameters );
+                lapCost( costs, costPackets, &mark );
+            }
+            if ( attributes & attrColour )
+            {
+                classifyDynamicRange( file, &hdrMetadata );
+                lapCost( costs, costColour, &mark );
+            }
+
+            /* * * audio codec * * */
+
+            for ( unsigned int i = 0; i < file->streams.count; ++i )
+            {
+                if ( audioParameters[i].channels > 0 )
+                {
+                    applyAudioParameters( &file->streams.info[i], &audioParameters[i] );
+                }
+            }
+
+            /* rather than av_find_best_stream()'s choice, use the best stream in the preferred language */
+            int best = bestAudioStream( file, gPreferredLanguage );
+            if ( best >= 0 )
+            {
+                fillAudioInfo( file, formatContext->streams[ file->streams.info[best].index ],
+                               &file->streams.info[best] );
+            }
+            else
+            {
+                file->audio.streamIndex = -1;
+            }
+            if ( attributes & attrAudio )
+            {
+                lapCost( costs, costAudio, &mark );
+            }
+        }
+
+        closeFormat( &formatContext );
+        break;
+    }
+    addCosts( costs );
     return result;
 }
\ No newline at end of file
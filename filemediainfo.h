@@ -5,6 +5,10 @@
 #ifndef AVCP_FILEMEDIAINFO_H
 #define AVCP_FILEMEDIAINFO_H
 
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 
 typedef enum
 {
@@ -32,10 +36,33 @@ typedef enum
 typedef enum
 {
     profileLevelUknown,
+    profileLevelBaseline,
     profileLevelMain,
-    profileLevelHigh
+    profileLevelMain10,
+    profileLevelHigh,
+    profileLevelHigh10,
+    profileLevelHigh422,
+    profileLevelHigh444
 } tProfileLevel;
 
+typedef enum
+{
+    chromaUnknown,
+    chroma400,      ///< monochrome
+    chroma420,
+    chroma422,
+    chroma444
+} tChromaFormat;
+
+typedef enum
+{
+    dynamicRangeSDR = 0,
+    dynamicRangeHLG,
+    dynamicRangeHDR10,
+    dynamicRangeHDR10Plus,
+    dynamicRangeDolbyVision
+} tDynamicRange;
+
 typedef enum {
     audioCodecUnknown = 0,
     audioCodecMP3,      ///< AV_CODEC_ID_MP3 preferred ID for decoding MPEG audio layer 1, 2 or 3
@@ -72,15 +99,97 @@ typedef enum {
     languageUnknown
 } tLanguage;
 
+typedef enum {
+    streamTypeVideo,
+    streamTypeAudio
+} tStreamType;
+
+typedef enum {
+    dispositionDefault    = 0x01,
+    dispositionOriginal   = 0x02,
+    dispositionDub        = 0x04,
+    dispositionCommentary = 0x08,
+    dispositionImpaired   = 0x10    ///< audio description, or for the hearing impaired
+} tDisposition;
+
+/* a compact summary of every audio and video stream, so ranking isn't limited to the one stream
+ * av_find_best_stream() picks. It's held inline in tFileInfo, so there's no allocation per file */
+#define kMaxStreams 16
+
+typedef struct {
+    uint8_t      index;         ///> AVStream index
+    uint8_t      type;          ///> tStreamType
+    uint8_t      codec;         ///> tVideoCodec or tAudioCodec, depending on type
+    uint8_t      language;      ///> tLanguage
+    uint8_t      disposition;   ///> tDisposition flags
+    uint8_t      layout;        ///> tChannelLayout (audio only)
+    uint8_t      channels;      ///> (audio only)
+    uint8_t      objects;       ///> object-based audio, i.e. Atmos (audio only)
+    uint16_t     height;        ///> (video only)
+    uint32_t     bitrate;       ///> in bits per second, if known
+} tStreamInfo;
+
+/* how far a file has been examined. Each stage costs more than the one before, so a comparison
+ * only goes as far as it needs to, to tell the files apart */
+typedef enum {
+    stageNone = 0,      ///< only its metadata is known
+    stageHeader,        ///< the container header has been read, so some stream parameters are known
+    stageStreams,       ///< probed in full
+    stageComplete       ///< nothing more to learn, including the error scan, if one applies
+} tProbeStage;
+
+/* why a file's probe gave up. Such a file is never ranked either way, nor removed */
+typedef enum {
+    failNone = 0,
+    failCrashed,        ///< the probe crashed, taking its worker with it
+    failTimedOut        ///< the probe ran past the deadline
+} tProbeFailure;
+
+/* the groups of fields processMediaInfo() can be asked for. Anything not asked for is left zero,
+ * and the work to find it is skipped */
+typedef enum {
+    attrContainer = 0x01,   ///< duration, bitrate and chapter count
+    attrVideo     = 0x02,   ///< video codec, resolution, frame rate and scan type
+    attrColour    = 0x04,   ///< bit depth, colour and dynamic range
+    attrAudio     = 0x08,   ///< every audio stream: codec, channels and language
+    attrAll       = 0x0f
+} tAttribute;
+
+/* the columns of a listing */
+typedef enum {
+    columnDuration   = 0x001,
+    columnBitrate    = 0x002,
+    columnVideo      = 0x004,   ///< video codec
+    columnResolution = 0x008,
+    columnFrameRate  = 0x010,   ///< with the scan type
+    columnRange      = 0x020,   ///< dynamic range
+    columnAudio      = 0x040,   ///< audio codec
+    columnChannels   = 0x080,
+    columnLanguage   = 0x100,
+    columnErrors     = 0x200,   ///< only with --scan-errors
+    columnAll        = 0x3ff
+} tColumn;
+
+/* just the parts of 'struct stat' that we use */
+typedef struct {
+    mode_t          mode;
+    uid_t           owner;
+    dev_t           device;
+    ino_t           inode;
+    nlink_t         links;
+    off_t           size;
+    struct timespec modified;
+} tFileStat;
+
 typedef struct fileInfo
 {
-    struct fileInfo * next;
     const char      * name;
-
-    unsigned long     score;  /* to determine which is the 'best' file */
+    int               fd;           ///> open for reading while the file is examined, -1 otherwise
 
     struct timespec   duration;
-    struct stat       stat;
+    tFileStat         stat;
+    tProbeStage       stage;
+    tProbeFailure     failure;      ///> set if the probe gave up on it
 
     struct {
         struct
@@ -96,6 +205,7 @@ typedef struct fileInfo
         struct {
             unsigned int count;
         } chapter;
+        int           hinted;       ///> opened with the demuxer guessed up front, without a probe
     } container;
 
     struct {
@@ -108,6 +218,20 @@ typedef struct fileInfo
         unsigned int        frameRate;
         tFrameRateType      frameRateType;
         tScanType           scanType;
+        unsigned int        bitDepth;
+        tChromaFormat       chromaFormat;
+        struct {
+            unsigned int primaries;    ///> ITU-T H.273 code points (2 = unspecified)
+            unsigned int transfer;
+            unsigned int matrix;
+        } colour;
+        struct {
+            tDynamicRange range;
+            unsigned int  maxLuminance;  ///> mastering display peak, in cd/m² (zero if unknown)
+            unsigned int  maxCLL;        ///> maximum content light level, in cd/m²
+            unsigned int  maxFALL;       ///> maximum frame-average light level, in cd/m²
+            unsigned int  doviProfile;   ///> Dolby Vision profile, if signalled
+        } hdr;
         struct {
             tVideoCodec   id;           ///> our tVideoCodec enum, remapped from AV_CODEC_ID
             struct
@@ -142,8 +266,23 @@ typedef struct fileInfo
             int            count;
             tChannelLayout layout;
         } channel;
+        int           objects;         ///> object-based audio (i.e. Atmos) is present
     } audio;
 
+    struct {
+        unsigned int  count;           ///> entries used in 'info'
+        tStreamInfo   info[kMaxStreams];
+    } streams;
+
+    struct {
+        unsigned long packets;         ///> transport packets examined (zero if not scanned)
+        unsigned long sync;            ///> times sync was lost, and had to be searched for
+        unsigned long transport;       ///> packets with the Transport Error Indicator set
+        unsigned long continuity;      ///> continuity counter discontinuities
+        unsigned long pcr;             ///> PCR jumps not flagged as discontinuities
+        unsigned long perMinute;       ///> error density, in thousandths of an error per minute
+    } errors;
+
 } tFileInfo;
 
 /* set up the ffmpeg libraries */
@@ -152,10 +291,67 @@ int initMediaInfo( void );
 /* single line summary */
 void printMediaInfo( tFileInfo * file );
 
+/* format the single line summary into 'buffer', newline included, with just the tColumn
+ * flags in 'columns'. Returns snprintf()'s result */
+int formatMediaInfo( const tFileInfo * file, unsigned int columns, char * buffer, size_t size );
+
+/* parse a comma-separated list of column names (e.g. "duration,height") into tColumn flags.
+ * Returns zero, or -1 if a name isn't recognised */
+int parseColumns( const char * list, unsigned int * columns );
+
+/* the tAttribute flags needed to fill in the given columns */
+unsigned int columnAttributes( unsigned int columns );
+
 /* dump out the media info collected */
 void dumpMediaInfo( tFileInfo * file );
 
-/* populate the media related fields, courtesy of the ffmpeg libraries */
-int processMediaInfo( tFileInfo * file );
+/* populate the media related fields, courtesy of the ffmpeg libraries. 'formatHint' names the
+ * demuxer to try first (e.g. "mpegts"), or is NULL to have libavformat probe for it. 'stage' is
+ * stageHeader to read no more than the container header, or stageStreams for a full probe.
+ * 'attributes' are the tAttribute groups wanted */
+int processMediaInfo( tFileInfo * file, const char * formatHint, tProbeStage stage, unsigned int attributes );
+
+/* returned by processMediaInfo() when the file took longer than the deadline to examine. Not one
+ * of ffmpeg's codes */
+#define kProbeTimedOut  (-0x746d6f75)
+
+/* the longest, in seconds, that processMediaInfo() may spend on any one file. Zero (the default)
+ * is no limit */
+void setProbeDeadline( unsigned int seconds );
+unsigned int probeDeadline( void );
+
+/* free what this thread kept between calls to processMediaInfo(). Call it as a thread finishes */
+void releaseProbeContext( void );
+
+#ifndef NDEBUG
+/* how many allocations processMediaInfo() has made itself, over every thread. libavformat's own
+ * aren't counted */
+unsigned long probeAllocations( void );
+#endif
+
+/* add up what each part of processMediaInfo() costs, across every file, for reportProbeCost() */
+void measureProbeCost( void );
+
+/* the average time each part of processMediaInfo() took, for the files that needed it */
+void reportProbeCost( FILE * output );
+
+/* set the language preferred when choosing between audio streams (e.g. "eng") */
+int setPreferredLanguage( const char * key );
+
+/* the best audio stream in the given language (or in any language, if there are none in it).
+ * Returns an index into file->streams.info[], or -1 if there are no audio streams */
+int bestAudioStream( const tFileInfo * file, tLanguage language );
+
+/* rank two files: > 0 if 'a' is better quality than 'b', < 0 if worse, 0 if equivalent */
+int compareMediaInfo( const tFileInfo * a, const tFileInfo * b );
+
+/* as compareMediaInfo(), for files that may only have been partly examined. Sets 'decided' if
+ * the files got far enough to tell them apart (or to be sure they're equivalent); if not, the
+ * one that's furthest behind needs to be examined further */
+int compareStaged( const tFileInfo * a, const tFileInfo * b, int * decided );
+
+/* whether transport streams are to be scanned for errors. If not (the default), compareStaged()
+ * needn't wait for a scan that will never happen */
+void setErrorScan( int enabled );
 
 #endif //AVCP_FILEMEDIAINFO_H
@@ -0,0 +1,423 @@
+//
+// Linking, copying and removing files on behalf of avcp/avln
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "avcp.h"
+#include "fileops.h"
+#include "recording.h"
+#include "throttle.h"
+
+/* copy in big chunks if copy_file_range() isn't available */
+#define kCopyBufferSize (1024 * 1024)
+
+/* following a recording: copy once this much has been appended, or the writer pauses for this long */
+#define kFollowChunk        (4 * 1024 * 1024)
+#define kFollowPollSeconds  5
+/* where the kernel won't say whether there's still a writer, stop once it's been still this long */
+#define kFollowQuietSeconds 60
+
+/**
+ * @brief build a temporary name in the same directory as 'target', so a rename() will be atomic
+ */
+static int tempName( const char * target, char * temp, size_t size )
+{
+    char dir[PATH_MAX];
+    char base[PATH_MAX];
+
+    /* dirname and basename may modify their argument, so use local copies */
+    strncpy( dir, target, sizeof( dir ) - 1 );
+    dir[sizeof( dir ) - 1] = '\0';
+    strncpy( base, target, sizeof( base ) - 1 );
+    base[sizeof( base ) - 1] = '\0';
+
+    int len = snprintf( temp, size, "%s/.%s.avcp-%d", dirname( dir ), basename( base ), getpid() );
+    if ( len < 0 || (size_t)len >= size )
+    {
+        return ENAMETOOLONG;
+    }
+    return 0;
+}
+
+int linkFile( const char * source, const char * target )
+{
+    char temp[PATH_MAX];
+    int  result = tempName( target, temp, sizeof( temp ));
+
+    if ( result == 0 )
+    {
+        /* link to a temporary name first, then rename over the target, so it's never missing */
+        unlink( temp );
+        if ( link( source, temp ) != 0 )
+        {
+            result = errno;
+            if ( result != EXDEV )
+            {
+                errorf( "unable to link \'%s\' to \'%s\'", source, temp );
+            }
+        }
+        else if ( rename( temp, target ) != 0 )
+        {
+            result = errno;
+            errorf( "unable to rename \'%s\' to \'%s\'", temp, target );
+            unlink( temp );
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief copy 'length' bytes at 'offset' from one fd to the same place in another, in-kernel if
+ * possible. In the background, it goes a chunk at a time, each through the read limit
+ * @return zero, or an errno. '*copied' is how much was, which is less if the source got shorter
+ */
+static int copyRange( int in, int out, off_t offset, off_t length, off_t * copied )
+{
+    off_t inOffset  = offset;
+    off_t outOffset = offset;
+    off_t chunk     = isThrottled() ? kCopyBufferSize : length;
+
+    *copied = 0;
+    while ( *copied < length )
+    {
+        size_t  want  = ( length - *copied < chunk ) ? length - *copied : chunk;
+        ssize_t count = copy_file_range( in, &inOffset, out, &outOffset, want, 0 );
+        if ( count < 0 )
+        {
+            if ( errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP )
+            {
+                break; /* fall back to read/write for the remainder */
+            }
+            return errno;
+        }
+        if ( count == 0 )
+        {
+            return 0; /* the source got shorter */
+        }
+        *copied += count;
+        throttleRead( count );
+    }
+
+    if ( *copied < length )
+    {
+        char * buffer = malloc( kCopyBufferSize );
+        if ( buffer == NULL )
+        {
+            return ENOMEM;
+        }
+
+        ssize_t count = 0;
+        while ( *copied < length )
+        {
+            size_t want = ( length - *copied < kCopyBufferSize ) ? length - *copied : kCopyBufferSize;
+            count = pread( in, buffer, want, offset + *copied );
+            if ( count <= 0 )
+            {
+                break;
+            }
+            throttleRead( count );
+            for ( ssize_t done = 0; done < count; )
+            {
+                ssize_t written = pwrite( out, &buffer[done], count - done, offset + *copied + done );
+                if ( written < 0 )
+                {
+                    free( buffer );
+                    return errno;
+                }
+                done += written;
+            }
+            *copied += count;
+        }
+        free( buffer );
+
+        if ( count < 0 )
+        {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief copy the contents of one fd to another, in-kernel if possible
+ */
+static int copyContents( int in, int out, off_t length )
+{
+    off_t copied;
+
+    return copyRange( in, out, 0, length, &copied );
+}
+
+int copyFile( const char * source, const char * target, int sync )
+{
+    char        temp[PATH_MAX];
+    struct stat sourceStat;
+    int         result = tempName( target, temp, sizeof( temp ));
+
+    if ( result != 0 )
+    {
+        return result;
+    }
+
+    int in = open( source, O_RDONLY );
+    if ( in < 0 )
+    {
+        errorf( "unable to open \'%s\'", source );
+        return errno;
+    }
+
+    if ( fstat( in, &sourceStat ) != 0 )
+    {
+        result = errno;
+        close( in );
+        return result;
+    }
+    posix_fadvise( in, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+    int out = open( temp, O_WRONLY | O_CREAT | O_TRUNC, sourceStat.st_mode & 07777 );
+    if ( out < 0 )
+    {
+        result = errno;
+        errorf( "unable to create \'%s\'", temp );
+        close( in );
+        return result;
+    }
+
+    result = copyContents( in, out, sourceStat.st_size );
+    if ( result == 0 && sync && fsync( out ) != 0 )
+    {
+        result = errno;
+    }
+    close( out );
+    close( in );
+
+    if ( result == 0 && rename( temp, target ) != 0 )
+    {
+        result = errno;
+        errorf( "unable to rename \'%s\' to \'%s\'", temp, target );
+    }
+    if ( result != 0 )
+    {
+        _errorf( result, strerror( result ), "copying \'%s\' to \'%s\' failed", source, target );
+        unlink( temp );
+    }
+    return result;
+}
+
+int publishFile( const char * source, const char * target, int preferLink, int sync )
+{
+    if ( preferLink )
+    {
+        int result = linkFile( source, target );
+        if ( result != EXDEV )
+        {
+            return result;
+        }
+        /* can't hard-link across filesystems, so copy instead */
+    }
+    return copyFile( source, target, sync );
+}
+
+/**
+ * @brief wait for the source to be written to (or closed by its writer), or for a while if it isn't
+ * @return zero, or an errno (ENOENT if the source was removed or renamed)
+ */
+static int awaitChange( int watch )
+{
+    struct pollfd poller = { .fd = watch, .events = POLLIN };
+    char events[ 16 * (sizeof( struct inotify_event ) + NAME_MAX + 1) ];
+
+    if ( poll( &poller, 1, kFollowPollSeconds * 1000 ) < 0 )
+    {
+        return ( errno == EINTR ) ? 0 : errno;
+    }
+    ssize_t length = read( watch, events, sizeof( events ));    /* non-blocking */
+    for ( ssize_t offset = 0; offset < length; )
+    {
+        const struct inotify_event * event = (const struct inotify_event *)&events[ offset ];
+        if ( event->mask & (IN_DELETE_SELF | IN_MOVE_SELF) )
+        {
+            return ENOENT;
+        }
+        offset += sizeof( struct inotify_event ) + event->len;
+    }
+    return 0;
+}
+
+/**
+ * @brief keep the staged copy up to date with the source until it's no longer being written
+ * @param out the staged copy, or -1 if it's a link, so there's only the waiting to do
+ */
+static int followContents( const char * source, int in, int out )
+{
+    int    result = 0;
+    off_t  copied = 0;
+    off_t  length = -1;
+    time_t grew   = time( NULL );
+
+    int watch = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    if ( watch < 0 || inotify_add_watch( watch, source, IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF ) < 0 )
+    {
+        result = errno;
+        errorf( "unable to watch \'%s\'", source );
+        if ( watch >= 0 )
+        {
+            close( watch );
+        }
+        return result;
+    }
+
+    while ( result == 0 )
+    {
+        struct stat sourceStat;
+
+        /* asked before the size, so nothing written before it's let go of is missed */
+        int writer = hasWriter( in );
+        if ( fstat( in, &sourceStat ) != 0 )
+        {
+            result = errno;
+            break;
+        }
+        if ( sourceStat.st_size < copied )
+        {
+            /* the recorder started again from the beginning; what's been copied is no good */
+            fprintf( stderr, "### Error: \'%s\' got shorter while it was being copied\n", source );
+            result = ESTALE;
+            break;
+        }
+
+        if ( sourceStat.st_size != length )
+        {
+            length = sourceStat.st_size;
+            grew   = time( NULL );
+        }
+        off_t pending = sourceStat.st_size - copied;
+
+        /* a little at a time would be a lot of small copies; there's no hurry until it's done */
+        if ( out >= 0 && pending > 0 && (pending >= kFollowChunk || writer != 1) )
+        {
+            off_t count;
+            result = copyRange( in, out, copied, pending, &count );
+            copied += count;
+            if ( result != 0 )
+            {
+                break;
+            }
+        }
+        else if ( out < 0 )
+        {
+            copied = sourceStat.st_size;    /* a link is always up to date */
+        }
+
+        if ( copied == sourceStat.st_size
+          && (writer == 0 || (writer < 0 && time( NULL ) - grew >= kFollowQuietSeconds)) )
+        {
+            break;  /* finished */
+        }
+
+        result = awaitChange( watch );
+    }
+    close( watch );
+
+    if ( result == 0 && out >= 0 && fsync( out ) != 0 )
+    {
+        result = errno;
+    }
+    return result;
+}
+
+int followFile( const char * source, const char * target, int preferLink, char * staged, size_t size )
+{
+    struct stat sourceStat;
+    int result = tempName( target, staged, size );
+
+    if ( result != 0 )
+    {
+        return result;
+    }
+
+    int in = open( source, O_RDONLY );
+    if ( in < 0 || fstat( in, &sourceStat ) != 0 )
+    {
+        result = errno;
+        errorf( "unable to open \'%s\'", source );
+        if ( in >= 0 )
+        {
+            close( in );
+        }
+        return result;
+    }
+    posix_fadvise( in, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+    int out = -1;
+    unlink( staged );
+    if ( !preferLink || link( source, staged ) != 0 )
+    {
+        /* a copy it is, then */
+        out = open( staged, O_WRONLY | O_CREAT | O_TRUNC, sourceStat.st_mode & 07777 );
+        if ( out < 0 )
+        {
+            result = errno;
+            errorf( "unable to create \'%s\'", staged );
+            close( in );
+            return result;
+        }
+    }
+
+    debugf( "following '%s' into '%s'", source, staged );
+    result = followContents( source, in, out );
+
+    if ( out >= 0 )
+    {
+        close( out );
+    }
+    close( in );
+
+    if ( result != 0 )
+    {
+        _errorf( result, strerror( result ), "following \'%s\' failed", source );
+        unlink( staged );
+    }
+    return result;
+}
+
+int publishStaged( const char * staged, const char * target )
+{
+    if ( rename( staged, target ) != 0 )
+    {
+        int result = errno;
+        errorf( "unable to rename \'%s\' to \'%s\'", staged, target );
+        unlink( staged );
+        return result;
+    }
+    return 0;
+}
+
+void discardStaged( const char * staged )
+{
+    unlink( staged );
+}
+
+int removeFile( const char * path )
+{
+    if ( unlink( path ) != 0 )
+    {
+        errorf( "unable to remove \'%s\'", path );
+        return errno;
+    }
+    return 0;
+}
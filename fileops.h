@@ -0,0 +1,34 @@
+//
+// Linking, copying and removing files on behalf of avcp/avln
+//
+
+#ifndef AVCP_FILEOPS_H
+#define AVCP_FILEOPS_H
+
+/* hard-link 'source' to 'target', atomically replacing any existing 'target' */
+int linkFile( const char * source, const char * target );
+
+/* copy 'source' to 'target', atomically replacing any existing 'target'. If 'sync', the copy is
+ * fsync()'d before it's renamed into place; if not, that's left to the caller (a syncfs() of the
+ * whole filesystem, once everything's done, say) */
+int copyFile( const char * source, const char * target, int sync );
+
+/* link if asked to and it's possible (same filesystem), otherwise copy */
+int publishFile( const char * source, const char * target, int preferLink, int sync );
+
+/* copy 'source' to a temporary name beside 'target' while it's still being written, taking each
+ * new range as it's appended, and return once no process has it open for writing. If asked to
+ * link, and it's on the same filesystem, a link is made instead, and it just waits. 'staged' gets
+ * the temporary name, for publishStaged() or discardStaged(). Returns zero, or an errno */
+int followFile( const char * source, const char * target, int preferLink, char * staged, size_t size );
+
+/* put a file staged by followFile() in place as 'target', atomically */
+int publishStaged( const char * staged, const char * target );
+
+/* remove a file staged by followFile() that won't be used after all */
+void discardStaged( const char * staged );
+
+/* remove a file that didn't win */
+int removeFile( const char * path );
+
+#endif //AVCP_FILEOPS_H
@@ -0,0 +1,373 @@
+//
+// Collect just the file metadata avcp uses, with statx() and (where available) io_uring
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "avcp.h"
+#include "filestat.h"
+
+#define kStatMask   (STATX_TYPE | STATX_MODE | STATX_UID | STATX_INO | STATX_NLINK | STATX_SIZE | STATX_MTIME)
+/* a network filesystem may answer from its attribute cache, rather than ask the server */
+#define kStatFlags  AT_STATX_DONT_SYNC
+
+typedef struct {
+    int                    fd;          ///> -1 if not set up (yet), -2 if io_uring is unavailable
+    unsigned int           entries;
+
+    void                 * sqRing;
+    size_t                 sqRingSize;
+    void                 * cqRing;
+    size_t                 cqRingSize;
+    struct io_uring_sqe  * sqes;
+    size_t                 sqesSize;
+
+    unsigned int         * sqHead;
+    unsigned int         * sqTail;
+    unsigned int         * sqMask;
+    unsigned int         * sqArray;
+    unsigned int         * cqHead;
+    unsigned int         * cqTail;
+    unsigned int         * cqMask;
+    struct io_uring_cqe  * cqes;
+} tStatRing;
+
+static tStatRing gRing = { .fd = -1 };
+
+static void copyStatx( tFileStat * stat, const struct statx * source )
+{
+    stat->mode             = source->stx_mode;
+    stat->owner            = source->stx_uid;
+    stat->device           = makedev( source->stx_dev_major, source->stx_dev_minor );
+    stat->inode            = source->stx_ino;
+    stat->links            = source->stx_nlink;
+    stat->size             = source->stx_size;
+    stat->modified.tv_sec  = source->stx_mtime.tv_sec;
+    stat->modified.tv_nsec = source->stx_mtime.tv_nsec;
+}
+
+static void copyStat( tFileStat * stat, const struct stat * source )
+{
+    stat->mode     = source->st_mode;
+    stat->owner    = source->st_uid;
+    stat->device   = source->st_dev;
+    stat->inode    = source->st_ino;
+    stat->links    = source->st_nlink;
+    stat->size     = source->st_size;
+    stat->modified = source->st_mtim;
+}
+
+/**
+ * @brief statx(), falling back to fstatat() on kernels that predate it
+ */
+static int statAt( int dirfd, const char * path, int flags, tFileStat * stat )
+{
+    struct statx sx;
+
+    if ( statx( dirfd, path, flags | kStatFlags, kStatMask, &sx ) == 0 )
+    {
+        copyStatx( stat, &sx );
+        return 0;
+    }
+    if ( errno == ENOSYS )
+    {
+        struct stat st;
+        if ( fstatat( dirfd, path, &st, flags ) == 0 )
+        {
+            copyStat( stat, &st );
+            return 0;
+        }
+    }
+    return errno;
+}
+
+int statFile( int dirfd, const char * path, tFileStat * stat )
+{
+    return statAt( dirfd, path, 0, stat );
+}
+
+int statDescriptor( int fd, tFileStat * stat )
+{
+    return statAt( fd, "", AT_EMPTY_PATH, stat );
+}
+
+static void closeRing( void )
+{
+    if ( gRing.sqes != NULL )
+    {
+        munmap( gRing.sqes, gRing.sqesSize );
+    }
+    if ( gRing.cqRing != NULL && gRing.cqRing != gRing.sqRing )
+    {
+        munmap( gRing.cqRing, gRing.cqRingSize );
+    }
+    if ( gRing.sqRing != NULL )
+    {
+        munmap( gRing.sqRing, gRing.sqRingSize );
+    }
+    if ( gRing.fd >= 0 )
+    {
+        close( gRing.fd );
+    }
+    memset( &gRing, 0, sizeof( gRing ));
+}
+
+/**
+ * @brief set up the io_uring instance, the first time it's needed
+ * @return non-zero if it's usable
+ */
+static int openRing( void )
+{
+    if ( gRing.fd >= 0 )
+    {
+        return 1;
+    }
+    if ( gRing.fd == -2 )
+    {
+        return 0;   /* already tried */
+    }
+
+    struct io_uring_params params;
+    memset( &params, 0, sizeof( params ));
+
+    gRing.fd = syscall( __NR_io_uring_setup, kStatBatchSize, &params );
+    if ( gRing.fd < 0 )
+    {
+        gRing.fd = -2;
+        return 0;
+    }
+    gRing.entries = params.sq_entries;
+
+    gRing.sqRingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned int );
+    gRing.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        if ( gRing.cqRingSize > gRing.sqRingSize )
+        {
+            gRing.sqRingSize = gRing.cqRingSize;
+        }
+        gRing.cqRingSize = gRing.sqRingSize;
+    }
+
+    gRing.sqRing = mmap( NULL, gRing.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         gRing.fd, IORING_OFF_SQ_RING );
+    if ( gRing.sqRing == MAP_FAILED )
+    {
+        gRing.sqRing = NULL;
+    }
+    else if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        gRing.cqRing = gRing.sqRing;
+    }
+    else
+    {
+        gRing.cqRing = mmap( NULL, gRing.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             gRing.fd, IORING_OFF_CQ_RING );
+        if ( gRing.cqRing == MAP_FAILED )
+        {
+            gRing.cqRing = NULL;
+        }
+    }
+
+    gRing.sqesSize = params.sq_entries * sizeof( struct io_uring_sqe );
+    gRing.sqes = mmap( NULL, gRing.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       gRing.fd, IORING_OFF_SQES );
+    if ( gRing.sqes == MAP_FAILED )
+    {
+        gRing.sqes = NULL;
+    }
+
+    if ( gRing.sqRing == NULL || gRing.cqRing == NULL || gRing.sqes == NULL )
+    {
+        closeRing();
+        gRing.fd = -2;
+        return 0;
+    }
+
+    uint8_t * sq = gRing.sqRing;
+    gRing.sqHead  = (unsigned int *)(sq + params.sq_off.head);
+    gRing.sqTail  = (unsigned int *)(sq + params.sq_off.tail);
+    gRing.sqMask  = (unsigned int *)(sq + params.sq_off.ring_mask);
+    gRing.sqArray = (unsigned int *)(sq + params.sq_off.array);
+
+    uint8_t * cq = gRing.cqRing;
+    gRing.cqHead  = (unsigned int *)(cq + params.cq_off.head);
+    gRing.cqTail  = (unsigned int *)(cq + params.cq_off.tail);
+    gRing.cqMask  = (unsigned int *)(cq + params.cq_off.ring_mask);
+    gRing.cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 1;
+}
+
+void closeFileStat( void )
+{
+    if ( gRing.fd >= 0 )
+    {
+        closeRing();
+    }
+    gRing.fd = -1;
+}
+
+/**
+ * @brief submit up to a ring's worth of statx requests, and wait for them all to complete
+ * @return zero, or an errno value if the ring itself failed (and the batch needs redoing)
+ */
+static int statBatch( const char * const paths[], unsigned int count, struct statx buffers[], int results[] )
+{
+    unsigned int tail = *gRing.sqTail;     /* only we write the tail */
+
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        unsigned int index = tail & *gRing.sqMask;
+        struct io_uring_sqe * sqe = &gRing.sqes[ index ];
+
+        memset( sqe, 0, sizeof( *sqe ));
+        sqe->opcode      = IORING_OP_STATX;
+        sqe->fd          = AT_FDCWD;
+        sqe->addr        = (unsigned long)paths[i];
+        sqe->len         = kStatMask;
+        sqe->off         = (unsigned long)&buffers[i];
+        sqe->statx_flags = kStatFlags;
+        sqe->user_data   = i;
+
+        gRing.sqArray[ index ] = index;
+        ++tail;
+    }
+    __atomic_store_n( gRing.sqTail, tail, __ATOMIC_RELEASE );
+
+    unsigned int completed = 0;
+    unsigned int submitted = 0;
+    while ( completed < count )
+    {
+        int ret = syscall( __NR_io_uring_enter, gRing.fd, count - submitted, count - completed,
+                           IORING_ENTER_GETEVENTS, NULL, 0 );
+        if ( ret < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            return errno;
+        }
+        submitted += ret;
+
+        unsigned int head = *gRing.cqHead;
+        unsigned int cqTail = __atomic_load_n( gRing.cqTail, __ATOMIC_ACQUIRE );
+        while ( head != cqTail )
+        {
+            const struct io_uring_cqe * cqe = &gRing.cqes[ head & *gRing.cqMask ];
+            if ( cqe->user_data < count )
+            {
+                results[ cqe->user_data ] = -cqe->res;
+                ++completed;
+            }
+            ++head;
+        }
+        __atomic_store_n( gRing.cqHead, head, __ATOMIC_RELEASE );
+    }
+    return 0;
+}
+
+void statFiles( const char * const paths[], unsigned int count, tFileStat stats[], int results[] )
+{
+    struct statx buffers[kStatBatchSize];
+    unsigned int done = 0;
+
+    while ( done < count && openRing() )
+    {
+        unsigned int batch = count - done;
+        if ( batch > gRing.entries )
+        {
+            batch = gRing.entries;
+        }
+        if ( batch > kStatBatchSize )
+        {
+            batch = kStatBatchSize;
+        }
+
+        if ( statBatch( &paths[done], batch, buffers, &results[done] ) != 0 )
+        {
+            /* the ring is broken, so finish the job the slow way */
+            closeRing();
+            gRing.fd = -2;
+            break;
+        }
+
+        for ( unsigned int i = 0; i < batch; ++i )
+        {
+            if ( results[done + i] == 0 )
+            {
+                copyStatx( &stats[done + i], &buffers[i] );
+            }
+            else if ( results[done + i] == EINVAL )
+            {
+                /* kernels before 5.6 have io_uring, but not IORING_OP_STATX */
+                results[done + i] = statFile( AT_FDCWD, paths[done + i], &stats[done + i] );
+            }
+        }
+        done += batch;
+    }
+
+    for ( ; done < count; ++done )
+    {
+        results[done] = statFile( AT_FDCWD, paths[done], &stats[done] );
+    }
+}
+
+int physicalOffset( const char * path, uint64_t * offset )
+{
+    int result = 0;
+
+    /* room for the header, and the one extent we ask for */
+    union {
+        struct fiemap header;
+        uint8_t       space[ sizeof( struct fiemap ) + sizeof( struct fiemap_extent ) ];
+    } map;
+
+    *offset = 0;
+
+    int fd = open( path, O_RDONLY | O_NONBLOCK | O_CLOEXEC );
+    if ( fd < 0 )
+    {
+        return errno;
+    }
+
+    /* just the extent holding the first byte, without forcing any pending writes out first */
+    memset( &map, 0, sizeof( map ));
+    map.header.fm_start        = 0;
+    map.header.fm_length       = 1;
+    map.header.fm_flags        = 0;
+    map.header.fm_extent_count = 1;
+
+    if ( ioctl( fd, FS_IOC_FIEMAP, &map.header ) != 0 )
+    {
+        result = errno;     /* e.g. EOPNOTSUPP, if the filesystem doesn't support it */
+    }
+    else if ( map.header.fm_mapped_extents == 0
+           || (map.header.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN) != 0 )
+    {
+        result = ENODATA;   /* empty, or not yet allocated */
+    }
+    else
+    {
+        *offset = map.header.fm_extents[0].fe_physical;
+    }
+
+    close( fd );
+    return result;
+}
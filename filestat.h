@@ -0,0 +1,33 @@
+//
+// Collect just the file metadata avcp uses, with statx() and (where available) io_uring
+//
+
+#ifndef AVCP_FILESTAT_H
+#define AVCP_FILESTAT_H
+
+#include <stdint.h>
+
+#include "filemediainfo.h"
+
+/* how many paths statFiles() submits to the kernel at once */
+#define kStatBatchSize  64
+
+/* fill in 'stat' for 'path' (relative to the directory open on 'dirfd', or AT_FDCWD).
+ * Returns zero, or an errno value */
+int statFile( int dirfd, const char * path, tFileStat * stat );
+
+/* the same, for the file already open on 'fd' */
+int statDescriptor( int fd, tFileStat * stat );
+
+/* stat 'count' paths at once. results[i] is zero, or the errno value for paths[i].
+ * Up to kStatBatchSize are in flight at once, through io_uring if the kernel allows it */
+void statFiles( const char * const paths[], unsigned int count, tFileStat stats[], int results[] );
+
+/* where the start of the file is on its device, according to FIEMAP. Returns zero, or an errno
+ * value (e.g. EOPNOTSUPP if the filesystem can't say, or ENODATA if nothing's allocated yet) */
+int physicalOffset( const char * path, uint64_t * offset );
+
+/* release the io_uring instance statFiles() may have set up */
+void closeFileStat( void );
+
+#endif //AVCP_FILESTAT_H
@@ -0,0 +1,282 @@
+//
+// Compact, append-only table of the files examined
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "avcp.h"
+#include "filetable.h"
+
+#define kChunkShift     12
+#define kChunkSize      (1 << kChunkShift)     /* entries per chunk */
+#define kChunkMask      (kChunkSize - 1)
+
+#define kStringBlockSize  (64 * 1024)
+
+/* tChunk.flags */
+#define kFlagScanned    0x01    /* errors.perMinute is valid */
+#define kFlagHasAudio   0x02    /* audio[] is valid */
+#define kFlagPresent    0x04    /* the entry has been stored */
+
+typedef struct {
+    const char * path;
+    const char * containerName;
+    const char * videoName;
+    const char * audioName;
+    tFileStat    stat;
+    uint32_t     bitrate;
+    uint16_t     width;
+} tColdInfo;
+
+/* entries by the order the files were given in, though they're stored as they complete. A chunk
+ * never moves once allocated, so a pointer into one stays valid. The fields compareMediaInfo()
+ * ranks on are kept as parallel arrays ('hot'), apart from those only needed to list a file */
+typedef struct {
+    /* hot */
+    uint32_t     duration[kChunkSize];       /* seconds */
+    uint32_t     frameRate[kChunkSize];
+    uint32_t     errorDensity[kChunkSize];
+    uint16_t     height[kChunkSize];
+    uint8_t      streamCount[kChunkSize];
+    uint8_t      flags[kChunkSize];
+    uint8_t      scanType[kChunkSize];
+    uint8_t      range[kChunkSize];
+    uint8_t      videoCodec[kChunkSize];
+    uint8_t      bitDepth[kChunkSize];
+    uint8_t      stage[kChunkSize];           /* how far it's been examined (tProbeStage) */
+    uint8_t      failure[kChunkSize];         /* why its probe gave up, if it did (tProbeFailure) */
+    tStreamInfo  audio[kChunkSize];           /* the stream chosen to represent the audio */
+
+    /* cold */
+    tColdInfo    cold[kChunkSize];
+} tChunk;
+
+typedef struct stringBlock {
+    struct stringBlock * next;
+    size_t               used;
+    size_t               size;
+    char                 data[];
+} tStringBlock;
+
+struct fileTable {
+    unsigned long   count;          /* one more than the highest index stored */
+    unsigned long   chunkCount;     /* entries used in 'chunks' (some may be NULL) */
+    unsigned long   chunkLimit;     /* capacity of 'chunks' */
+    tChunk       ** chunks;
+    tStringBlock  * strings;        /* the block currently being filled is at the head */
+};
+
+tFileTable * newFileTable( void )
+{
+    return calloc( 1, sizeof( tFileTable ));
+}
+
+void freeFileTable( tFileTable * table )
+{
+    if ( table != NULL )
+    {
+        for ( unsigned long i = 0; i < table->chunkCount; ++i )
+        {
+            free( table->chunks[i] );   /* may be NULL */
+        }
+        free( table->chunks );
+
+        tStringBlock * block = table->strings;
+        while ( block != NULL )
+        {
+            tStringBlock * next = block->next;
+            free( block );
+            block = next;
+        }
+        free( table );
+    }
+}
+
+/**
+ * @brief copy a string into the arena, where the paths are packed end to end rather than
+ * allocated one by one
+ * @return the arena's copy, or NULL if memory ran out
+ */
+static const char * internString( tFileTable * table, const char * string )
+{
+    size_t length = strlen( string ) + 1;
+    tStringBlock * block = table->strings;
+
+    if ( block == NULL || block->size - block->used < length )
+    {
+        size_t size = (length > kStringBlockSize) ? length : kStringBlockSize;
+        block = malloc( sizeof( tStringBlock ) + size );
+        if ( block == NULL )
+        {
+            return NULL;
+        }
+        block->used = 0;
+        block->size = size;
+        block->next = table->strings;
+        table->strings = block;
+    }
+
+    char * copy = &block->data[ block->used ];
+    memcpy( copy, string, length );
+    block->used += length;
+    return copy;
+}
+
+int storeFile( tFileTable * table, unsigned long index, const tFileInfo * file )
+{
+    unsigned long chunkIndex = index >> kChunkShift;
+
+    if ( chunkIndex >= table->chunkLimit )
+    {
+        /* only the array of chunk pointers grows; the chunks themselves never move */
+        unsigned long limit = (table->chunkLimit == 0) ? 16 : table->chunkLimit;
+        while ( limit <= chunkIndex )
+        {
+            limit *= 2;
+        }
+        tChunk ** chunks = realloc( table->chunks, limit * sizeof( tChunk * ));
+        if ( chunks == NULL )
+        {
+            return ENOMEM;
+        }
+        memset( &chunks[ table->chunkLimit ], 0, (limit - table->chunkLimit) * sizeof( tChunk * ));
+        table->chunks     = chunks;
+        table->chunkLimit = limit;
+    }
+    if ( table->chunks[ chunkIndex ] == NULL )
+    {
+        /* zeroed, so every entry starts out absent */
+        table->chunks[ chunkIndex ] = calloc( 1, sizeof( tChunk ));
+        if ( table->chunks[ chunkIndex ] == NULL )
+        {
+            return ENOMEM;
+        }
+    }
+    if ( chunkIndex >= table->chunkCount )
+    {
+        table->chunkCount = chunkIndex + 1;
+    }
+
+    tChunk * chunk = table->chunks[ chunkIndex ];
+    unsigned int i = index & kChunkMask;
+
+    /* stored again after each round of ranking, by which time the path's already kept */
+    const char * path = (chunk->flags[i] & kFlagPresent) ? chunk->cold[i].path : internString( table, file->name );
+    if ( path == NULL )
+    {
+        return ENOMEM;
+    }
+
+    chunk->duration[i]     = file->container.duration;
+    chunk->frameRate[i]    = file->video.frameRate;
+    chunk->errorDensity[i] = (file->errors.perMinute > UINT32_MAX) ? UINT32_MAX : file->errors.perMinute;
+    chunk->height[i]       = file->video.height;
+    chunk->streamCount[i]  = (file->container.stream.count > UINT8_MAX) ? UINT8_MAX : file->container.stream.count;
+    chunk->scanType[i]     = file->video.scanType;
+    chunk->range[i]        = file->video.hdr.range;
+    chunk->videoCodec[i]   = file->video.codec.id;
+    chunk->bitDepth[i]     = file->video.bitDepth;
+    chunk->stage[i]        = file->stage;
+    chunk->failure[i]      = file->failure;
+
+    chunk->flags[i] = kFlagPresent;
+    if ( file->errors.packets > 0 )
+    {
+        chunk->flags[i] |= kFlagScanned;
+    }
+
+    /* keep only the audio stream processMediaInfo() selected */
+    for ( unsigned int s = 0; s < file->streams.count; ++s )
+    {
+        if ( file->streams.info[s].type == streamTypeAudio
+          && file->streams.info[s].index == file->audio.streamIndex )
+        {
+            chunk->flags[i] |= kFlagHasAudio;
+            chunk->audio[i] = file->streams.info[s];
+            break;
+        }
+    }
+
+    tColdInfo * cold = &chunk->cold[i];
+    cold->path          = path;
+    cold->containerName = file->container.name.brief;
+    cold->videoName     = file->video.codec.name.brief;
+    cold->audioName     = file->audio.codec.name.brief;
+    cold->stat          = file->stat;
+    cold->bitrate       = (file->container.bitrate > UINT32_MAX) ? UINT32_MAX : file->container.bitrate;
+    cold->width         = file->video.width;
+
+    if ( index >= table->count )
+    {
+        table->count = index + 1;
+    }
+    return 0;
+}
+
+unsigned long fileCount( const tFileTable * table )
+{
+    return table->count;
+}
+
+int getFileInfo( const tFileTable * table, unsigned long index, tFileInfo * file )
+{
+    const tChunk * chunk = (index < table->count) ? table->chunks[ index >> kChunkShift ] : NULL;
+    unsigned int i = index & kChunkMask;
+
+    memset( file, 0, sizeof( tFileInfo ));
+    file->fd = -1;
+
+    if ( chunk == NULL || (chunk->flags[i] & kFlagPresent) == 0 )
+    {
+        return ENOENT;
+    }
+    const tColdInfo * cold = &chunk->cold[i];
+
+    file->name                  = cold->path;
+    file->stat                  = cold->stat;
+    file->stage                 = chunk->stage[i];
+    file->failure               = chunk->failure[i];
+    file->container.name.brief  = cold->containerName;
+    file->container.bitrate     = cold->bitrate;
+    file->container.duration    = chunk->duration[i];
+    file->container.stream.count = chunk->streamCount[i];
+
+    file->video.width           = cold->width;
+    file->video.height          = chunk->height[i];
+    file->video.frameRate       = chunk->frameRate[i];
+    file->video.scanType        = chunk->scanType[i];
+    file->video.hdr.range       = chunk->range[i];
+    file->video.bitDepth        = chunk->bitDepth[i];
+    file->video.codec.id        = chunk->videoCodec[i];
+    file->video.codec.name.brief = cold->videoName;
+
+    if ( chunk->flags[i] & kFlagScanned )
+    {
+        file->errors.packets   = 1; /* the count itself isn't kept, only that it was scanned */
+        file->errors.perMinute = chunk->errorDensity[i];
+    }
+
+    file->audio.streamIndex = -1;
+    if ( chunk->flags[i] & kFlagHasAudio )
+    {
+        const tStreamInfo * audio = &chunk->audio[i];
+
+        file->streams.count   = 1;
+        file->streams.info[0] = *audio;
+
+        file->audio.streamIndex    = audio->index;
+        file->audio.codec.id       = audio->codec;
+        file->audio.codec.name.brief = cold->audioName;
+        file->audio.language       = audio->language;
+        file->audio.bitrate        = audio->bitrate;
+        file->audio.channel.count  = audio->channels;
+        file->audio.channel.layout = audio->layout;
+        file->audio.objects        = audio->objects;
+    }
+    return 0;
+}
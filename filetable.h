@@ -0,0 +1,26 @@
+//
+// Compact, append-only table of the files examined
+//
+
+#ifndef AVCP_FILETABLE_H
+#define AVCP_FILETABLE_H
+
+#include "filemediainfo.h"
+
+typedef struct fileTable tFileTable;
+
+tFileTable * newFileTable( void );
+void freeFileTable( tFileTable * table );
+
+/* copy the listing and ranking fields of 'file' into entry 'index' of the table, in O(1).
+ * Entries may be stored in any order. Returns zero, or ENOMEM. Not thread-safe */
+int storeFile( tFileTable * table, unsigned long index, const tFileInfo * file );
+
+/* one more than the highest index stored */
+unsigned long fileCount( const tFileTable * table );
+
+/* reconstitute an entry's listing and ranking fields (everything printMediaInfo()
+ * and compareMediaInfo() use) into 'file'. Returns ENOENT if nothing was stored at 'index' */
+int getFileInfo( const tFileTable * table, unsigned long index, tFileInfo * file );
+
+#endif //AVCP_FILETABLE_H
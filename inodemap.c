@@ -0,0 +1,139 @@
+//
+// Probe results shared between the names of a hardlinked file, for the length of a run
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "avcp.h"
+#include "inodemap.h"
+
+#define kBucketShift    10
+#define kBucketCount    (1 << kBucketShift)
+
+/* only for the length of a run, as the content may change between them */
+typedef struct inodeEntry {
+    struct inodeEntry * next;
+    dev_t               device;
+    ino_t               inode;
+    int                 published;  ///> 'info' is valid
+    tFileInfo           info;
+} tInodeEntry;
+
+static tInodeEntry * gBucket[kBucketCount];
+
+/* claims come from the worker threads; 'gPublished' wakes those waiting on another's probe */
+static pthread_mutex_t gInodeLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gPublished = PTHREAD_COND_INITIALIZER;
+
+static unsigned int hashInode( dev_t device, ino_t inode )
+{
+    uint64_t h = ((uint64_t)inode ^ ((uint64_t)device << 32)) * 0x9E3779B97F4A7C15ULL;
+    return h >> (64 - kBucketShift);
+}
+
+static tInodeEntry * findInode( dev_t device, ino_t inode )
+{
+    tInodeEntry * entry = gBucket[ hashInode( device, inode ) ];
+    while ( entry != NULL && (entry->device != device || entry->inode != inode) )
+    {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+/**
+ * @brief copy the probe result for another name of the same inode, leaving 'file' its own identity
+ */
+static void copyInfo( tFileInfo * file, const tFileInfo * info )
+{
+    const char * name = file->name;
+    int          fd   = file->fd;
+    tFileStat    stat = file->stat;
+
+    *file = *info;
+
+    file->name = name;
+    file->fd   = fd;
+    file->stat = stat;
+}
+
+tInodeClaim claimInode( tFileInfo * file, tProbeStage stage )
+{
+    tInodeClaim claim = inodeClaimed;
+
+    pthread_mutex_lock( &gInodeLock );
+
+    tInodeEntry * entry = findInode( file->stat.device, file->stat.inode );
+    if ( entry == NULL )
+    {
+        entry = calloc( 1, sizeof( tInodeEntry ));
+        if ( entry != NULL )
+        {
+            unsigned int bucket = hashInode( file->stat.device, file->stat.inode );
+
+            entry->device = file->stat.device;
+            entry->inode  = file->stat.inode;
+            entry->next   = gBucket[ bucket ];
+            gBucket[ bucket ] = entry;
+        }
+        /* if memory ran out, it's simply probed again under this name */
+    }
+    else
+    {
+        /* the claimant publishes before it can block on anything, so this wait is short */
+        while ( !entry->published )
+        {
+            pthread_cond_wait( &gPublished, &gInodeLock );
+        }
+        if ( entry->info.stage >= stage )
+        {
+            copyInfo( file, &entry->info );
+            claim = inodeShared;
+        }
+        else
+        {
+            /* not examined as far as this name needs, so this one takes it further */
+            entry->published = 0;
+        }
+    }
+
+    pthread_mutex_unlock( &gInodeLock );
+    return claim;
+}
+
+void publishInode( const tFileInfo * file )
+{
+    pthread_mutex_lock( &gInodeLock );
+
+    tInodeEntry * entry = findInode( file->stat.device, file->stat.inode );
+    if ( entry != NULL && !entry->published )
+    {
+        entry->info      = *file;
+        entry->info.name = NULL;    /* belongs to the caller */
+        entry->info.fd   = -1;
+        entry->published = 1;
+        pthread_cond_broadcast( &gPublished );
+    }
+
+    pthread_mutex_unlock( &gInodeLock );
+}
+
+void freeInodeMap( void )
+{
+    pthread_mutex_lock( &gInodeLock );
+    for ( unsigned int i = 0; i < kBucketCount; ++i )
+    {
+        tInodeEntry * entry = gBucket[i];
+        while ( entry != NULL )
+        {
+            tInodeEntry * next = entry->next;
+            free( entry );
+            entry = next;
+        }
+        gBucket[i] = NULL;
+    }
+    pthread_mutex_unlock( &gInodeLock );
+}
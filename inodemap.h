@@ -0,0 +1,27 @@
+//
+// Probe results shared between the names of a hardlinked file, for the length of a run
+//
+
+#ifndef AVCP_INODEMAP_H
+#define AVCP_INODEMAP_H
+
+#include "filemediainfo.h"
+
+typedef enum {
+    inodeClaimed,   ///> the first name seen for this inode; probe it, then call publishInode()
+    inodeShared     ///> another name has already been probed, and its result copied into 'file'
+} tInodeClaim;
+
+/* look up the file's (device, inode). If another name for it is still being probed, wait for
+ * that to finish. If it got at least as far as 'stage', its result is shared; 'file' keeps its
+ * own name, descriptor and stat. Only worth calling for files with more than one link */
+tInodeClaim claimInode( tFileInfo * file, tProbeStage stage );
+
+/* make the result of probing a claimed inode available to its other names. Must be called for
+ * every claim, whatever the outcome of the probe, or those names will wait forever */
+void publishInode( const tFileInfo * file );
+
+/* release everything */
+void freeInodeMap( void );
+
+#endif //AVCP_INODEMAP_H
@@ -0,0 +1,795 @@
+//
+// H.264 and H.265 parameter set parsing, directly from the bitstream
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "avcp.h"
+#include "bitreader.h"
+#include "nalparse.h"
+
+/* an SPS is normally a few dozen bytes; scaling lists can make it a few hundred */
+#define kMaxRBSP    1024
+
+/* H.273 'unspecified' code point, used for primaries, transfer and matrix */
+#define kColourUnspecified  2
+
+/**
+ * @brief strip the emulation prevention bytes (the 03 in 00 00 03) from a NAL unit
+ * @return the number of bytes written to rbsp
+ */
+static size_t unescapeNAL( const uint8_t * nal, size_t size, uint8_t * rbsp, size_t max )
+{
+    size_t length = 0;
+    unsigned int zeros = 0;
+
+    for ( size_t i = 0; i < size && length < max; ++i )
+    {
+        if ( zeros >= 2 && nal[i] == 0x03 )
+        {
+            zeros = 0;
+            continue;
+        }
+        zeros = (nal[i] == 0) ? zeros + 1 : 0;
+        rbsp[length++] = nal[i];
+    }
+    return length;
+}
+
+static void initParameters( tVideoParameters * params )
+{
+    memset( params, 0, sizeof( tVideoParameters ));
+    params->bitDepth     = 8;
+    params->chromaFormat = chroma420;
+    params->scanType     = scanUnknown;
+    params->primaries    = kColourUnspecified;
+    params->transfer     = kColourUnspecified;
+    params->matrix       = kColourUnspecified;
+}
+
+static tChromaFormat chromaFormat( uint32_t chromaFormatIdc )
+{
+    switch ( chromaFormatIdc )
+    {
+    case 0:  return chroma400;
+    case 1:  return chroma420;
+    case 2:  return chroma422;
+    case 3:  return chroma444;
+    default: return chromaUnknown;
+    }
+}
+
+/* video_signal_type, common to both H.264 and H.265 VUI */
+static void parseVideoSignalType( tBitReader * reader, tVideoParameters * params )
+{
+    if ( readBit( reader ))     /* video_signal_type_present_flag */
+    {
+        skipBits( reader, 3 );  /* video_format */
+        skipBits( reader, 1 );  /* video_full_range_flag */
+        if ( readBit( reader )) /* colour_description_present_flag */
+        {
+            params->primaries = readBits( reader, 8 );
+            params->transfer  = readBits( reader, 8 );
+            params->matrix    = readBits( reader, 8 );
+        }
+    }
+}
+
+static void parseAspectAndOverscan( tBitReader * reader )
+{
+    if ( readBit( reader ))         /* aspect_ratio_info_present_flag */
+    {
+        if ( readBits( reader, 8 ) == 255 ) /* Extended_SAR */
+        {
+            skipBits( reader, 32 ); /* sar_width, sar_height */
+        }
+    }
+    if ( readBit( reader ))         /* overscan_info_present_flag */
+    {
+        skipBits( reader, 1 );      /* overscan_appropriate_flag */
+    }
+}
+
+static void skipScalingList( tBitReader * reader, unsigned int size )
+{
+    int lastScale = 8;
+    int nextScale = 8;
+    for ( unsigned int j = 0; j < size && nextScale != 0; ++j )
+    {
+        nextScale = (lastScale + readSE( reader ) + 256) % 256;
+        if ( nextScale != 0 )
+        {
+            lastScale = nextScale;
+        }
+    }
+}
+
+/**
+ * @brief parse an H.264 seq_parameter_set_rbsp(), as per section 7.3.2.1.1
+ */
+static int parseH264SPS( tBitReader * reader, tVideoParameters * params )
+{
+    skipBits( reader, 8 );     /* NAL header */
+
+    params->profile = readBits( reader, 8 );
+    skipBits( reader, 8 );     /* constraint_set flags */
+    params->level   = readBits( reader, 8 );   /* level_idc is already in tenths */
+    readUE( reader );          /* seq_parameter_set_id */
+
+    switch ( params->profile )
+    {
+    case 100: case 110: case 122: case 244: case 44:
+    case 83:  case 86:  case 118: case 128: case 138:
+    case 139: case 134: case 135:
+        {
+            uint32_t chromaFormatIdc = readUE( reader );
+            params->chromaFormat = chromaFormat( chromaFormatIdc );
+            if ( chromaFormatIdc == 3 )
+            {
+                skipBits( reader, 1 );  /* separate_colour_plane_flag */
+            }
+            params->bitDepth = readUE( reader ) + 8;
+            readUE( reader );           /* bit_depth_chroma_minus8 */
+            skipBits( reader, 1 );      /* qpprime_y_zero_transform_bypass_flag */
+            if ( readBit( reader ))     /* seq_scaling_matrix_present_flag */
+            {
+                unsigned int count = (chromaFormatIdc != 3) ? 8 : 12;
+                for ( unsigned int i = 0; i < count; ++i )
+                {
+                    if ( readBit( reader ))
+                    {
+                        skipScalingList( reader, (i < 6) ? 16 : 64 );
+                    }
+                }
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    readUE( reader );                   /* log2_max_frame_num_minus4 */
+    switch ( readUE( reader ))          /* pic_order_cnt_type */
+    {
+    case 0:
+        readUE( reader );               /* log2_max_pic_order_cnt_lsb_minus4 */
+        break;
+
+    case 1:
+        {
+            skipBits( reader, 1 );      /* delta_pic_order_always_zero_flag */
+            readSE( reader );           /* offset_for_non_ref_pic */
+            readSE( reader );           /* offset_for_top_to_bottom_field */
+            uint32_t cycle = readUE( reader );
+            for ( uint32_t i = 0; i < cycle && !reader->overrun; ++i )
+            {
+                readSE( reader );       /* offset_for_ref_frame[i] */
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    readUE( reader );                   /* max_num_ref_frames */
+    skipBits( reader, 1 );              /* gaps_in_frame_num_value_allowed_flag */
+    readUE( reader );                   /* pic_width_in_mbs_minus1 */
+    readUE( reader );                   /* pic_height_in_map_units_minus1 */
+
+    if ( readBit( reader ))             /* frame_mbs_only_flag */
+    {
+        params->scanType = scanProgressive;
+    }
+    else
+    {
+        /* field pictures or MBAFF are possible, which in practice means interlaced */
+        params->scanType = scanInterlaced;
+        skipBits( reader, 1 );          /* mb_adaptive_frame_field_flag */
+    }
+    skipBits( reader, 1 );              /* direct_8x8_inference_flag */
+    if ( readBit( reader ))             /* frame_cropping_flag */
+    {
+        readUE( reader );
+        readUE( reader );
+        readUE( reader );
+        readUE( reader );
+    }
+
+    if ( readBit( reader ) && !reader->overrun )   /* vui_parameters_present_flag */
+    {
+        parseAspectAndOverscan( reader );
+        parseVideoSignalType( reader, params );
+        if ( readBit( reader ))         /* chroma_loc_info_present_flag */
+        {
+            readUE( reader );
+            readUE( reader );
+        }
+        if ( readBit( reader ))         /* timing_info_present_flag */
+        {
+            uint32_t numUnitsInTick = readBits( reader, 32 );
+            uint32_t timeScale      = readBits( reader, 32 );
+            params->fixedFrameRate  = readBit( reader );
+
+            /* a tick is one field, so there are two per frame */
+            if ( numUnitsInTick != 0 && !reader->overrun )
+            {
+                params->frameRate = (unsigned int)(((uint64_t)timeScale * 1000) / (2 * (uint64_t)numUnitsInTick));
+            }
+        }
+    }
+
+    return reader->overrun ? -1 : 0;
+}
+
+/**
+ * @brief skip over an H.265 st_ref_pic_set(), as per section 7.3.7
+ * @return the NumDeltaPocs of this set, which the next set may be predicted from
+ */
+static unsigned int skipShortTermRefPicSet( tBitReader * reader, unsigned int index,
+                                            unsigned int previousDeltaPocs )
+{
+    unsigned int numDeltaPocs = 0;
+
+    if ( index != 0 && readBit( reader ))  /* inter_ref_pic_set_prediction_flag */
+    {
+        skipBits( reader, 1 );             /* delta_rps_sign */
+        readUE( reader );                  /* abs_delta_rps_minus1 */
+        for ( unsigned int j = 0; j <= previousDeltaPocs && !reader->overrun; ++j )
+        {
+            unsigned int used = readBit( reader );    /* used_by_curr_pic_flag */
+            if ( used || readBit( reader ))            /* use_delta_flag */
+            {
+                ++numDeltaPocs;
+            }
+        }
+    }
+    else
+    {
+        uint32_t negative = readUE( reader );
+        uint32_t positive = readUE( reader );
+        for ( uint32_t i = 0; i < negative + positive && !reader->overrun; ++i )
+        {
+            readUE( reader );              /* delta_poc_sx_minus1 */
+            skipBits( reader, 1 );         /* used_by_curr_pic_sx_flag */
+        }
+        numDeltaPocs = negative + positive;
+    }
+    return numDeltaPocs;
+}
+
+/**
+ * @brief parse an H.265 seq_parameter_set_rbsp(), as per section 7.3.2.2
+ */
+static int parseH265SPS( tBitReader * reader, tVideoParameters * params )
+{
+    skipBits( reader, 16 );             /* NAL header */
+
+    skipBits( reader, 4 );              /* sps_video_parameter_set_id */
+    unsigned int maxSubLayersMinus1 = readBits( reader, 3 );
+    skipBits( reader, 1 );              /* sps_temporal_id_nesting_flag */
+
+    /* profile_tier_level( 1, sps_max_sub_layers_minus1 ) */
+    skipBits( reader, 2 );              /* general_profile_space */
+    skipBits( reader, 1 );              /* general_tier_flag */
+    params->profile = readBits( reader, 5 );
+    skipBits( reader, 32 );             /* general_profile_compatibility_flag[32] */
+    unsigned int progressiveSource = readBit( reader );
+    unsigned int interlacedSource  = readBit( reader );
+    skipBits( reader, 2 );              /* non_packed_constraint, frame_only_constraint */
+    skipBits( reader, 44 );             /* the remaining constraint/reserved bits */
+    /* general_level_idc is 30x the level number */
+    params->level = readBits( reader, 8 ) / 3;
+
+    if ( progressiveSource && !interlacedSource )
+    {
+        params->scanType = scanProgressive;
+    }
+    else if ( interlacedSource && !progressiveSource )
+    {
+        params->scanType = scanInterlaced;
+    }
+
+    unsigned int subLayerProfilePresent[8];
+    unsigned int subLayerLevelPresent[8];
+    for ( unsigned int i = 0; i < maxSubLayersMinus1; ++i )
+    {
+        subLayerProfilePresent[i] = readBit( reader );
+        subLayerLevelPresent[i]   = readBit( reader );
+    }
+    if ( maxSubLayersMinus1 > 0 )
+    {
+        skipBits( reader, 2 * (8 - maxSubLayersMinus1) ); /* reserved_zero_2bits */
+    }
+    for ( unsigned int i = 0; i < maxSubLayersMinus1; ++i )
+    {
+        if ( subLayerProfilePresent[i] )
+        {
+            skipBits( reader, 88 );
+        }
+        if ( subLayerLevelPresent[i] )
+        {
+            skipBits( reader, 8 );
+        }
+    }
+
+    readUE( reader );                   /* sps_seq_parameter_set_id */
+    uint32_t chromaFormatIdc = readUE( reader );
+    params->chromaFormat = chromaFormat( chromaFormatIdc );
+    if ( chromaFormatIdc == 3 )
+    {
+        skipBits( reader, 1 );          /* separate_colour_plane_flag */
+    }
+    readUE( reader );                   /* pic_width_in_luma_samples */
+    readUE( reader );                   /* pic_height_in_luma_samples */
+    if ( readBit( reader ))             /* conformance_window_flag */
+    {
+        readUE( reader );
+        readUE( reader );
+        readUE( reader );
+        readUE( reader );
+    }
+    params->bitDepth = readUE( reader ) + 8;
+    readUE( reader );                   /* bit_depth_chroma_minus8 */
+    unsigned int log2MaxPocLsb = readUE( reader ) + 4;
+
+    unsigned int orderingInfoPresent = readBit( reader );
+    for ( unsigned int i = orderingInfoPresent ? 0 : maxSubLayersMinus1; i <= maxSubLayersMinus1; ++i )
+    {
+        readUE( reader );               /* sps_max_dec_pic_buffering_minus1 */
+        readUE( reader );               /* sps_max_num_reorder_pics */
+        readUE( reader );               /* sps_max_latency_increase_plus1 */
+    }
+
+    readUE( reader );                   /* log2_min_luma_coding_block_size_minus3 */
+    readUE( reader );                   /* log2_diff_max_min_luma_coding_block_size */
+    readUE( reader );                   /* log2_min_luma_transform_block_size_minus2 */
+    readUE( reader );                   /* log2_diff_max_min_luma_transform_block_size */
+    readUE( reader );                   /* max_transform_hierarchy_depth_inter */
+    readUE( reader );                   /* max_transform_hierarchy_depth_intra */
+
+    if ( readBit( reader ) && readBit( reader )) /* scaling_list_enabled_flag, sps_scaling_list_data_present_flag */
+    {
+        /* scaling_list_data() */
+        for ( unsigned int sizeId = 0; sizeId < 4; ++sizeId )
+        {
+            for ( unsigned int matrixId = 0; matrixId < 6; matrixId += (sizeId == 3) ? 3 : 1 )
+            {
+                if ( !readBit( reader ))    /* scaling_list_pred_mode_flag */
+                {
+                    readUE( reader );       /* scaling_list_pred_matrix_id_delta */
+                }
+                else
+                {
+                    unsigned int coefNum = 1U << (4 + (sizeId << 1));
+                    if ( coefNum > 64 )
+                    {
+                        coefNum = 64;
+                    }
+                    if ( sizeId > 1 )
+                    {
+                        readSE( reader );   /* scaling_list_dc_coef_minus8 */
+                    }
+                    for ( unsigned int i = 0; i < coefNum; ++i )
+                    {
+                        readSE( reader );   /* scaling_list_delta_coef */
+                    }
+                }
+            }
+        }
+    }
+
+    skipBits( reader, 1 );              /* amp_enabled_flag */
+    skipBits( reader, 1 );              /* sample_adaptive_offset_enabled_flag */
+    if ( readBit( reader ))             /* pcm_enabled_flag */
+    {
+        skipBits( reader, 8 );          /* pcm_sample_bit_depth_luma/chroma_minus1 */
+        readUE( reader );
+        readUE( reader );
+        skipBits( reader, 1 );          /* pcm_loop_filter_disabled_flag */
+    }
+
+    uint32_t numShortTermRefPicSets = readUE( reader );
+    unsigned int numDeltaPocs = 0;
+    for ( uint32_t i = 0; i < numShortTermRefPicSets && i < 64 && !reader->overrun; ++i )
+    {
+        numDeltaPocs = skipShortTermRefPicSet( reader, i, numDeltaPocs );
+    }
+
+    if ( readBit( reader ))             /* long_term_ref_pics_present_flag */
+    {
+        uint32_t count = readUE( reader );
+        for ( uint32_t i = 0; i < count && !reader->overrun; ++i )
+        {
+            skipBits( reader, log2MaxPocLsb + 1 );  /* lt_ref_pic_poc_lsb_sps, used_by_curr_pic_lt_sps_flag */
+        }
+    }
+    skipBits( reader, 1 );              /* sps_temporal_mvp_enabled_flag */
+    skipBits( reader, 1 );              /* strong_intra_smoothing_enabled_flag */
+
+    if ( readBit( reader ) && !reader->overrun )   /* vui_parameters_present_flag */
+    {
+        parseAspectAndOverscan( reader );
+        parseVideoSignalType( reader, params );
+        if ( readBit( reader ))         /* chroma_loc_info_present_flag */
+        {
+            readUE( reader );
+            readUE( reader );
+        }
+        skipBits( reader, 1 );          /* neutral_chroma_indication_flag */
+        if ( readBit( reader ))         /* field_seq_flag */
+        {
+            params->scanType = scanInterlaced;
+        }
+        skipBits( reader, 1 );          /* frame_field_info_present_flag */
+        if ( readBit( reader ))         /* default_display_window_flag */
+        {
+            readUE( reader );
+            readUE( reader );
+            readUE( reader );
+            readUE( reader );
+        }
+        if ( readBit( reader ))         /* vui_timing_info_present_flag */
+        {
+            uint32_t numUnitsInTick = readBits( reader, 32 );
+            uint32_t timeScale      = readBits( reader, 32 );
+
+            if ( numUnitsInTick != 0 && !reader->overrun )
+            {
+                params->frameRate = (unsigned int)(((uint64_t)timeScale * 1000) / numUnitsInTick);
+                params->fixedFrameRate = 1;
+            }
+        }
+    }
+
+    return reader->overrun ? -1 : 0;
+}
+
+static int isSPS( tVideoCodec codec, const uint8_t * nal, size_t size )
+{
+    if ( size < 2 )
+    {
+        return 0;
+    }
+    if ( codec == videoCodecH264 )
+    {
+        return (nal[0] & 0x1F) == 7;
+    }
+    return ((nal[0] >> 1) & 0x3F) == 33;
+}
+
+static int parseSPS( tVideoCodec codec, const uint8_t * nal, size_t size, tVideoParameters * params )
+{
+    uint8_t    rbsp[kMaxRBSP];
+    tBitReader reader;
+
+    initBitReader( &reader, rbsp, unescapeNAL( nal, size, rbsp, sizeof( rbsp )));
+
+    initParameters( params );
+
+    if ( codec == videoCodecH264 )
+    {
+        return parseH264SPS( &reader, params );
+    }
+    return parseH265SPS( &reader, params );
+}
+
+/**
+ * @brief find the next NAL unit in a packet, advancing *offset past it
+ * @param lengthSize zero for an Annex B byte stream (start codes), or the
+ *                   size of the big-endian length prefix for ISO/IEC 14496-15 framing
+ * @return non-zero if a NAL unit was found
+ */
+static int nextNAL( const uint8_t * data, size_t size, unsigned int lengthSize, size_t * offset,
+                    const uint8_t ** nal, size_t * nalSize )
+{
+    size_t i = *offset;
+
+    if ( lengthSize != 0 )
+    {
+        if ( i + lengthSize > size )
+        {
+            return 0;
+        }
+        size_t length = 0;
+        for ( unsigned int j = 0; j < lengthSize; ++j )
+        {
+            length = (length << 8) | data[i++];
+        }
+        if ( length > size - i )
+        {
+            return 0;
+        }
+        *nal     = &data[i];
+        *nalSize = length;
+        *offset  = i + length;
+        return 1;
+    }
+
+    /* find the next start code */
+    while ( i + 3 <= size && (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1) )
+    {
+        ++i;
+    }
+    if ( i + 3 > size )
+    {
+        return 0;
+    }
+    size_t start = i + 3;
+
+    /* and the one after it, to know where this NAL ends */
+    size_t end = start;
+    while ( end + 3 <= size && (data[end] != 0 || data[end + 1] != 0 || data[end + 2] != 1) )
+    {
+        ++end;
+    }
+    if ( end + 3 > size )
+    {
+        end = size;
+    }
+
+    *nal     = &data[start];
+    *nalSize = end - start;
+    *offset  = end;
+    return 1;
+}
+
+/**
+ * @brief walk an Annex B byte stream (NAL units separated by 00 00 01 start codes)
+ */
+static int parseAnnexB( tVideoCodec codec, const uint8_t * data, size_t size, tVideoParameters * params )
+{
+    size_t          offset = 0;
+    const uint8_t * nal;
+    size_t          nalSize;
+
+    while ( nextNAL( data, size, 0, &offset, &nal, &nalSize ))
+    {
+        if ( isSPS( codec, nal, nalSize ))
+        {
+            return parseSPS( codec, nal, nalSize, params );
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief walk an ISO/IEC 14496-15 AVCDecoderConfigurationRecord (avcC)
+ */
+static int parseAvcC( const uint8_t * data, size_t size, tVideoParameters * params )
+{
+    if ( size < 8 )
+    {
+        return -1;
+    }
+    unsigned int count = data[5] & 0x1F;
+    size_t offset = 6;
+
+    for ( unsigned int i = 0; i < count && offset + 2 <= size; ++i )
+    {
+        size_t length = (data[offset] << 8) | data[offset + 1];
+        offset += 2;
+        if ( offset + length > size )
+        {
+            break;
+        }
+        if ( isSPS( videoCodecH264, &data[offset], length ))
+        {
+            return parseSPS( videoCodecH264, &data[offset], length, params );
+        }
+        offset += length;
+    }
+    return -1;
+}
+
+/**
+ * @brief walk an ISO/IEC 14496-15 HEVCDecoderConfigurationRecord (hvcC)
+ */
+static int parseHvcC( const uint8_t * data, size_t size, tVideoParameters * params )
+{
+    if ( size < 23 )
+    {
+        return -1;
+    }
+    unsigned int arrays = data[22];
+    size_t offset = 23;
+
+    for ( unsigned int i = 0; i < arrays && offset + 3 <= size; ++i )
+    {
+        unsigned int count = (data[offset + 1] << 8) | data[offset + 2];
+        offset += 3;
+
+        for ( unsigned int j = 0; j < count && offset + 2 <= size; ++j )
+        {
+            size_t length = (data[offset] << 8) | data[offset + 1];
+            offset += 2;
+            if ( offset + length > size )
+            {
+                return -1;
+            }
+            if ( isSPS( videoCodecH265, &data[offset], length ))
+            {
+                return parseSPS( videoCodecH265, &data[offset], length, params );
+            }
+            offset += length;
+        }
+    }
+    return -1;
+}
+
+int parseVideoParameters( tVideoCodec codec, const uint8_t * data, size_t size, tVideoParameters * params )
+{
+    if ( data == NULL || size < 4 || (codec != videoCodecH264 && codec != videoCodecH265) )
+    {
+        return -1;
+    }
+
+    /* both avcC and hvcC start with a configurationVersion of 1, whereas Annex B starts with a zero */
+    if ( data[0] == 1 )
+    {
+        if ( codec == videoCodecH264 )
+        {
+            return parseAvcC( data, size, params );
+        }
+        return parseHvcC( data, size, params );
+    }
+    return parseAnnexB( codec, data, size, params );
+}
+
+unsigned int nalLengthSize( tVideoCodec codec, const uint8_t * extradata, size_t size )
+{
+    if ( extradata == NULL || extradata[0] != 1 )
+    {
+        return 0; /* Annex B */
+    }
+    if ( codec == videoCodecH264 && size >= 5 )
+    {
+        return (extradata[4] & 0x03) + 1;
+    }
+    if ( codec == videoCodecH265 && size >= 22 )
+    {
+        return (extradata[21] & 0x03) + 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief examine a user_data_registered_itu_t_t35 SEI payload for ST 2094-40 (HDR10+)
+ */
+static int isHDR10Plus( const uint8_t * payload, size_t size )
+{
+    return size >= 6
+        && payload[0] == 0xB5                           /* itu_t_t35_country_code: USA */
+        && payload[1] == 0x00 && payload[2] == 0x3C     /* terminal_provider_code: Samsung */
+        && payload[3] == 0x00 && payload[4] == 0x01     /* terminal_provider_oriented_code */
+        && payload[5] == 0x04;                          /* application_identifier */
+}
+
+/**
+ * @brief walk the sei_message()s in an SEI NAL unit (already unescaped), as per section 7.3.5
+ */
+static void parseSEI( const uint8_t * rbsp, size_t size, tHDRMetadata * hdr )
+{
+    size_t i = 0;
+
+    /* stop short of the rbsp_trailing_bits */
+    while ( i + 2 <= size && rbsp[i] != 0x80 )
+    {
+        unsigned int type = 0;
+        while ( i < size && rbsp[i] == 0xFF )
+        {
+            type += rbsp[i++];
+        }
+        if ( i >= size )
+        {
+            return;
+        }
+        type += rbsp[i++];
+
+        size_t length = 0;
+        while ( i < size && rbsp[i] == 0xFF )
+        {
+            length += rbsp[i++];
+        }
+        if ( i >= size )
+        {
+            return;
+        }
+        length += rbsp[i++];
+
+        if ( length > size - i )
+        {
+            return;
+        }
+        const uint8_t * payload = &rbsp[i];
+
+        switch ( type )
+        {
+        case 4:     /* user_data_registered_itu_t_t35 */
+            if ( isHDR10Plus( payload, length ))
+            {
+                hdr->hdr10Plus = 1;
+            }
+            break;
+
+        case 137:   /* mastering_display_colour_volume */
+            if ( length >= 24 )
+            {
+                /* max_display_mastering_luminance is in units of 0.0001 cd/m² */
+                uint32_t max = ((uint32_t)payload[16] << 24) | (payload[17] << 16)
+                             | (payload[18] << 8) | payload[19];
+                hdr->maxLuminance = max / 10000;
+            }
+            break;
+
+        case 144:   /* content_light_level_info */
+            if ( length >= 4 )
+            {
+                hdr->maxCLL  = (payload[0] << 8) | payload[1];
+                hdr->maxFALL = (payload[2] << 8) | payload[3];
+            }
+            break;
+
+        default:
+            break;
+        }
+        i += length;
+    }
+}
+
+int parseHDRMetadata( tVideoCodec codec, unsigned int lengthSize,
+                      const uint8_t * data, size_t size, tHDRMetadata * hdr )
+{
+    size_t          offset = 0;
+    const uint8_t * nal;
+    size_t          nalSize;
+    uint8_t         rbsp[kMaxRBSP];
+    int             found = 0;
+
+    if ( data == NULL || (codec != videoCodecH264 && codec != videoCodecH265) )
+    {
+        return 0;
+    }
+
+    while ( nextNAL( data, size, lengthSize, &offset, &nal, &nalSize ))
+    {
+        if ( nalSize < 2 )
+        {
+            continue;
+        }
+
+        size_t headerSize;
+        int    isSEI;
+        if ( codec == videoCodecH264 )
+        {
+            headerSize = 1;
+            isSEI = (nal[0] & 0x1F) == 6;
+        }
+        else
+        {
+            unsigned int type = (nal[0] >> 1) & 0x3F;
+            headerSize = 2;
+            isSEI = (type == 39 || type == 40);   /* prefix or suffix SEI */
+
+            if ( type == 62 )   /* UNSPEC62 carries the Dolby Vision RPU */
+            {
+                hdr->doviRPU = 1;
+                found = 1;
+            }
+        }
+
+        if ( isSEI )
+        {
+            /* the payloads we're interested in are small, so a truncated copy is fine */
+            size_t length = unescapeNAL( &nal[headerSize], nalSize - headerSize, rbsp, sizeof( rbsp ));
+            parseSEI( rbsp, length, hdr );
+            found = 1;
+        }
+    }
+    return found;
+}
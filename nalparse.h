@@ -0,0 +1,46 @@
+//
+// H.264 and H.265 parameter set parsing, directly from the bitstream
+//
+
+#ifndef AVCP_NALPARSE_H
+#define AVCP_NALPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "filemediainfo.h"
+
+typedef struct {
+    unsigned int  profile;          ///> profile_idc, as coded
+    unsigned int  level;            ///> in tenths, e.g. 41 for level 4.1
+    unsigned int  bitDepth;         ///> luma bit depth
+    tChromaFormat chromaFormat;
+    tScanType     scanType;
+    unsigned int  frameRate;        ///> in thousandths of a frame per second (zero if not signalled)
+    int           fixedFrameRate;
+    unsigned int  primaries;        ///> ITU-T H.273 code points (2 = unspecified)
+    unsigned int  transfer;
+    unsigned int  matrix;
+} tVideoParameters;
+
+typedef struct {
+    unsigned int  maxLuminance;     ///> mastering display peak, in cd/m² (zero if not present)
+    unsigned int  maxCLL;           ///> maximum content light level, in cd/m²
+    unsigned int  maxFALL;          ///> maximum frame-average light level, in cd/m²
+    int           hdr10Plus;        ///> an ST 2094-40 dynamic metadata SEI was seen
+    int           doviRPU;          ///> a Dolby Vision RPU NAL unit was seen
+} tHDRMetadata;
+
+/* find the first SPS in 'data' (avcC, hvcC or Annex B format) and parse it.
+ * Returns zero if one was found and parsed successfully. */
+int parseVideoParameters( tVideoCodec codec, const uint8_t * data, size_t size, tVideoParameters * params );
+
+/* the size of the NAL length prefix implied by the extradata, or zero for Annex B start codes */
+unsigned int nalLengthSize( tVideoCodec codec, const uint8_t * extradata, size_t size );
+
+/* look through the NAL units in a packet for HDR-related SEI messages and Dolby Vision RPUs.
+ * Returns non-zero if any SEI or RPU NAL units were seen. */
+int parseHDRMetadata( tVideoCodec codec, unsigned int lengthSize,
+                      const uint8_t * data, size_t size, tHDRMetadata * hdr );
+
+#endif //AVCP_NALPARSE_H
@@ -0,0 +1,108 @@
+//
+// Deciding what's put in place, and what's removed, once the files have been ranked
+//
+
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "avcp.h"
+#include "placement.h"
+
+int planPlacement( const tFileTable * table, long best, const tFileInfo * target, const char * staged,
+                   unsigned int flags, tPlan * plan )
+{
+    int result = 0;
+    int decided;
+    unsigned long count = fileCount( table );
+
+    tFileInfo * file   = malloc( sizeof(tFileInfo) );
+    tFileInfo * winner = malloc( sizeof(tFileInfo) );
+    if ( file == NULL || winner == NULL )
+    {
+        free( file );
+        free( winner );
+        return ENOMEM;
+    }
+
+    /* whether the existing target stays, as at least as good as any of them */
+    int kept = 0;
+
+    if ( best >= 0 && getFileInfo( table, best, winner ) != 0 )
+    {
+        best = -1;
+    }
+
+    if ( best >= 0 && winner->container.stream.count == 0 )
+    {
+        /* none of them are media files, so there's nothing to put in place, nor anything to
+         * say the rest aren't wanted */
+        debugf( "none of the files are media" );
+        free( file );
+        free( winner );
+        return 0;
+    }
+
+    if ( best >= 0 && S_ISREG( target->stat.mode )
+      && winner->stat.device == target->stat.device && winner->stat.inode == target->stat.inode )
+    {
+        /* the winner is already in place, under another name */
+        debugf( "'%s' is the same file as '%s'", winner->name, target->name );
+        best = -1;
+        kept = 1;
+    }
+    else if ( best >= 0 && S_ISREG( target->stat.mode ) && compareStaged( winner, target, &decided ) <= 0 )
+    {
+        /* the existing target is at least as good, so leave it be */
+        debugf( "keeping '%s'", target->name );
+        best = -1;
+        kept = ( target->container.stream.count > 0 );
+    }
+    else if ( best < 0 )
+    {
+        /* nothing beat the target - which only counts if there is one, and it's media */
+        kept = ( S_ISREG( target->stat.mode ) && target->container.stream.count > 0 );
+    }
+
+    /* the losers are only removed once the winner's in place, or if the target was kept */
+    int placed = -1;
+    struct stat copy;
+    if ( best == 0 && staged != NULL && staged[0] != '\0'
+      && stat( staged, &copy ) == 0 && copy.st_size == winner->stat.size )
+    {
+        /* the copy's already made, so it only has to be renamed into place */
+        placed = planAction( plan, actionMove, staged, target->name, -1 );
+    }
+    else if ( best >= 0 )
+    {
+        placed = planAction( plan, (flags & placeLink) ? actionLink : actionCopy,
+                             winner->name, target->name, -1 );
+    }
+    if ( best >= 0 && placed < 0 )
+    {
+        result = ENOMEM;
+    }
+
+    if ( result == 0 && (flags & placeRemove) && (placed >= 0 || kept) )
+    {
+        for ( unsigned long i = 0; i < count; ++i )
+        {
+            /* never remove the winner, nor another name for the target, nor one that couldn't be probed */
+            if ( getFileInfo( table, i, file ) != 0
+              || (long)i == best || file->failure != failNone
+              || (file->stat.device == target->stat.device && file->stat.inode == target->stat.inode) )
+            {
+                continue;
+            }
+            if ( planAction( plan, actionDelete, NULL, file->name, placed ) < 0 )
+            {
+                result = ENOMEM;
+                break;
+            }
+        }
+    }
+
+    free( file );
+    free( winner );
+    return result;
+}
@@ -0,0 +1,28 @@
+//
+// Deciding what's put in place, and what's removed, once the files have been ranked
+//
+
+#ifndef AVCP_PLACEMENT_H
+#define AVCP_PLACEMENT_H
+
+#include "filemediainfo.h"
+#include "filetable.h"
+#include "plan.h"
+
+typedef enum {
+    placeLink   = 0x01,     ///< link the winner over the target, rather than copy it
+    placeRemove = 0x02      ///< remove the files that didn't win (-d)
+} tPlacementFlag;
+
+/* plan putting the winner ('best', an index into 'table', or -1 if none beat the target) in place
+ * as 'target', and with placeRemove, removing the rest. 'staged' is a copy of the first file
+ * already made beside the target, or NULL. Nothing is changed yet.
+ *
+ * A file is only removed once the winner is durably in place, or if the target was kept because
+ * it's media at least as good as any of them. Nothing is removed if none of them are media, nor
+ * is the winner, another name for the target, or a file whose probe gave up.
+ * Returns zero, or an errno */
+int planPlacement( const tFileTable * table, long best, const tFileInfo * target, const char * staged,
+                   unsigned int flags, tPlan * plan );
+
+#endif //AVCP_PLACEMENT_H
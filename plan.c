@@ -0,0 +1,423 @@
+//
+// The changes avcp has decided on, planned in full before any of them are made
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "avcp.h"
+#include "fileops.h"
+#include "plan.h"
+#include "reaper.h"
+
+/* the most filesystems a plan is expected to touch; beyond that, they're synced as they're found */
+#define kMaxFilesystems 16
+
+typedef enum {
+    statePending,
+    stateRunning,
+    stateDone,
+    stateHeld       ///> a delete, waiting for everything else to be made and synced
+} tActionState;
+
+typedef struct {
+    tActionKind     kind;
+    const char    * source;     ///> NULL for a delete
+    const char    * target;
+    int             after;      ///> the action that has to succeed first, or -1
+    int             previous;   ///> the last action planned before this one on the same target, or -1
+    tActionState    state;
+    int             result;
+} tAction;
+
+struct plan {
+    tAction       * action;
+    unsigned int    count;
+    unsigned int    size;
+
+    /* while it's being executed */
+    pthread_mutex_t lock;
+    pthread_cond_t  finished;   ///> signalled as each action is done
+    unsigned int    first;      ///> no action before this one is still pending
+};
+
+static const char * actionNames[] = {
+    [actionLink]   = "link",
+    [actionCopy]   = "copy",
+    [actionMove]   = "move",
+    [actionDelete] = "delete"
+};
+
+tPlan * newPlan( void )
+{
+    tPlan * plan = calloc( 1, sizeof( tPlan ));
+    if ( plan != NULL )
+    {
+        pthread_mutex_init( &plan->lock, NULL );
+        pthread_cond_init( &plan->finished, NULL );
+    }
+    return plan;
+}
+
+void freePlan( tPlan * plan )
+{
+    if ( plan != NULL )
+    {
+        pthread_mutex_destroy( &plan->lock );
+        pthread_cond_destroy( &plan->finished );
+        free( plan->action );
+        free( plan );
+    }
+}
+
+int planAction( tPlan * plan, tActionKind kind, const char * source, const char * target, int after )
+{
+    if ( plan->count >= plan->size )
+    {
+        unsigned int size = (plan->size == 0) ? 64 : plan->size * 2;
+        tAction * action = realloc( plan->action, size * sizeof( tAction ));
+        if ( action == NULL )
+        {
+            return -1;
+        }
+        plan->action = action;
+        plan->size   = size;
+    }
+
+    tAction * action = &plan->action[ plan->count ];
+    action->kind     = kind;
+    action->source   = source;
+    action->target   = target;
+    action->after    = after;
+    action->previous = -1;
+    action->state    = statePending;
+    action->result   = 0;
+    return plan->count++;
+}
+
+unsigned int planSize( const tPlan * plan )
+{
+    return plan->count;
+}
+
+void printPlan( const tPlan * plan, FILE * output )
+{
+    for ( unsigned int i = 0; i < plan->count; ++i )
+    {
+        const tAction * action = &plan->action[i];
+
+        fprintf( output, "%4u  %-6s  ", i + 1, actionNames[ action->kind ] );
+        if ( action->source != NULL )
+        {
+            fprintf( output, "'%s' -> ", action->source );
+        }
+        fprintf( output, "'%s'", action->target );
+        if ( action->after >= 0 )
+        {
+            fprintf( output, "  (after %d)", action->after + 1 );
+        }
+        fputc( '\n', output );
+    }
+}
+
+static int compareTargets( const void * a, const void * b, void * context )
+{
+    const tAction * action = context;
+    unsigned int i = *(const unsigned int *)a;
+    unsigned int j = *(const unsigned int *)b;
+
+    /* the deletes are made after everything else, so they're ordered among themselves */
+    int diff = (action[i].kind == actionDelete) - (action[j].kind == actionDelete);
+    if ( diff == 0 )
+    {
+        diff = strcmp( action[i].target, action[j].target );
+    }
+    if ( diff == 0 )
+    {
+        diff = (i > j) - (i < j);
+    }
+    return diff;
+}
+
+/**
+ * @brief chain together the actions on each target, in the order they were planned. The deletes
+ * are made in a wave of their own, so are only chained to each other
+ */
+static int linkTargets( tPlan * plan )
+{
+    unsigned int * order = malloc( plan->count * sizeof( unsigned int ));
+    if ( order == NULL )
+    {
+        return ENOMEM;
+    }
+    for ( unsigned int i = 0; i < plan->count; ++i )
+    {
+        order[i] = i;
+    }
+    qsort_r( order, plan->count, sizeof( unsigned int ), compareTargets, plan->action );
+
+    for ( unsigned int i = 1; i < plan->count; ++i )
+    {
+        const tAction * last = &plan->action[ order[i - 1] ];
+        const tAction * next = &plan->action[ order[i] ];
+        if ( (last->kind == actionDelete) == (next->kind == actionDelete) && strcmp( last->target, next->target ) == 0 )
+        {
+            plan->action[ order[i] ].previous = order[i - 1];
+        }
+    }
+    free( order );
+    return 0;
+}
+
+/**
+ * @brief whether an action can be started. Call with the plan locked
+ * @return 1 if it can, 0 if it has to wait, or -1 if its prerequisite failed
+ */
+static int isReady( const tPlan * plan, const tAction * action )
+{
+    if ( action->previous >= 0 && plan->action[ action->previous ].state != stateDone )
+    {
+        return 0;
+    }
+    if ( action->after >= 0 )
+    {
+        const tAction * after = &plan->action[ action->after ];
+        if ( after->state == stateHeld )
+        {
+            return -1;      /* a delete can't be waited on by anything made before it */
+        }
+        if ( after->state != stateDone )
+        {
+            return 0;
+        }
+        if ( after->result != 0 )
+        {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+static int runAction( const tAction * action )
+{
+    switch ( action->kind )
+    {
+    case actionLink:
+        debugf( "linking '%s' to '%s'", action->source, action->target );
+        return publishFile( action->source, action->target, 1, 0 );
+
+    case actionCopy:
+        debugf( "copying '%s' to '%s'", action->source, action->target );
+        return publishFile( action->source, action->target, 0, 0 );
+
+    case actionMove:
+        debugf( "moving '%s' to '%s'", action->source, action->target );
+        return publishStaged( action->source, action->target );
+
+    case actionDelete:
+        debugf( "removing '%s'", action->target );
+        return trashFile( action->target );
+    }
+    return EINVAL;
+}
+
+static void * executeActions( void * context )
+{
+    tPlan * plan = context;
+
+    pthread_mutex_lock( &plan->lock );
+    while ( plan->first < plan->count )
+    {
+        tAction * ready    = NULL;
+        int       canceled = 0;
+
+        for ( unsigned int i = plan->first; i < plan->count && ready == NULL; ++i )
+        {
+            tAction * action = &plan->action[i];
+            if ( action->state != statePending )
+            {
+                continue;
+            }
+            switch ( isReady( plan, action ))
+            {
+            case 1:
+                ready = action;
+                break;
+
+            case -1:
+                /* what it depended on didn't happen, so neither does this */
+                action->state  = stateDone;
+                action->result = ECANCELED;
+                canceled = 1;
+                pthread_cond_broadcast( &plan->finished );
+                break;
+            }
+        }
+        while ( plan->first < plan->count && plan->action[ plan->first ].state != statePending )
+        {
+            ++plan->first;
+        }
+
+        if ( ready == NULL )
+        {
+            /* having cancelled some, those that depend on them can be too, without waiting */
+            if ( plan->first < plan->count && !canceled )
+            {
+                pthread_cond_wait( &plan->finished, &plan->lock );
+            }
+            continue;
+        }
+
+        ready->state = stateRunning;
+        pthread_mutex_unlock( &plan->lock );
+
+        int result = runAction( ready );
+
+        pthread_mutex_lock( &plan->lock );
+        ready->result = result;
+        ready->state  = stateDone;
+        pthread_cond_broadcast( &plan->finished );
+    }
+    pthread_mutex_unlock( &plan->lock );
+    return NULL;
+}
+
+/**
+ * @brief flush each filesystem changed by the plan's deletes, or by everything else, once
+ */
+static void syncTargets( const tPlan * plan, int deletes )
+{
+    dev_t devices[kMaxFilesystems];
+    unsigned int count = 0;
+
+    for ( unsigned int i = 0; i < plan->count; ++i )
+    {
+        char directory[PATH_MAX];
+        struct stat dirStat;
+
+        if ( plan->action[i].state != stateDone || plan->action[i].result != 0
+          || (plan->action[i].kind == actionDelete) != deletes )
+        {
+            continue;
+        }
+        /* the target's directory is on the filesystem that changed, even if the target's gone */
+        snprintf( directory, sizeof( directory ), "%s", plan->action[i].target );
+        int fd = open( dirname( directory ), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+        if ( fd < 0 )
+        {
+            continue;
+        }
+
+        unsigned int j = 0;
+        if ( fstat( fd, &dirStat ) == 0 )
+        {
+            while ( j < count && devices[j] != dirStat.st_dev )
+            {
+                ++j;
+            }
+        }
+        if ( j == count )
+        {
+            if ( syncfs( fd ) != 0 )
+            {
+                errorf( "unable to sync the filesystem holding \'%s\'", plan->action[i].target );
+            }
+            if ( count < kMaxFilesystems )
+            {
+                devices[ count++ ] = dirStat.st_dev;
+            }
+        }
+        close( fd );
+    }
+}
+
+/**
+ * @brief carry out the pending actions, up to 'workers' at a time
+ */
+static void runActions( tPlan * plan, unsigned int workers )
+{
+    plan->first = 0;
+    if ( workers > plan->count )
+    {
+        workers = plan->count;
+    }
+    pthread_t * thread = calloc( workers, sizeof( pthread_t ));
+    unsigned int started = 0;
+    if ( thread != NULL )
+    {
+        while ( started < workers && pthread_create( &thread[ started ], NULL, executeActions, plan ) == 0 )
+        {
+            ++started;
+        }
+    }
+    if ( started == 0 )
+    {
+        executeActions( plan );     /* no threads to be had, so do it all here */
+    }
+    for ( unsigned int i = 0; i < started; ++i )
+    {
+        pthread_join( thread[i], NULL );
+    }
+    free( thread );
+}
+
+int executePlan( tPlan * plan, unsigned int workers )
+{
+    if ( plan->count == 0 )
+    {
+        return 0;
+    }
+    int result = linkTargets( plan );
+    if ( result != 0 )
+    {
+        return result;
+    }
+
+    /* nothing is removed until what replaces it is safely on disk */
+    unsigned int held = 0;
+    for ( unsigned int i = 0; i < plan->count; ++i )
+    {
+        if ( plan->action[i].kind == actionDelete )
+        {
+            plan->action[i].state = stateHeld;
+            ++held;
+        }
+    }
+    if ( held < plan->count )
+    {
+        runActions( plan, workers );
+        syncTargets( plan, 0 );
+    }
+
+    if ( held > 0 )
+    {
+        for ( unsigned int i = 0; i < plan->count; ++i )
+        {
+            if ( plan->action[i].state == stateHeld )
+            {
+                plan->action[i].state = statePending;
+            }
+        }
+        runActions( plan, workers );
+        syncTargets( plan, 1 );
+    }
+
+    for ( unsigned int i = 0; i < plan->count; ++i )
+    {
+        if ( plan->action[i].result != 0 && plan->action[i].result != ECANCELED )
+        {
+            return plan->action[i].result;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,40 @@
+//
+// The changes avcp has decided on, planned in full before any of them are made
+//
+
+#ifndef AVCP_PLAN_H
+#define AVCP_PLAN_H
+
+#include <stdio.h>
+
+typedef enum {
+    actionLink,     ///> hard-link 'source' over 'target' (copying it if they're on different filesystems)
+    actionCopy,     ///> copy 'source' over 'target'
+    actionMove,     ///> rename 'source' (a copy already made) over 'target'
+    actionDelete    ///> remove 'target'
+} tActionKind;
+
+typedef struct plan tPlan;
+
+tPlan * newPlan( void );
+
+void freePlan( tPlan * plan );
+
+/* add an action. The paths aren't copied, so must outlive the plan. 'after' is the number of an
+ * action that has to succeed first, or -1. Actions on the same target are also made in the order
+ * they were planned. Returns the action's number, or -1 if memory ran out */
+int planAction( tPlan * plan, tActionKind kind, const char * source, const char * target, int after );
+
+/* how many actions there are */
+unsigned int planSize( const tPlan * plan );
+
+/* write the plan out, one action per line */
+void printPlan( const tPlan * plan, FILE * output );
+
+/* make the changes, up to 'workers' at a time, in two waves: everything but the deletes, then
+ * the deletes. After each, every filesystem that was changed is synced once, rather than each file
+ * as it's done, so nothing is removed before what replaces it is durable. An action whose
+ * prerequisite failed isn't attempted. Returns zero, or the errno of the first action to fail */
+int executePlan( tPlan * plan, unsigned int workers );
+
+#endif //AVCP_PLAN_H
@@ -0,0 +1,300 @@
+//
+// Cheap check of a file's name and first few bytes, to avoid probing obviously non-media files
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "avcp.h"
+#include "prefilter.h"
+
+typedef struct {
+    unsigned int  offset;
+    unsigned int  length;
+    const char  * bytes;
+    tContentGuess guess;
+    const char  * format;   ///> the libavformat demuxer that handles it, if it's unambiguous
+} tSignature;
+
+static const tSignature signatures[] =
+    {
+        /* containers */
+        { 0, 4, "\x1A\x45\xDF\xA3",   contentMedia, "matroska" }, /* EBML: Matroska, WebM */
+        { 4, 4, "ftyp",               contentMedia, "mov" },      /* ISO BMFF: MP4, MOV, 3GP */
+        { 4, 4, "moov",               contentMedia, "mov" },
+        { 4, 4, "mdat",               contentMedia, "mov" },
+        { 4, 4, "wide",               contentMedia, "mov" },
+        { 4, 4, "free",               contentMedia, "mov" },
+        { 4, 4, "skip",               contentMedia, "mov" },
+        { 0, 4, "\x00\x00\x01\xBA",   contentMedia, "mpeg" },     /* MPEG program stream */
+        { 0, 4, "\x00\x00\x01\xB3",   contentMedia, "mpegvideo" },/* MPEG-1/2 video sequence header */
+        { 0, 4, "\x00\x00\x00\x01",   contentMedia, NULL },       /* H.264/H.265 Annex B */
+        { 0, 4, "\x30\x26\xB2\x75",   contentMedia, "asf" },      /* ASF, WMV */
+        { 0, 3, "FLV",                contentMedia, "flv" },
+        { 0, 4, "OggS",               contentMedia, "ogg" },
+        { 0, 4, "fLaC",               contentMedia, "flac" },
+        { 0, 3, "ID3",                contentMedia, NULL },       /* tagged MP3 (or AAC) */
+        { 0, 2, "\x0B\x77",           contentMedia, NULL },       /* AC-3, E-AC-3 */
+        { 0, 4, "\x7F\xFE\x80\x01",   contentMedia, "dts" },      /* DTS */
+        { 8, 4, "AVI ",               contentMedia, "avi" },      /* RIFF AVI */
+        { 8, 4, "WAVE",               contentMedia, "wav" },      /* RIFF WAVE */
+
+        /* things that are definitely not */
+        { 0, 3, "\xFF\xD8\xFF",       contentNotMedia, NULL },    /* JPEG */
+        { 0, 8, "\x89PNG\r\n\x1A\n",  contentNotMedia, NULL },
+        { 0, 4, "GIF8",               contentNotMedia, NULL },
+        { 8, 4, "WEBP",               contentNotMedia, NULL },    /* RIFF WebP image */
+        { 0, 4, "%PDF",               contentNotMedia, NULL },
+        { 0, 4, "PK\x03\x04",         contentNotMedia, NULL },    /* zip, and everything built on it */
+        { 0, 6, "7z\xBC\xAF\x27\x1C", contentNotMedia, NULL },
+        { 0, 3, "\x1F\x8B\x08",       contentNotMedia, NULL },    /* gzip */
+        { 0, 5, "<?xml",              contentNotMedia, NULL },
+        { 0, 16, "SQLite format 3",   contentNotMedia, NULL },
+        { 0, 3, "\xEF\xBB\xBF",       contentNotMedia, NULL },    /* UTF-8 byte order mark, i.e. text */
+    };
+
+/* the files that typically accompany recordings. Only trusted if there's no media signature */
+static const char * sidecarExtensions[] =
+    {
+        "nfo", "txt", "log", "xml", "json", "ini", "db",
+        "jpg", "jpeg", "png", "gif", "bmp", "tbn", "webp",
+        "srt", "ass", "ssa", "sub", "idx", "vtt", "edl", "sfv", "md5", "par2",
+        NULL
+    };
+
+typedef struct {
+    const char * extension;
+    const char * format;
+} tExtensionFormat;
+
+/* only consulted when there's no signature to go on */
+static const tExtensionFormat extensionFormats[] =
+    {
+        { "ts",   "mpegts" },   { "m2ts", "mpegts" },   { "mts",  "mpegts" },   { "tp",   "mpegts" },
+        { "mkv",  "matroska" }, { "mka",  "matroska" }, { "webm", "matroska" },
+        { "mp4",  "mov" },      { "m4v",  "mov" },      { "m4a",  "mov" },      { "mov",  "mov" },
+        { "mpg",  "mpeg" },     { "mpeg", "mpeg" },     { "vob",  "mpeg" },
+        { "avi",  "avi" },      { "wmv",  "asf" },      { "asf",  "asf" },      { "flv",  "flv" },
+        { "mp3",  "mp3" },      { "ac3",  "ac3" },      { "flac", "flac" },     { "wav",  "wav" },
+        { NULL, NULL }
+    };
+
+/* a per-directory record of the demuxer that last worked, as recordings tend to be grouped by
+ * source (e.g. every file in a Channels DVR folder is a transport stream) */
+#define kMaxDirectories 16
+
+static struct {
+    char       * directory;
+    const char * format;        ///> one of the static names in extensionFormats[]
+} gDirectoryFormat[kMaxDirectories];
+static unsigned int gNextDirectory = 0;
+static pthread_mutex_t gDirectoryLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief the extension of the last element of the path, if there is one
+ */
+static const char * findExtension( const char * path )
+{
+    const char * dot   = strrchr( path, '.' );
+    const char * slash = strrchr( path, '/' );
+
+    if ( dot != NULL && (slash == NULL || dot > slash) )
+    {
+        return dot + 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief the length of the directory part of the path (zero if there isn't one)
+ */
+static size_t directoryLength( const char * path )
+{
+    const char * slash = strrchr( path, '/' );
+    return (slash == NULL) ? 0 : (size_t)(slash - path);
+}
+
+static int findDirectory( const char * path, size_t length )
+{
+    for ( int i = 0; i < kMaxDirectories; ++i )
+    {
+        const char * directory = gDirectoryFormat[i].directory;
+        if ( directory != NULL && strncmp( directory, path, length ) == 0 && directory[length] == '\0' )
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief libavformat names some demuxers with a list (e.g. "mov,mp4,m4a,3gp,3g2,mj2"), and
+ * av_find_input_format() wants just one of them. Map it to one of ours, which is also static
+ * (so it's safe to hand out after the lock is released). Demuxers we don't know aren't hinted.
+ */
+static const char * findFormatName( const char * name )
+{
+    size_t span = strcspn( name, "," );
+
+    for ( const tExtensionFormat * ext = extensionFormats; ext->extension != NULL; ++ext )
+    {
+        if ( strncmp( ext->format, name, span ) == 0 && ext->format[span] == '\0' )
+        {
+            return ext->format;
+        }
+    }
+    return NULL;
+}
+
+const char * directoryFormat( const char * path )
+{
+    const char * format = NULL;
+
+    pthread_mutex_lock( &gDirectoryLock );
+    int i = findDirectory( path, directoryLength( path ));
+    if ( i >= 0 )
+    {
+        format = gDirectoryFormat[i].format;
+    }
+    pthread_mutex_unlock( &gDirectoryLock );
+
+    return format;
+}
+
+void learnDirectoryFormat( const char * path, const char * format )
+{
+    size_t length = directoryLength( path );
+
+    pthread_mutex_lock( &gDirectoryLock );
+    int i = findDirectory( path, length );
+    if ( i < 0 )
+    {
+        /* replace the oldest */
+        i = gNextDirectory;
+        gNextDirectory = (gNextDirectory + 1) % kMaxDirectories;
+
+        free( gDirectoryFormat[i].directory );
+        gDirectoryFormat[i].directory = strndup( path, length );
+    }
+
+    gDirectoryFormat[i].format = findFormatName( format );
+    pthread_mutex_unlock( &gDirectoryLock );
+}
+
+/**
+ * @brief MPEG transport stream: a sync byte every 188 bytes (or 192, for M2TS)
+ */
+static int isTransportStream( const uint8_t * head, size_t size )
+{
+    if ( size >= 188 * 2 + 1 && head[0] == 0x47 && head[188] == 0x47 && head[188 * 2] == 0x47 )
+    {
+        return 1;
+    }
+    if ( size >= 4 + 192 * 2 + 1 && head[4] == 0x47 && head[4 + 192] == 0x47 && head[4 + 192 * 2] == 0x47 )
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief an MPEG audio frame sync (MP3, MP2), or ADTS (AAC)
+ */
+static int isAudioFrameSync( const uint8_t * head, size_t size )
+{
+    return ( size >= 2 && head[0] == 0xFF && (head[1] & 0xE0) == 0xE0 );
+}
+
+static int hasSidecarExtension( const char * path )
+{
+    const char * extension = findExtension( path );
+
+    if ( extension != NULL )
+    {
+        for ( const char ** ext = sidecarExtensions; *ext != NULL; ++ext )
+        {
+            if ( strcasecmp( extension, *ext ) == 0 )
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static const char * extensionFormat( const char * path )
+{
+    const char * extension = findExtension( path );
+
+    if ( extension != NULL )
+    {
+        for ( const tExtensionFormat * ext = extensionFormats; ext->extension != NULL; ++ext )
+        {
+            if ( strcasecmp( extension, ext->extension ) == 0 )
+            {
+                return ext->format;
+            }
+        }
+    }
+    return NULL;
+}
+
+tContentGuess classifyContent( const char * path, const uint8_t * head, size_t size, const char ** format )
+{
+    *format = NULL;
+
+    if ( isTransportStream( head, size ))
+    {
+        *format = "mpegts";
+        return contentMedia;
+    }
+    if ( isAudioFrameSync( head, size ))
+    {
+        return contentMedia;    /* MP3 and ADTS look much alike, so leave that to the probe */
+    }
+
+    for ( unsigned int i = 0; i < sizeof( signatures ) / sizeof( signatures[0] ); ++i )
+    {
+        const tSignature * sig = &signatures[i];
+        if ( size >= sig->offset + sig->length
+          && memcmp( &head[ sig->offset ], sig->bytes, sig->length ) == 0 )
+        {
+            *format = sig->format;
+            return sig->guess;
+        }
+    }
+
+    if ( size == 0 || hasSidecarExtension( path ) )
+    {
+        /* an empty file has nothing to probe, though it may yet be written to */
+        return contentNotMedia;
+    }
+
+    *format = extensionFormat( path );
+    return contentUnknown;
+}
+
+tContentGuess classifyFile( int fd, const char * path, const char ** format )
+{
+    tContentGuess guess = contentUnknown;
+    uint8_t       head[kPrefilterBytes];
+
+    *format = NULL;
+
+    /* pread(), so the file offset is left alone for whoever reads it next */
+    ssize_t size = pread( fd, head, sizeof( head ), 0 );
+    if ( size < 0 )
+    {
+        debugf( "unable to read '%s' (%d: %s)", path, errno, strerror( errno ));
+    }
+    else
+    {
+        guess = classifyContent( path, head, size, format );
+    }
+    return guess;
+}
@@ -0,0 +1,35 @@
+//
+// Cheap check of a file's name and first few bytes, to avoid probing obviously non-media files
+//
+
+#ifndef AVCP_PREFILTER_H
+#define AVCP_PREFILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    contentUnknown,     ///< nothing conclusive, so it needs a full probe
+    contentMedia,       ///< the signature of a container or elementary stream we know
+    contentNotMedia     ///< an image, document, archive or sidecar file
+} tContentGuess;
+
+/* the number of leading bytes classifyContent() would like to see */
+#define kPrefilterBytes 512
+
+/* classify a file from its name, and the first 'size' bytes of its contents. Only a signature of
+ * something that isn't media, or a sidecar extension without a media signature, rules out a
+ * probe. If the demuxer that handles it can be identified, its name is returned in 'format'
+ * (otherwise it's NULL), which saves libavformat scoring every demuxer it has against the file */
+tContentGuess classifyContent( const char * path, const uint8_t * head, size_t size, const char ** format );
+
+/* read the start of the file open on 'fd' (named 'path') and classify it */
+tContentGuess classifyFile( int fd, const char * path, const char ** format );
+
+/* the demuxer that last worked for a file in the same directory as 'path', or NULL */
+const char * directoryFormat( const char * path );
+
+/* record the demuxer that worked for 'path' (as libavformat names it) */
+void learnDirectoryFormat( const char * path, const char * format );
+
+#endif //AVCP_PREFILTER_H
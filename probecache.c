@@ -0,0 +1,323 @@
+//
+// Persistent record of the files already found not to be media, so they aren't probed again
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "avcp.h"
+#include "probecache.h"
+#include "fileops.h"
+
+#define kCacheMagic     "avcpneg1"
+
+/* new entries are appended to the file; past this many, it's rewritten with only the newest */
+#define kMaxEntries     (256 * 1024)
+
+/* keyed on the file rather than its path, so a renamed file still matches, and one that's been
+ * rewritten (or is still being recorded) doesn't */
+typedef struct {
+    uint64_t  device;
+    uint64_t  inode;
+    uint64_t  size;
+    uint64_t  modified;     ///> in nanoseconds since the epoch
+} tCacheEntry;
+
+static struct {
+    char          path[PATH_MAX];
+    tCacheEntry * entry;        ///> in the order they were added, oldest first
+    unsigned long count;
+    unsigned long limit;
+    unsigned long saved;        ///> entries already in the file
+    uint32_t    * hash;         ///> open addressing, holds entry index + 1 (zero is empty)
+    unsigned long hashSize;     ///> always a power of two
+} gCache;
+
+/* lookups and additions come from the worker threads */
+static pthread_mutex_t gCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void makeKey( tCacheEntry * key, const tFileStat * stat )
+{
+    key->device   = stat->device;
+    key->inode    = stat->inode;
+    key->size     = stat->size;
+    key->modified = (uint64_t)stat->modified.tv_sec * 1000000000 + stat->modified.tv_nsec;
+}
+
+static unsigned long hashKey( const tCacheEntry * key )
+{
+    uint64_t h = key->inode * 0x9E3779B97F4A7C15ULL;
+    h ^= key->device + (h << 6) + (h >> 2);
+    h ^= key->size   + (h << 6) + (h >> 2);
+    h ^= key->modified * 0xC2B2AE3D27D4EB4FULL;
+    return (unsigned long)(h ^ (h >> 29));
+}
+
+static int sameKey( const tCacheEntry * a, const tCacheEntry * b )
+{
+    return memcmp( a, b, sizeof( tCacheEntry )) == 0;
+}
+
+static long findEntry( const tCacheEntry * key )
+{
+    if ( gCache.hashSize != 0 )
+    {
+        unsigned long mask = gCache.hashSize - 1;
+        for ( unsigned long h = hashKey( key ) & mask; gCache.hash[h] != 0; h = (h + 1) & mask )
+        {
+            if ( sameKey( &gCache.entry[ gCache.hash[h] - 1 ], key ))
+            {
+                return gCache.hash[h] - 1;
+            }
+        }
+    }
+    return -1;
+}
+
+static void insertHash( unsigned long index )
+{
+    unsigned long mask = gCache.hashSize - 1;
+    unsigned long h = hashKey( &gCache.entry[ index ] ) & mask;
+
+    while ( gCache.hash[h] != 0 )
+    {
+        h = (h + 1) & mask;
+    }
+    gCache.hash[h] = index + 1;
+}
+
+/**
+ * @brief make room for another entry, keeping the hash table no more than half full
+ */
+static int growCache( void )
+{
+    if ( gCache.count >= gCache.limit )
+    {
+        unsigned long limit = (gCache.limit == 0) ? 1024 : gCache.limit * 2;
+        tCacheEntry * entry = realloc( gCache.entry, limit * sizeof( tCacheEntry ));
+        if ( entry == NULL )
+        {
+            return ENOMEM;
+        }
+        gCache.entry = entry;
+        gCache.limit = limit;
+    }
+
+    if ( (gCache.count + 1) * 2 > gCache.hashSize )
+    {
+        unsigned long size = (gCache.hashSize == 0) ? 2048 : gCache.hashSize * 2;
+        uint32_t * hash = calloc( size, sizeof( uint32_t ));
+        if ( hash == NULL )
+        {
+            return ENOMEM;
+        }
+        free( gCache.hash );
+        gCache.hash     = hash;
+        gCache.hashSize = size;
+        for ( unsigned long i = 0; i < gCache.count; ++i )
+        {
+            insertHash( i );
+        }
+    }
+    return 0;
+}
+
+static int addEntry( const tCacheEntry * key )
+{
+    int result = growCache();
+    if ( result == 0 )
+    {
+        gCache.entry[ gCache.count ] = *key;
+        insertHash( gCache.count );
+        ++gCache.count;
+    }
+    return result;
+}
+
+/**
+ * @brief work out where the cache lives, creating the directory if need be
+ */
+static int locateCache( void )
+{
+    char dir[PATH_MAX - 16];
+    const char * base = getenv( "XDG_CACHE_HOME" );
+
+    if ( base != NULL && base[0] == '/' )
+    {
+        snprintf( dir, sizeof( dir ), "%s/avcp", base );
+    }
+    else
+    {
+        const char * home = getenv( "HOME" );
+        if ( home == NULL )
+        {
+            return ENOENT;
+        }
+        snprintf( dir, sizeof( dir ), "%s/.cache", home );
+        mkdir( dir, 0700 );
+        snprintf( dir, sizeof( dir ), "%s/.cache/avcp", home );
+    }
+
+    if ( mkdir( dir, 0700 ) != 0 && errno != EEXIST )
+    {
+        return errno;
+    }
+    snprintf( gCache.path, sizeof( gCache.path ), "%s/nonmedia", dir );
+    return 0;
+}
+
+int openProbeCache( void )
+{
+    int result = locateCache();
+    if ( result != 0 )
+    {
+        return result;
+    }
+
+    FILE * file = fopen( gCache.path, "rb" );
+    if ( file == NULL )
+    {
+        return ( errno == ENOENT ) ? 0 : errno;
+    }
+
+    char magic[sizeof( kCacheMagic ) - 1];
+    if ( fread( magic, sizeof( magic ), 1, file ) == 1 && memcmp( magic, kCacheMagic, sizeof( magic )) == 0 )
+    {
+        tCacheEntry key;
+        while ( result == 0 && fread( &key, sizeof( key ), 1, file ) == 1 )
+        {
+            result = addEntry( &key );
+        }
+        gCache.saved = gCache.count;
+    }
+    else
+    {
+        debugf( "ignoring unrecognised cache '%s'", gCache.path );
+    }
+    fclose( file );
+
+    return result;
+}
+
+/**
+ * @brief write the newest entries to a new cache file, and put it in place of the old one
+ */
+static int rewriteCache( unsigned long first )
+{
+    int  result = 0;
+    char temp[PATH_MAX + 16];
+
+    snprintf( temp, sizeof( temp ), "%s.%d", gCache.path, getpid() );
+    FILE * file = fopen( temp, "wb" );
+    if ( file == NULL )
+    {
+        return errno;
+    }
+
+    if ( fwrite( kCacheMagic, sizeof( kCacheMagic ) - 1, 1, file ) != 1
+      || fwrite( &gCache.entry[ first ], sizeof( tCacheEntry ), gCache.count - first, file ) != gCache.count - first )
+    {
+        result = EIO;
+    }
+    if ( fclose( file ) != 0 && result == 0 )
+    {
+        result = errno;
+    }
+
+    if ( result == 0 && rename( temp, gCache.path ) != 0 )
+    {
+        result = errno;
+    }
+    if ( result != 0 )
+    {
+        removeFile( temp );
+    }
+    return result;
+}
+
+/**
+ * @brief append the entries added since the cache was loaded
+ */
+static int appendCache( void )
+{
+    int result = 0;
+
+    int fd = open( gCache.path, O_WRONLY | O_APPEND | O_CLOEXEC );
+    if ( fd < 0 )
+    {
+        return errno;
+    }
+
+    size_t  size = (gCache.count - gCache.saved) * sizeof( tCacheEntry );
+    ssize_t written = write( fd, &gCache.entry[ gCache.saved ], size );
+    if ( written < 0 )
+    {
+        result = errno;
+    }
+    else if ( (size_t)written != size )
+    {
+        result = EIO;
+    }
+    close( fd );
+    return result;
+}
+
+void closeProbeCache( void )
+{
+    if ( gCache.path[0] != '\0' && gCache.count > gCache.saved )
+    {
+        int result;
+        if ( gCache.saved == 0 || gCache.count > kMaxEntries )
+        {
+            /* a new file, or one that's outgrown its limit */
+            result = rewriteCache( (gCache.count > kMaxEntries) ? gCache.count - kMaxEntries : 0 );
+        }
+        else
+        {
+            result = appendCache();
+        }
+
+        if ( result != 0 )
+        {
+            debugf( "unable to update '%s' (%d: %s)", gCache.path, result, strerror( result ));
+        }
+    }
+
+    free( gCache.entry );
+    free( gCache.hash );
+    memset( &gCache, 0, sizeof( gCache ));
+}
+
+int isKnownNonMedia( const tFileStat * stat )
+{
+    tCacheEntry key;
+
+    makeKey( &key, stat );
+
+    pthread_mutex_lock( &gCacheLock );
+    int found = findEntry( &key ) >= 0;
+    pthread_mutex_unlock( &gCacheLock );
+
+    return found;
+}
+
+void rememberNonMedia( const tFileStat * stat )
+{
+    tCacheEntry key;
+
+    makeKey( &key, stat );
+
+    pthread_mutex_lock( &gCacheLock );
+    if ( findEntry( &key ) < 0 )
+    {
+        addEntry( &key );
+    }
+    pthread_mutex_unlock( &gCacheLock );
+}
@@ -0,0 +1,22 @@
+//
+// Persistent record of the files already found not to be media, so they aren't probed again
+//
+
+#ifndef AVCP_PROBECACHE_H
+#define AVCP_PROBECACHE_H
+
+#include "filemediainfo.h"
+
+/* load the cache from $XDG_CACHE_HOME/avcp (or ~/.cache/avcp). A missing cache isn't an error */
+int openProbeCache( void );
+
+/* save anything new, and release the cache */
+void closeProbeCache( void );
+
+/* non-zero if this exact file (same inode, size and modification time) is known not to be media */
+int isKnownNonMedia( const tFileStat * stat );
+
+/* record that this file isn't media. If it changes, it'll no longer match */
+void rememberNonMedia( const tFileStat * stat );
+
+#endif //AVCP_PROBECACHE_H
@@ -0,0 +1,702 @@
+//
+// Pool of long-lived worker processes that run the probes, so a crash in libavformat only costs one file
+//
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "avcp.h"
+#include "probepool.h"
+
+#define kMaxHintLength  32
+#define kMaxNameLength  128
+
+/* how long past the deadline a worker has to reply, before it's given up on. The probe enforces
+ * its own deadline, but a read stuck in the kernel (a hard NFS mount, a dying disk) never returns
+ * to notice it */
+#define kGraceSeconds   5
+
+/* the tFileInfo fields that point to a name (format and codec). A worker's strings aren't ours,
+ * so each crosses the slot as a copy */
+#define kNameFields     6
+
+/* a worker's half of the shared mapping */
+typedef struct {
+    char          path[PATH_MAX];
+    char          hint[kMaxHintLength];     ///> empty for none
+    tProbeStage   stage;
+    unsigned int  attributes;
+    int           result;
+    unsigned int  named;                    ///> a bit for each of 'name' that's set
+    char          name[kNameFields][kMaxNameLength];
+    tFileInfo     file;                     ///> in: its stat. out: the probe's result. Names are NULL
+} tProbeSlot;
+
+typedef struct {
+    int     socket;     ///> our end of the socketpair, -1 if the worker couldn't be started
+    int     busy;
+} tProbeWorker;
+
+/* what's asked of the supervisor, for a slot */
+typedef enum {
+    spawnFirst,         ///> start its first worker
+    spawnDied,          ///> its worker died: collect it, and start another
+    spawnKill           ///> its worker is taking too long: kill it, and start another
+} tSpawnAction;
+
+typedef struct {
+    unsigned int  index;
+    tSpawnAction  action;
+} tSpawnRequest;
+
+/* sent back with our end of the new worker's socketpair */
+typedef struct {
+    int     result;     ///> zero, or an errno if the worker couldn't be started
+    int     status;     ///> the one it replaced, from waitpid(), or -1 if not known
+} tSpawnReply;
+
+static struct {
+    tProbeSlot    * slot;       ///> shared with the workers, one each
+    tProbeWorker  * worker;
+    unsigned int    count;
+    unsigned int    live;       ///> workers that are running
+    unsigned int    idle;       ///> of those, the ones waiting for a request
+    pid_t           supervisor;
+    int             control;    ///> our end of the supervisor's socketpair
+} gPool = { .control = -1 };
+
+static int gRetry = 0;     ///> give a probe that timed out a second chance
+
+static pthread_mutex_t gPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  gIdle     = PTHREAD_COND_INITIALIZER;
+
+/* the names the workers have sent back. Kept for the life of the process, as the file table
+ * points to them */
+typedef struct tName {
+    struct tName * next;
+    char           text[];
+} tName;
+
+static tName         * gNames = NULL;
+static pthread_mutex_t gNameLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief send a message, with a descriptor (if there is one) attached
+ */
+static int sendMessage( int socket, const void * data, size_t length, int fd )
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = length };
+    union {
+        struct cmsghdr header;
+        char           space[ CMSG_SPACE( sizeof( int )) ];
+    } control;
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+    if ( fd >= 0 )
+    {
+        memset( &control, 0, sizeof( control ));
+        message.msg_control    = &control;
+        message.msg_controllen = sizeof( control );
+
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR( &message );
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN( sizeof( int ));
+        memcpy( CMSG_DATA( cmsg ), &fd, sizeof( int ));
+    }
+    return ( sendmsg( socket, &message, MSG_NOSIGNAL ) == (ssize_t)length ) ? 0 : -1;
+}
+
+/**
+ * @brief wait for a message of exactly 'length' bytes
+ * @return zero, or -1 if the other end has gone. 'fd' is the descriptor sent with it, or -1
+ */
+static int receiveMessage( int socket, void * data, size_t length, int * fd )
+{
+    struct iovec iov = { .iov_base = data, .iov_len = length };
+    union {
+        struct cmsghdr header;
+        char           space[ CMSG_SPACE( sizeof( int )) ];
+    } control;
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1,
+                              .msg_control = &control, .msg_controllen = sizeof( control ) };
+    ssize_t received;
+
+    do {
+        received = recvmsg( socket, &message, MSG_CMSG_CLOEXEC );
+    } while ( received < 0 && errno == EINTR );
+
+    *fd = -1;
+    if ( received <= 0 )
+    {
+        return -1;
+    }
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR( &message );
+    if ( cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS )
+    {
+        memcpy( fd, CMSG_DATA( cmsg ), sizeof( int ));
+    }
+    if ( (size_t)received != length )
+    {
+        if ( *fd >= 0 )
+        {
+            close( *fd );
+            *fd = -1;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief the fields of 'file' that point to a name, in the order they're kept in a slot
+ */
+static void nameFields( tFileInfo * file, const char ** field[ kNameFields ] )
+{
+    field[0] = &file->container.name.brief;
+    field[1] = &file->container.name.full;
+    field[2] = &file->video.codec.name.brief;
+    field[3] = &file->video.codec.name.full;
+    field[4] = &file->audio.codec.name.brief;
+    field[5] = &file->audio.codec.name.full;
+}
+
+/**
+ * @brief copy the names the slot's file points to into the slot, leaving it pointing to none
+ */
+static void packNames( tProbeSlot * slot )
+{
+    const char ** field[ kNameFields ];
+
+    nameFields( &slot->file, field );
+    slot->named = 0;
+    for ( unsigned int i = 0; i < kNameFields; ++i )
+    {
+        if ( *field[i] != NULL )
+        {
+            snprintf( slot->name[i], sizeof( slot->name[i] ), "%s", *field[i] );
+            slot->named |= 1u << i;
+        }
+        *field[i] = NULL;
+    }
+}
+
+/**
+ * @brief our own copy of a name, shared with every other file that has it
+ * @return NULL if there's no memory for it
+ */
+static const char * internName( const char * text )
+{
+    tName * name;
+
+    pthread_mutex_lock( &gNameLock );
+    for ( name = gNames; name != NULL; name = name->next )
+    {
+        if ( strcmp( name->text, text ) == 0 )
+        {
+            break;
+        }
+    }
+    if ( name == NULL )
+    {
+        size_t length = strlen( text ) + 1;
+        name = malloc( sizeof( tName ) + length );
+        if ( name != NULL )
+        {
+            memcpy( name->text, text, length );
+            name->next = gNames;
+            gNames     = name;
+        }
+    }
+    pthread_mutex_unlock( &gNameLock );
+
+    return ( name != NULL ) ? name->text : NULL;
+}
+
+/**
+ * @brief point 'file' at the names in the slot: at copies in 'buffer' if there is one, or interned if not
+ */
+static void unpackNames( const tProbeSlot * slot, tFileInfo * file, char buffer[ kNameFields ][ kMaxNameLength ] )
+{
+    const char ** field[ kNameFields ];
+
+    nameFields( file, field );
+    for ( unsigned int i = 0; i < kNameFields; ++i )
+    {
+        if ( !( slot->named & (1u << i)))
+        {
+            *field[i] = NULL;
+        }
+        else if ( buffer != NULL )
+        {
+            memcpy( buffer[i], slot->name[i], kMaxNameLength );
+            *field[i] = buffer[i];
+        }
+        else
+        {
+            *field[i] = internName( slot->name[i] );
+        }
+    }
+}
+
+/**
+ * @brief what a worker process does, until the parent goes away
+ */
+static void runWorker( unsigned int index, int socket )
+{
+    tProbeSlot * slot = &gPool.slot[ index ];
+    tFileInfo    file;
+    char         name[ kNameFields ][ kMaxNameLength ];
+    char         byte;
+    int          fd;
+
+    /* the parent going away closes the socket, which ends the loop */
+    while ( receiveMessage( socket, &byte, 1, &fd ) == 0 )
+    {
+        file      = slot->file;
+        file.name = slot->path;
+        file.fd   = fd;
+        unpackNames( slot, &file, name );
+
+        slot->result = processMediaInfo( &file, (slot->hint[0] != '\0') ? slot->hint : NULL,
+                                         slot->stage, slot->attributes );
+        if ( fd >= 0 )
+        {
+            close( fd );
+        }
+        file.name  = NULL;
+        file.fd    = -1;
+        slot->file = file;
+        packNames( slot );
+
+        byte = 'r';
+        if ( send( socket, &byte, 1, MSG_NOSIGNAL ) != 1 )
+        {
+            break;
+        }
+    }
+    releaseProbeContext();
+    _exit( 0 );
+}
+
+/**
+ * @brief fork a worker for slot 'index', and send the parent's end of its socketpair back over
+ * 'control', with the status of the one it replaces
+ */
+static void startWorker( int control, unsigned int index, int status, pid_t * child )
+{
+    tSpawnReply reply = { 0, status };
+    int pair[2] = { -1, -1 };
+
+    if ( socketpair( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair ) != 0 )
+    {
+        reply.result = errno;
+    }
+    else
+    {
+        fflush( stderr );
+        pid_t pid = fork();
+        if ( pid == 0 )
+        {
+            close( control );
+            close( pair[0] );
+            runWorker( index, pair[1] );
+        }
+        if ( pid < 0 )
+        {
+            reply.result = errno;
+        }
+        else
+        {
+            *child = pid;
+        }
+        close( pair[1] );
+    }
+    sendMessage( control, &reply, sizeof( reply ), ( reply.result == 0 ) ? pair[0] : -1 );
+    if ( pair[0] >= 0 )
+    {
+        close( pair[0] );
+    }
+}
+
+/**
+ * @brief what the supervisor does, until the parent goes away
+ *
+ * It's forked before the parent starts any threads, and has none of its own, so it can fork
+ * the workers at any time. A fork from a threaded process only copies the calling thread, and
+ * the child can deadlock on a lock (stdio's, malloc's, ffmpeg's) that another thread held.
+ * The workers are its children, so it's the one to collect them.
+ */
+static void runSupervisor( int control )
+{
+    /* the worker in each slot, and the last one killed there, if it hasn't been collected yet */
+    pid_t       * child     = calloc( gPool.count, sizeof( pid_t ));
+    pid_t       * abandoned = calloc( gPool.count, sizeof( pid_t ));
+    tSpawnRequest request;
+    int           fd;
+
+    if ( child == NULL || abandoned == NULL )
+    {
+        _exit( 1 );
+    }
+    while ( receiveMessage( control, &request, sizeof( request ), &fd ) == 0 )
+    {
+        if ( fd >= 0 )
+        {
+            close( fd );
+        }
+        if ( request.index >= gPool.count )
+        {
+            continue;
+        }
+        for ( unsigned int i = 0; i < gPool.count; ++i )
+        {
+            if ( abandoned[i] > 0 && waitpid( abandoned[i], NULL, WNOHANG ) != 0 )
+            {
+                abandoned[i] = 0;
+            }
+        }
+
+        pid_t * pid    = &child[ request.index ];
+        int     status = -1;
+        if ( *pid > 0 )
+        {
+            if ( request.action == spawnKill )
+            {
+                /* one stuck in an uninterruptible read won't go until the read does, so don't wait */
+                kill( *pid, SIGKILL );
+                if ( waitpid( *pid, NULL, WNOHANG ) == 0 )
+                {
+                    abandoned[ request.index ] = *pid;
+                }
+            }
+            else if ( waitpid( *pid, &status, 0 ) != *pid )
+            {
+                status = -1;
+            }
+            *pid = 0;
+        }
+        startWorker( control, request.index, status, pid );
+    }
+
+    /* closing the parent's end of their sockets has told the workers to exit */
+    for ( unsigned int i = 0; i < gPool.count; ++i )
+    {
+        if ( child[i] > 0 )
+        {
+            waitpid( child[i], NULL, 0 );
+        }
+    }
+    _exit( 0 );
+}
+
+/**
+ * @brief have the supervisor start a worker for slot 'index'. Must be called with gPoolLock held,
+ * or before the pool is shared
+ * @return zero, or an errno. 'status' is that of the worker it replaced, or -1 if not known
+ */
+static int spawnWorker( unsigned int index, tSpawnAction action, int * status )
+{
+    tSpawnRequest request = { .index = index, .action = action };
+    tSpawnReply   reply;
+    int           socket;
+
+    *status = -1;
+    if ( sendMessage( gPool.control, &request, sizeof( request ), -1 ) != 0
+      || receiveMessage( gPool.control, &reply, sizeof( reply ), &socket ) != 0 )
+    {
+        /* the supervisor has gone */
+        return ECHILD;
+    }
+    *status = reply.status;
+    if ( reply.result != 0 || socket < 0 )
+    {
+        if ( socket >= 0 )
+        {
+            close( socket );
+        }
+        return ( reply.result != 0 ) ? reply.result : ECHILD;
+    }
+
+    gPool.worker[ index ].socket = socket;
+    gPool.worker[ index ].busy   = 0;
+    ++gPool.live;
+    ++gPool.idle;
+    return 0;
+}
+
+int startProbePool( unsigned int count )
+{
+    int control[2];
+    int status;
+
+    gPool.slot = mmap( NULL, count * sizeof( tProbeSlot ), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( gPool.slot == MAP_FAILED )
+    {
+        gPool.slot = NULL;
+        return errno;
+    }
+    gPool.worker = calloc( count, sizeof( tProbeWorker ));
+    if ( gPool.worker == NULL )
+    {
+        munmap( gPool.slot, count * sizeof( tProbeSlot ));
+        gPool.slot = NULL;
+        return ENOMEM;
+    }
+    gPool.count = count;
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        gPool.worker[i].socket = -1;
+    }
+
+    if ( socketpair( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, control ) != 0 )
+    {
+        int result = errno;
+        stopProbePool();
+        return result;
+    }
+    /* anything still buffered would otherwise be written twice */
+    fflush( stdout );
+    fflush( stderr );
+
+    gPool.supervisor = fork();
+    if ( gPool.supervisor < 0 )
+    {
+        int result = errno;
+        gPool.supervisor = 0;
+        close( control[0] );
+        close( control[1] );
+        stopProbePool();
+        return result;
+    }
+    if ( gPool.supervisor == 0 )
+    {
+        close( control[0] );
+        runSupervisor( control[1] );
+    }
+    close( control[1] );
+    gPool.control = control[0];
+
+    for ( unsigned int i = 0; i < count; ++i )
+    {
+        int result = spawnWorker( i, spawnFirst, &status );
+        if ( result != 0 )
+        {
+            /* carry on with the ones that did start */
+            errno = result;
+            errorf( "unable to start probe worker %u", i );
+        }
+    }
+    return ( gPool.live > 0 ) ? 0 : ECHILD;
+}
+
+void stopProbePool( void )
+{
+    if ( gPool.worker != NULL )
+    {
+        /* closing our end is the signal to exit */
+        for ( unsigned int i = 0; i < gPool.count; ++i )
+        {
+            if ( gPool.worker[i].socket >= 0 )
+            {
+                close( gPool.worker[i].socket );
+                gPool.worker[i].socket = -1;
+            }
+        }
+        if ( gPool.control >= 0 )
+        {
+            close( gPool.control );
+        }
+        /* it waits for the workers before it exits */
+        if ( gPool.supervisor > 0 )
+        {
+            waitpid( gPool.supervisor, NULL, 0 );
+        }
+        free( gPool.worker );
+        munmap( gPool.slot, gPool.count * sizeof( tProbeSlot ));
+    }
+    memset( &gPool, 0, sizeof( gPool ));
+    gPool.control = -1;
+}
+
+/**
+ * @brief a worker died, or is to be killed for taking too long: start another in its place, and say which
+ */
+static void replaceWorker( unsigned int index, const char * filename, int killed )
+{
+    tProbeWorker * worker = &gPool.worker[ index ];
+    int status;
+
+    pthread_mutex_lock( &gPoolLock );
+    close( worker->socket );
+    worker->socket = -1;
+    --gPool.live;
+    int result = spawnWorker( index, killed ? spawnKill : spawnDied, &status );
+    if ( result == 0 )
+    {
+        --gPool.idle;   /* it's still ours until it's handed back */
+        worker->busy = 1;
+    }
+    pthread_mutex_unlock( &gPoolLock );
+
+    if ( killed )
+    {
+        fprintf( stderr, "### Error: the probe of '%s' didn't finish in time\n", filename );
+    }
+    else if ( status != -1 && WIFSIGNALED( status ))
+    {
+        fprintf( stderr, "### Error: the probe of '%s' crashed (%s)\n", filename, strsignal( WTERMSIG( status )));
+    }
+    else
+    {
+        fprintf( stderr, "### Error: the probe of '%s' failed\n", filename );
+    }
+
+    if ( result != 0 )
+    {
+        errno = result;
+        errorf( "unable to replace probe worker %u", index );
+    }
+}
+
+/**
+ * @brief wait for the worker's reply, for no longer than the deadline allows
+ * @return 1 if it replied, 0 if it died, or -1 if it ran out of time
+ */
+static int awaitReply( int socket )
+{
+    struct pollfd poller = { .fd = socket, .events = POLLIN };
+    unsigned int deadline = probeDeadline();
+    int timeout = ( deadline > 0 ) ? (int)(deadline + kGraceSeconds) * 1000 : -1;
+    int ready;
+    char byte;
+
+    do {
+        ready = poll( &poller, 1, timeout );
+    } while ( ready < 0 && errno == EINTR );
+
+    if ( ready == 0 )
+    {
+        return -1;
+    }
+    return ( ready > 0 && recv( socket, &byte, 1, 0 ) == 1 ) ? 1 : 0;
+}
+
+/**
+ * @brief run one probe on an idle worker, preferring any but 'avoid'
+ */
+static int probeOnce( tFileInfo * file, const char * formatHint, tProbeStage stage, unsigned int attributes,
+                      int avoid, int * used )
+{
+    unsigned int index;
+
+    pthread_mutex_lock( &gPoolLock );
+    while ( gPool.live > 0 && gPool.idle == 0 )
+    {
+        pthread_cond_wait( &gIdle, &gPoolLock );
+    }
+    if ( gPool.live == 0 )
+    {
+        /* no pool (or none of it is left), so do it here */
+        pthread_mutex_unlock( &gPoolLock );
+        *used = -1;
+        return processMediaInfo( file, formatHint, stage, attributes );
+    }
+    int found = -1;
+    for ( index = 0; index < gPool.count; ++index )
+    {
+        if ( gPool.worker[ index ].socket >= 0 && !gPool.worker[ index ].busy )
+        {
+            found = index;
+            if ( (int)index != avoid )
+            {
+                break;
+            }
+        }
+    }
+    /* there's bound to be one, as 'idle' is non-zero */
+    index = found;
+    gPool.worker[ index ].busy = 1;
+    --gPool.idle;
+    pthread_mutex_unlock( &gPoolLock );
+    *used = index;
+
+    /* the slot is only touched by this thread and its worker, until it's handed back */
+    tProbeSlot * slot = &gPool.slot[ index ];
+    snprintf( slot->path, sizeof( slot->path ), "%s", file->name );
+    snprintf( slot->hint, sizeof( slot->hint ), "%s", (formatHint != NULL) ? formatHint : "" );
+    slot->stage      = stage;
+    slot->attributes = attributes;
+    slot->file       = *file;
+    slot->file.name  = NULL;
+    packNames( slot );
+
+    int  result;
+    int  reply = -2;
+    char byte  = 'p';
+    if ( sendMessage( gPool.worker[ index ].socket, &byte, 1, file->fd ) == 0 )
+    {
+        reply = awaitReply( gPool.worker[ index ].socket );
+    }
+    if ( reply == 1 )
+    {
+        /* the worker filled in a copy; this file keeps its own name and descriptor */
+        const char * name = file->name;
+        int          fd   = file->fd;
+
+        *file      = slot->file;
+        file->name = name;
+        file->fd   = fd;
+        unpackNames( slot, file, NULL );
+        result     = slot->result;
+    }
+    else
+    {
+        replaceWorker( index, file->name, reply == -1 );
+        file->stage   = stageComplete;    /* don't try it again */
+        file->failure = ( reply == -1 ) ? failTimedOut : failCrashed;
+        result = ( reply == -1 ) ? kProbeTimedOut : kProbeCrashed;
+    }
+
+    pthread_mutex_lock( &gPoolLock );
+    if ( gPool.worker[ index ].socket >= 0 )
+    {
+        gPool.worker[ index ].busy = 0;
+        ++gPool.idle;
+    }
+    pthread_cond_broadcast( &gIdle );
+    pthread_mutex_unlock( &gPoolLock );
+
+    return result;
+}
+
+void retryTimedOutProbes( int retry )
+{
+    gRetry = retry;
+}
+
+int probeMedia( tFileInfo * file, const char * formatHint, tProbeStage stage, unsigned int attributes )
+{
+    int used;
+    int result = probeOnce( file, formatHint, stage, attributes, -1, &used );
+
+    if ( result == kProbeTimedOut && gRetry && used >= 0 )
+    {
+        /* it may have been the worker rather than the file, so give it one more go elsewhere */
+        fprintf( stderr, "### Retrying '%s'\n", file->name );
+        result = probeOnce( file, formatHint, stage, attributes, used, &used );
+    }
+    return result;
+}
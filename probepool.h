@@ -0,0 +1,30 @@
+//
+// Pool of long-lived worker processes that run the probes, so a crash in libavformat only costs one file
+//
+
+#ifndef AVCP_PROBEPOOL_H
+#define AVCP_PROBEPOOL_H
+
+#include "filemediainfo.h"
+
+/* returned by probeMedia() when the worker died while examining the file. Not one of ffmpeg's codes */
+#define kProbeCrashed   (-0x70726f62)
+
+/* start 'count' worker processes, forked by a supervisor process that also forks any that replace
+ * them. Call it before any other threads are started, and after initMediaInfo() and
+ * measureProbeCost(). Returns zero, or an errno */
+int startProbePool( unsigned int count );
+
+/* tell the workers to exit, and wait for them */
+void stopProbePool( void );
+
+/* processMediaInfo(), in one of the worker processes if the pool was started, or in this one if
+ * not. If the worker dies, the file is left as it was, marked stageComplete, a new worker takes
+ * its place, and kProbeCrashed is returned. A worker that's still going a few seconds past the
+ * probe deadline is killed and replaced the same way, and kProbeTimedOut returned */
+int probeMedia( tFileInfo * file, const char * formatHint, tProbeStage stage, unsigned int attributes );
+
+/* if non-zero, a probe that times out is tried once more, on a different worker if one's free */
+void retryTimedOutProbes( int retry );
+
+#endif //AVCP_PROBEPOOL_H
@@ -0,0 +1,243 @@
+//
+// Deferred deletion of losing files, a step at a time, so it doesn't stall recordings
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "avcp.h"
+#include "reaper.h"
+
+#define kTrashName      ".avcp-trash"
+
+/* files no bigger than a step are unlinked straight away */
+#define kReapStep       (512LL * 1024 * 1024)
+#define kReapPauseMS    200
+
+/* the trash directories used this run, one per filesystem */
+#define kMaxTrash       16
+
+static struct {
+    dev_t   device;
+    int     fd;             ///> the directory itself, so nothing can be swapped in under its name
+    char    path[PATH_MAX];
+} gTrash[kMaxTrash];
+
+static unsigned int gTrashCount = 0;
+
+/* losers may be removed by several threads at once */
+static pthread_mutex_t gTrashLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief open a trash directory, making it if need be. One that's already there has to be a real
+ * directory that's ours, and no-one else's to add to, or what's put there could be redirected
+ * @return the descriptor, or -1
+ */
+static int openTrash( const char * path )
+{
+    struct stat before;
+    struct stat after;
+
+    if ( mkdir( path, 0700 ) != 0 && errno != EEXIST )
+    {
+        return -1;
+    }
+    if ( lstat( path, &before ) != 0 || !S_ISDIR( before.st_mode )
+      || before.st_uid != geteuid() || (before.st_mode & 07777) != 0700 )
+    {
+        debugf( "not using '%s' as the trash, as it isn't a private directory of ours", path );
+        return -1;
+    }
+
+    int fd = open( path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+    if ( fd >= 0 && (fstat( fd, &after ) != 0
+                  || after.st_dev != before.st_dev || after.st_ino != before.st_ino) )
+    {
+        /* replaced since it was checked */
+        close( fd );
+        fd = -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief the trash directory for files on 'device', starting the search from 'directory'
+ * @return the index in gTrash, or -1 if there's no room for another, or it can't be used
+ */
+static int trashDirectory( const char * directory, dev_t device )
+{
+    for ( unsigned int i = 0; i < gTrashCount; ++i )
+    {
+        if ( gTrash[i].device == device )
+        {
+            return i;
+        }
+    }
+    if ( gTrashCount >= kMaxTrash )
+    {
+        return -1;
+    }
+
+    /* climb as far as we can while staying on the same filesystem, and able to write there */
+    char highest[PATH_MAX];
+    char current[PATH_MAX];
+    if ( realpath( directory, current ) == NULL )
+    {
+        return -1;
+    }
+    strcpy( highest, current );
+    while ( strcmp( current, "/" ) != 0 )
+    {
+        struct stat parent;
+        char * up = dirname( current );   /* in place, or a static "/" */
+        memmove( current, up, strlen( up ) + 1 );
+
+        if ( stat( current, &parent ) != 0 || parent.st_dev != device )
+        {
+            break;
+        }
+        if ( access( current, W_OK | X_OK ) == 0 )
+        {
+            strcpy( highest, current );
+        }
+    }
+
+    int length = snprintf( gTrash[ gTrashCount ].path, PATH_MAX, "%s%s" kTrashName,
+                           highest, (strcmp( highest, "/" ) == 0) ? "" : "/" );
+    if ( length >= PATH_MAX || (gTrash[ gTrashCount ].fd = openTrash( gTrash[ gTrashCount ].path )) < 0 )
+    {
+        return -1;
+    }
+    gTrash[ gTrashCount ].device = device;
+    return gTrashCount++;
+}
+
+int trashFile( const char * path )
+{
+    struct stat fileStat;
+
+    if ( lstat( path, &fileStat ) != 0 )
+    {
+        errorf( "unable to remove \'%s\'", path );
+        return errno;
+    }
+
+    /* truncating one with other names would destroy them too, and unlinking it frees nothing anyway */
+    if ( S_ISREG( fileStat.st_mode ) && fileStat.st_nlink == 1 && fileStat.st_size > kReapStep )
+    {
+        char directory[PATH_MAX];
+        char trashed[32];
+
+        snprintf( directory, sizeof( directory ), "%s", path );
+        pthread_mutex_lock( &gTrashLock );
+        int trash = trashDirectory( dirname( directory ), fileStat.st_dev );
+        pthread_mutex_unlock( &gTrashLock );
+
+        /* named for its inode, which is unique on the filesystem while it's there */
+        snprintf( trashed, sizeof( trashed ), "%llx", (unsigned long long)fileStat.st_ino );
+        if ( trash >= 0 && renameat( AT_FDCWD, path, gTrash[ trash ].fd, trashed ) == 0 )
+        {
+            return 0;
+        }
+        debugf( "unable to move '%s' to the trash, so removing it now", path );
+    }
+
+    if ( unlink( path ) != 0 )
+    {
+        errorf( "unable to remove \'%s\'", path );
+        return errno;
+    }
+    return 0;
+}
+
+/**
+ * @brief shrink a file in the trash a step at a time, then unlink it
+ */
+static void reapFile( int directory, const char * name )
+{
+    const struct timespec pause = { .tv_sec = 0, .tv_nsec = kReapPauseMS * 1000000L };
+    struct stat fileStat;
+
+    int fd = openat( directory, name, O_WRONLY | O_NOFOLLOW | O_CLOEXEC );
+    if ( fd >= 0 )
+    {
+        if ( fstat( fd, &fileStat ) == 0 && S_ISREG( fileStat.st_mode ) && fileStat.st_nlink == 1 )
+        {
+            /* from the end, so each step frees a run of extents, not the whole map */
+            off_t size = fileStat.st_size;
+            while ( size > kReapStep && ftruncate( fd, size - kReapStep ) == 0 )
+            {
+                size -= kReapStep;
+                nanosleep( &pause, NULL );
+            }
+        }
+        close( fd );
+    }
+    unlinkat( directory, name, 0 );
+}
+
+void startReaper( void )
+{
+    if ( gTrashCount == 0 )
+    {
+        return;
+    }
+
+    /* anything still buffered would otherwise be written twice */
+    fflush( stdout );
+    fflush( stderr );
+
+    pid_t pid = fork();
+    if ( pid < 0 )
+    {
+        errorf( "unable to start reclaiming the trash" );
+        return;
+    }
+    if ( pid > 0 )
+    {
+        return;     /* init takes it on when we exit */
+    }
+
+    /* whatever's reading our output shouldn't wait on the reaper for end of file */
+    setsid();
+    int null = open( "/dev/null", O_RDWR );
+    if ( null >= 0 )
+    {
+        dup2( null, STDIN_FILENO );
+        dup2( null, STDOUT_FILENO );
+        dup2( null, STDERR_FILENO );
+        close( null );
+    }
+
+    for ( unsigned int i = 0; i < gTrashCount; ++i )
+    {
+        DIR * trash = fdopendir( gTrash[i].fd );
+        if ( trash == NULL )
+        {
+            continue;
+        }
+        struct dirent * entry;
+        while ( (entry = readdir( trash )) != NULL )
+        {
+            /* only what trashFile() put there, which is named for its inode, in hex */
+            if ( entry->d_name[0] != '\0' && strspn( entry->d_name, "0123456789abcdef" ) == strlen( entry->d_name ))
+            {
+                reapFile( dirfd( trash ), entry->d_name );
+            }
+        }
+        closedir( trash );
+    }
+    _exit( 0 );
+}
@@ -0,0 +1,17 @@
+//
+// Deferred deletion of losing files, a step at a time, so it doesn't stall recordings
+//
+
+#ifndef AVCP_REAPER_H
+#define AVCP_REAPER_H
+
+/* take a file that didn't win out of the way, by renaming it into the trash directory on its
+ * filesystem. One that's small, or has other names, is simply unlinked. Returns zero, or an errno */
+int trashFile( const char * path );
+
+/* fork a process that reclaims what was put in the trash directories used (or left there by an
+ * earlier run), shrinking each file a step at a time before unlinking it, and return without
+ * waiting for it */
+void startReaper( void );
+
+#endif //AVCP_REAPER_H
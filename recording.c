@@ -0,0 +1,58 @@
+//
+// Spot files that are still being written, such as a recording in progress
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "avcp.h"
+#include "recording.h"
+
+static pthread_once_t gLeaseSetup = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief if a writer opens the file in the moment we hold the lease, the kernel signals us to
+ * let go of it, which we do anyway. SIGIO's default action is to terminate, so ignore it
+ */
+static void setupLeases( void )
+{
+    signal( SIGIO, SIG_IGN );
+}
+
+int hasWriter( int fd )
+{
+    pthread_once( &gLeaseSetup, setupLeases );
+
+    if ( fcntl( fd, F_SETLEASE, F_RDLCK ) == 0 )
+    {
+        /* only wanted to know we could have it */
+        fcntl( fd, F_SETLEASE, F_UNLCK );
+        return 0;
+    }
+    return ( errno == EAGAIN ) ? 1 : -1;
+}
+
+int isBeingWritten( int fd, const tFileStat * stat, int settled )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+    if ( !settled && now.tv_sec - stat->modified.tv_sec < kRecentSeconds )
+    {
+        return 1;
+    }
+    return ( hasWriter( fd ) == 1 );
+}
+
+int hasChanged( const tFileStat * before, const tFileStat * after )
+{
+    return ( before->size != after->size
+          || before->modified.tv_sec  != after->modified.tv_sec
+          || before->modified.tv_nsec != after->modified.tv_nsec );
+}
@@ -0,0 +1,26 @@
+//
+// Spot files that are still being written, such as a recording in progress
+//
+
+#ifndef AVCP_RECORDING_H
+#define AVCP_RECORDING_H
+
+#include "filemediainfo.h"
+
+/* how recently a file has to have been modified to be taken as still being written */
+#define kRecentSeconds  5
+
+/* whether the file open on 'fd' seems to still be being written: it was modified in the last
+ * kRecentSeconds, or some process has it open for writing (so a read lease can't be had).
+ * 'settled' if it's already been seen not to change over a while, in which case the modification
+ * time is no evidence either way (the clocks of a network share's server may be ahead of ours) */
+int isBeingWritten( int fd, const tFileStat * stat, int settled );
+
+/* whether some process has the file open on 'fd' open for writing: 1 if so, 0 if not, or -1 if
+ * the kernel won't say (not a local filesystem, or not our file) */
+int hasWriter( int fd );
+
+/* whether the file has changed between two stats of it, taken a while apart */
+int hasChanged( const tFileStat * before, const tFileStat * after );
+
+#endif //AVCP_RECORDING_H
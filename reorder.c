@@ -0,0 +1,137 @@
+//
+// Small bounded buffer that puts lines produced out of order back into sequence
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "avcp.h"
+#include "reorder.h"
+
+/* lines that arrive in order are written straight through, so nothing is held (or allocated)
+ * unless they really do complete out of order */
+typedef struct {
+    int    present;     ///> this sequence number has been submitted
+    char * line;        ///> held copy of the line (NULL if it produces no output)
+} tReorderSlot;
+
+struct reorder {
+    pthread_mutex_t lock;
+    pthread_cond_t  advanced;   ///> signalled when 'next' moves on
+    FILE          * output;
+    unsigned long   next;       ///> sequence number of the next line due out
+    unsigned int    window;
+    tReorderSlot    slot[];     ///> indexed by sequence number, modulo 'window'
+};
+
+tReorder * newReorder( FILE * output, unsigned int window )
+{
+    if ( window == 0 )
+    {
+        window = 1;
+    }
+
+    tReorder * reorder = calloc( 1, sizeof( tReorder ) + window * sizeof( tReorderSlot ));
+    if ( reorder != NULL )
+    {
+        pthread_mutex_init( &reorder->lock, NULL );
+        pthread_cond_init( &reorder->advanced, NULL );
+        reorder->output = output;
+        reorder->window = window;
+    }
+    return reorder;
+}
+
+/**
+ * @brief write out the held lines that are now in sequence
+ */
+static void drain( tReorder * reorder )
+{
+    tReorderSlot * slot = &reorder->slot[ reorder->next % reorder->window ];
+
+    while ( slot->present )
+    {
+        if ( slot->line != NULL )
+        {
+            fputs( slot->line, reorder->output );
+            free( slot->line );
+            slot->line = NULL;
+        }
+        slot->present = 0;
+
+        ++reorder->next;
+        slot = &reorder->slot[ reorder->next % reorder->window ];
+    }
+    fflush( reorder->output );
+}
+
+void freeReorder( tReorder * reorder )
+{
+    if ( reorder != NULL )
+    {
+        /* a gap means a sequence number was never submitted; don't hold up what follows it */
+        for ( unsigned int i = 0; i < reorder->window; ++i )
+        {
+            tReorderSlot * slot = &reorder->slot[ (reorder->next + i) % reorder->window ];
+            if ( slot->line != NULL )
+            {
+                fputs( slot->line, reorder->output );
+                free( slot->line );
+            }
+        }
+        fflush( reorder->output );
+        pthread_cond_destroy( &reorder->advanced );
+        pthread_mutex_destroy( &reorder->lock );
+        free( reorder );
+    }
+}
+
+int reorderSubmit( tReorder * reorder, unsigned long sequence, const char * line )
+{
+    int result = 0;
+
+    pthread_mutex_lock( &reorder->lock );
+
+    /* too far ahead to hold on to, so wait for the lines before it to be written */
+    while ( sequence >= reorder->next && sequence - reorder->next >= reorder->window )
+    {
+        pthread_cond_wait( &reorder->advanced, &reorder->lock );
+    }
+
+    if ( sequence < reorder->next )
+    {
+        result = EINVAL;  /* already written out */
+    }
+    else if ( sequence == reorder->next )
+    {
+        /* the common case: write it straight out, without copying it */
+        if ( line != NULL )
+        {
+            fputs( line, reorder->output );
+        }
+        ++reorder->next;
+        drain( reorder );
+        pthread_cond_broadcast( &reorder->advanced );
+    }
+    else
+    {
+        tReorderSlot * slot = &reorder->slot[ sequence % reorder->window ];
+
+        slot->line = NULL;
+        if ( line != NULL )
+        {
+            slot->line = strdup( line );
+            if ( slot->line == NULL )
+            {
+                result = ENOMEM;
+            }
+        }
+        /* even if the line was lost, the ones after it mustn't wait for it forever */
+        slot->present = 1;
+    }
+
+    pthread_mutex_unlock( &reorder->lock );
+    return result;
+}
@@ -0,0 +1,24 @@
+//
+// Small bounded buffer that puts lines produced out of order back into sequence
+//
+
+#ifndef AVCP_REORDER_H
+#define AVCP_REORDER_H
+
+#include <stdio.h>
+
+typedef struct reorder tReorder;
+
+/* 'window' is how far ahead of the next line due out a line may arrive */
+tReorder * newReorder( FILE * output, unsigned int window );
+
+/* write out anything still held, and release the buffer */
+void freeReorder( tReorder * reorder );
+
+/* submit the line for 'sequence' (or NULL, if that sequence number produces no output).
+ * It's written immediately if it's the next one due, along with any held lines that follow it.
+ * If 'sequence' is beyond the window, waits until it isn't. Safe to call from several threads.
+ * Returns EINVAL if 'sequence' was already written out, or ENOMEM if the line had to be dropped */
+int reorderSubmit( tReorder * reorder, unsigned long sequence, const char * line );
+
+#endif //AVCP_REORDER_H
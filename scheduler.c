@@ -0,0 +1,649 @@
+//
+// Per-device work queues, so each disk is kept busy at a queue depth that suits it
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "avcp.h"
+#include "scheduler.h"
+
+/* jobs queued or in progress, across all devices, before scheduleJob() waits */
+#define kMaxPendingJobs         1024
+
+#define kRotationalWorkers      1
+#define kSolidStateWorkers      4
+#define kNetworkWorkers         8   /* latency bound, rather than limited by the media */
+
+#define kMaxWorkersPerDevice    64
+#define kMaxPrefetchDepth       32
+
+/* the span of input order a physically ordered queue may reorder within. It must be smaller than
+ * the window of anything putting the results back in order, or that could wait forever */
+#define kSweepSpan              512
+
+typedef struct jobEntry {
+    struct jobEntry * next;
+    void            * job;
+    unsigned long     sweep;        ///> sequence / kSweepSpan
+    uint64_t          position;     ///> physical offset on the device
+    int               prefetched;   ///> handed to the prefetch function already
+    int               prefetching;  ///> a worker is still in the prefetch function with it
+} tJobEntry;
+
+typedef enum {
+    storageRotational,
+    storageSolidState,
+    storageNetwork
+} tStorage;
+
+/* each disk gets its own workers: one for a spinning disk, so it reads sequentially, more where
+ * several requests in flight is what gets the throughput. Every disk is then busy at once */
+typedef struct deviceQueue {
+    struct deviceQueue * next;
+    tScheduler         * scheduler;
+    dev_t                device;        ///> the disk, which several filesystems may share
+    tJobEntry          * head;
+    tJobEntry          * tail;
+    int                  ordered;       ///> served in physical order, rather than first come first served
+    uint64_t             position;      ///> physical offset of the last job taken (ordered only)
+    pthread_cond_t       ready;         ///> signalled when a job is queued, or it's time to exit
+    unsigned int         workerCount;
+    pthread_t            worker[];
+} tDeviceQueue;
+
+/* the queue for each filesystem seen so far */
+typedef struct deviceAlias {
+    struct deviceAlias * next;
+    dev_t                device;        ///> as st_dev gives it
+    tDeviceQueue       * queue;
+} tDeviceAlias;
+
+struct scheduler {
+    pthread_mutex_t  lock;
+    pthread_cond_t   idle;              ///> signalled when a job completes
+    tJobRunner       runner;
+    tWorkerExit      workerExit;
+    unsigned int     workersPerDevice;
+    int              physicalOrder;     ///> order the queues of spinning disks by physical offset
+    tJobPrefetch     prefetch;
+    unsigned int     prefetchDepth;     ///> how many jobs ahead to prefetch
+    tDeviceQueue   * queues;
+    tDeviceAlias   * aliases;
+    unsigned int     pending;           ///> queued or in progress
+    int              error;             ///> the first error a job reported
+    int              exiting;
+};
+
+/**
+ * @brief read a small integer from a sysfs attribute
+ * @return the value, or -1 if it couldn't be read
+ */
+static int readAttribute( const char * path )
+{
+    int value = -1;
+
+    FILE * file = fopen( path, "r" );
+    if ( file != NULL )
+    {
+        if ( fscanf( file, "%d", &value ) != 1 )
+        {
+            value = -1;
+        }
+        fclose( file );
+    }
+    return value;
+}
+
+/**
+ * @brief read a device number ("major:minor") from a sysfs attribute
+ * @return zero, or -1 if it couldn't be read
+ */
+static int readDevice( const char * path, dev_t * device )
+{
+    unsigned int major, minor;
+    int result = -1;
+
+    FILE * file = fopen( path, "r" );
+    if ( file != NULL )
+    {
+        if ( fscanf( file, "%u:%u", &major, &minor ) == 2 )
+        {
+            *device = makedev( major, minor );
+            result = 0;
+        }
+        fclose( file );
+    }
+    return result;
+}
+
+/**
+ * @brief the whole disk a block device is part of, and whether it spins
+ */
+static dev_t diskOf( dev_t device, tStorage * storage )
+{
+    char path[64];
+
+    /* a partition's disk is the directory above it */
+    snprintf( path, sizeof( path ), "/sys/dev/block/%u:%u/partition", major( device ), minor( device ));
+    if ( readAttribute( path ) >= 0 )
+    {
+        snprintf( path, sizeof( path ), "/sys/dev/block/%u:%u/../dev", major( device ), minor( device ));
+        readDevice( path, &device );
+    }
+
+    /* if sysfs won't say, assume it spins; too many workers on one of those is what hurts */
+    snprintf( path, sizeof( path ), "/sys/dev/block/%u:%u/queue/rotational", major( device ), minor( device ));
+    *storage = ( readAttribute( path ) == 0 ) ? storageSolidState : storageRotational;
+    return device;
+}
+
+/**
+ * @brief whether a filesystem type is reached over the network, or through a userspace daemon
+ * that probably is, where several requests in flight hide the latency
+ */
+static int isNetworkFilesystem( const char * type )
+{
+    static const char * network[] = { "nfs", "nfs4", "cifs", "smb3", "smbfs", "ceph", "9p", "afs",
+                                      "glusterfs", "lustre", "fuse", NULL };
+
+    for ( int i = 0; network[i] != NULL; ++i )
+    {
+        if ( strcmp( type, network[i] ) == 0 )
+        {
+            return 1;
+        }
+    }
+    return ( strncmp( type, "fuse.", 5 ) == 0 );
+}
+
+/**
+ * @brief find the disk a filesystem is on, and what kind of storage that is. Filesystems like
+ * btrfs and ZFS give each subvolume or dataset an anonymous device (major zero) of its own, so
+ * those are looked up in the mount table, to find the block device behind them
+ * @return the device to queue its jobs under
+ */
+static dev_t resolveDevice( dev_t device, tStorage * storage )
+{
+    if ( major( device ) != 0 )
+    {
+        return diskOf( device, storage );
+    }
+
+    char line[PATH_MAX + 256];
+    char type[64]  = "";
+    char source[PATH_MAX] = "";
+
+    FILE * mounts = fopen( "/proc/self/mountinfo", "r" );
+    if ( mounts != NULL )
+    {
+        while ( fgets( line, sizeof( line ), mounts ) != NULL )
+        {
+            unsigned int major, minor;
+            const char * fields = strstr( line, " - " );
+            if ( sscanf( line, "%*d %*d %u:%u", &major, &minor ) == 2
+              && makedev( major, minor ) == device && fields != NULL
+              && sscanf( fields, " - %63s %4095s", type, source ) == 2 )
+            {
+                break;
+            }
+            type[0] = '\0';
+        }
+        fclose( mounts );
+    }
+
+    if ( type[0] != '\0' && isNetworkFilesystem( type ))
+    {
+        *storage = storageNetwork;
+        return device;
+    }
+    if ( strcmp( type, "tmpfs" ) == 0 || strcmp( type, "ramfs" ) == 0 )
+    {
+        *storage = storageSolidState;   /* no heads to move */
+        return device;
+    }
+
+    struct stat sourceStat;
+    if ( type[0] != '\0' && stat( source, &sourceStat ) == 0 && S_ISBLK( sourceStat.st_mode ))
+    {
+        return diskOf( sourceStat.st_rdev, storage );
+    }
+
+    /* no block device to be found (a ZFS dataset, an overlay). They all share a queue, as the
+     * likeliest case is several datasets of one pool, on spinning disks */
+    *storage = storageRotational;
+    return makedev( 0, 0 );
+}
+
+static unsigned int storageConcurrency( tStorage storage )
+{
+    switch ( storage )
+    {
+    case storageSolidState:
+        return kSolidStateWorkers;
+
+    case storageRotational:
+        return kRotationalWorkers;
+
+    default:
+        return kNetworkWorkers;
+    }
+}
+
+unsigned int deviceConcurrency( dev_t device )
+{
+    tStorage storage;
+
+    resolveDevice( device, &storage );
+    return storageConcurrency( storage );
+}
+
+/**
+ * @brief take the next job off a queue. An ordered queue is served elevator style: the next job
+ * further across the platter from where the heads last were, wrapping around at the end
+ * @note called with the scheduler locked, and the queue not empty
+ */
+static tJobEntry * takeJob( tDeviceQueue * queue )
+{
+    tJobEntry ** link = &queue->head;
+
+    if ( queue->ordered )
+    {
+        /* the queue is sorted by sweep, then position. Within the first sweep, take the first job
+         * at or beyond where the heads are, or wrap around to the start of it if there isn't one */
+        unsigned long sweep = queue->head->sweep;
+        for ( tJobEntry ** scan = &queue->head; *scan != NULL && (*scan)->sweep == sweep; scan = &(*scan)->next )
+        {
+            if ( (*scan)->position >= queue->position )
+            {
+                link = scan;
+                break;
+            }
+        }
+    }
+
+    tJobEntry * entry = *link;
+    *link = entry->next;
+    if ( queue->tail == entry )
+    {
+        /* find the new tail (only an ordered queue takes anything other than the head) */
+        queue->tail = queue->head;
+        while ( queue->tail != NULL && queue->tail->next != NULL )
+        {
+            queue->tail = queue->tail->next;
+        }
+    }
+    queue->position = entry->position;
+    return entry;
+}
+
+/**
+ * @brief choose the jobs that will follow 'taken' that haven't been prefetched yet, and mark them
+ * @note called with the scheduler locked. 'taken' has been removed from the queue, but its
+ * 'next' still points at what followed it
+ * @return how many were put in 'ahead'
+ */
+static unsigned int pickPrefetch( tDeviceQueue * queue, tJobEntry * taken, tJobEntry * ahead[], unsigned int depth )
+{
+    unsigned int count = 0;
+    unsigned int seen  = 0;
+
+    /* what follows it in the queue, then (for an elevator, which will wrap around) the start */
+    tJobEntry * start = (queue->ordered && taken->next != NULL) ? taken->next : queue->head;
+    tJobEntry * entry = start;
+    while ( entry != NULL && seen < depth )
+    {
+        if ( !entry->prefetched )
+        {
+            entry->prefetched  = 1;
+            entry->prefetching = 1;
+            ahead[ count++ ] = entry;
+        }
+        ++seen;
+
+        entry = entry->next;
+        if ( entry == NULL && start != queue->head )
+        {
+            entry = queue->head;
+        }
+        if ( entry == start )
+        {
+            break;  /* all the way around */
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief add a job to a queue
+ * @note called with the scheduler locked
+ */
+static void putJob( tDeviceQueue * queue, tJobEntry * entry )
+{
+    if ( queue->ordered )
+    {
+        /* keep it sorted by sweep, then position. Jobs usually arrive in ascending sweeps,
+         * so only the last sweep's entries need be searched, but it's short in any case */
+        tJobEntry ** link = &queue->head;
+        while ( *link != NULL
+             && ( (*link)->sweep < entry->sweep
+               || ((*link)->sweep == entry->sweep && (*link)->position <= entry->position)) )
+        {
+            link = &(*link)->next;
+        }
+        entry->next = *link;
+        *link = entry;
+        if ( entry->next == NULL )
+        {
+            queue->tail = entry;
+        }
+    }
+    else
+    {
+        if ( queue->tail == NULL )
+        {
+            queue->head = entry;
+        }
+        else
+        {
+            queue->tail->next = entry;
+        }
+        queue->tail = entry;
+    }
+}
+
+static void * workerThread( void * arg )
+{
+    tDeviceQueue * queue = arg;
+    tScheduler   * scheduler = queue->scheduler;
+
+    pthread_mutex_lock( &scheduler->lock );
+    for (;;)
+    {
+        while ( queue->head == NULL && !scheduler->exiting )
+        {
+            pthread_cond_wait( &queue->ready, &scheduler->lock );
+        }
+        if ( queue->head == NULL )
+        {
+            break;  /* exiting, and nothing left to do */
+        }
+
+        tJobEntry * entry = takeJob( queue );
+
+        /* start the I/O for the jobs that follow it, before getting on with this one */
+        tJobEntry * ahead[kMaxPrefetchDepth];
+        unsigned int count = 0;
+        if ( scheduler->prefetch != NULL )
+        {
+            count = pickPrefetch( queue, entry, ahead, scheduler->prefetchDepth );
+            if ( count > 0 )
+            {
+                pthread_mutex_unlock( &scheduler->lock );
+                for ( unsigned int i = 0; i < count; ++i )
+                {
+                    scheduler->prefetch( ahead[i]->job );
+                }
+                pthread_mutex_lock( &scheduler->lock );
+
+                for ( unsigned int i = 0; i < count; ++i )
+                {
+                    ahead[i]->prefetching = 0;
+                }
+                pthread_cond_broadcast( &queue->ready );
+            }
+        }
+
+        /* another worker may still be prefetching this one */
+        while ( entry->prefetching )
+        {
+            pthread_cond_wait( &queue->ready, &scheduler->lock );
+        }
+        pthread_mutex_unlock( &scheduler->lock );
+
+        int result = scheduler->runner( entry->job );
+        free( entry );
+
+        pthread_mutex_lock( &scheduler->lock );
+        if ( result != 0 && scheduler->error == 0 )
+        {
+            scheduler->error = result;
+        }
+        --scheduler->pending;
+        pthread_cond_broadcast( &scheduler->idle );
+    }
+    pthread_mutex_unlock( &scheduler->lock );
+
+    if ( scheduler->workerExit != NULL )
+    {
+        scheduler->workerExit();
+    }
+    return NULL;
+}
+
+/**
+ * @brief make the queue for a disk, and start its workers
+ * @note called with the scheduler locked
+ */
+static tDeviceQueue * newQueue( tScheduler * scheduler, dev_t device, tStorage storage )
+{
+    unsigned int workers = scheduler->workersPerDevice;
+    if ( workers == 0 )
+    {
+        workers = storageConcurrency( storage );
+    }
+    if ( workers > kMaxWorkersPerDevice )
+    {
+        workers = kMaxWorkersPerDevice;
+    }
+
+    tDeviceQueue * queue = calloc( 1, sizeof( tDeviceQueue ) + workers * sizeof( pthread_t ));
+    if ( queue == NULL )
+    {
+        return NULL;
+    }
+    queue->scheduler = scheduler;
+    queue->device    = device;
+    queue->ordered   = scheduler->physicalOrder && storage == storageRotational;
+    pthread_cond_init( &queue->ready, NULL );
+
+    for ( unsigned int i = 0; i < workers; ++i )
+    {
+        if ( pthread_create( &queue->worker[i], NULL, workerThread, queue ) != 0 )
+        {
+            break;
+        }
+        ++queue->workerCount;
+    }
+    if ( queue->workerCount == 0 )
+    {
+        pthread_cond_destroy( &queue->ready );
+        free( queue );
+        return NULL;
+    }
+
+    debugf( "device %u:%u, %u worker%s%s", major( device ), minor( device ),
+            queue->workerCount, (queue->workerCount == 1) ? "" : "s", queue->ordered ? ", in physical order" : "" );
+
+    queue->next = scheduler->queues;
+    scheduler->queues = queue;
+    return queue;
+}
+
+/**
+ * @brief find the queue for a filesystem's device, creating it (and starting its workers) the
+ * first time its disk is seen
+ * @note called with the scheduler locked
+ */
+static tDeviceQueue * findQueue( tScheduler * scheduler, dev_t device )
+{
+    tDeviceQueue * queue;
+
+    for ( tDeviceAlias * alias = scheduler->aliases; alias != NULL; alias = alias->next )
+    {
+        if ( alias->device == device )
+        {
+            return alias->queue;
+        }
+    }
+
+    tDeviceAlias * alias = malloc( sizeof( tDeviceAlias ));
+    if ( alias == NULL )
+    {
+        return NULL;
+    }
+
+    /* each partition or subvolume of a disk shares its queue, or they'd fight over the heads */
+    tStorage storage;
+    dev_t disk = resolveDevice( device, &storage );
+    for ( queue = scheduler->queues; queue != NULL; queue = queue->next )
+    {
+        if ( queue->device == disk )
+        {
+            break;
+        }
+    }
+    if ( queue == NULL )
+    {
+        queue = newQueue( scheduler, disk, storage );
+    }
+    if ( queue == NULL )
+    {
+        free( alias );
+        return NULL;
+    }
+
+    alias->device = device;
+    alias->queue  = queue;
+    alias->next   = scheduler->aliases;
+    scheduler->aliases = alias;
+    return queue;
+}
+
+tScheduler * newScheduler( tJobRunner runner, tWorkerExit workerExit, unsigned int workersPerDevice, int physicalOrder )
+{
+    tScheduler * scheduler = calloc( 1, sizeof( tScheduler ));
+    if ( scheduler != NULL )
+    {
+        pthread_mutex_init( &scheduler->lock, NULL );
+        pthread_cond_init( &scheduler->idle, NULL );
+        scheduler->runner           = runner;
+        scheduler->workerExit       = workerExit;
+        scheduler->workersPerDevice = workersPerDevice;
+        scheduler->physicalOrder    = physicalOrder;
+    }
+    return scheduler;
+}
+
+void setPrefetch( tScheduler * scheduler, tJobPrefetch prefetch, unsigned int depth )
+{
+    pthread_mutex_lock( &scheduler->lock );
+    scheduler->prefetch      = prefetch;
+    scheduler->prefetchDepth = (depth > kMaxPrefetchDepth) ? kMaxPrefetchDepth : depth;
+    pthread_mutex_unlock( &scheduler->lock );
+}
+
+int isOrderedDevice( tScheduler * scheduler, dev_t device )
+{
+    pthread_mutex_lock( &scheduler->lock );
+    tDeviceQueue * queue = findQueue( scheduler, device );
+    int ordered = ( queue != NULL && queue->ordered );
+    pthread_mutex_unlock( &scheduler->lock );
+
+    return ordered;
+}
+
+int scheduleJob( tScheduler * scheduler, dev_t device, unsigned long sequence, uint64_t position, void * job )
+{
+    int result;
+
+    tJobEntry * entry = malloc( sizeof( tJobEntry ));
+    if ( entry == NULL )
+    {
+        return ENOMEM;
+    }
+    entry->next     = NULL;
+    entry->job      = job;
+    entry->sweep    = sequence / kSweepSpan;
+    entry->position = position;
+    entry->prefetched  = 0;
+    entry->prefetching = 0;
+
+    pthread_mutex_lock( &scheduler->lock );
+
+    /* keep the amount of work in hand bounded, however many files there are */
+    while ( scheduler->pending >= kMaxPendingJobs && scheduler->error == 0 )
+    {
+        pthread_cond_wait( &scheduler->idle, &scheduler->lock );
+    }
+
+    result = scheduler->error;
+    if ( result == 0 )
+    {
+        tDeviceQueue * queue = findQueue( scheduler, device );
+        if ( queue == NULL )
+        {
+            result = ENOMEM;
+        }
+        else
+        {
+            putJob( queue, entry );
+            ++scheduler->pending;
+
+            pthread_cond_signal( &queue->ready );
+            entry = NULL;
+        }
+    }
+    pthread_mutex_unlock( &scheduler->lock );
+
+    /* not queued, so it's still ours */
+    free( entry );
+    return result;
+}
+
+int finishScheduler( tScheduler * scheduler )
+{
+    pthread_mutex_lock( &scheduler->lock );
+    scheduler->exiting = 1;
+    for ( tDeviceQueue * queue = scheduler->queues; queue != NULL; queue = queue->next )
+    {
+        pthread_cond_broadcast( &queue->ready );
+    }
+    pthread_mutex_unlock( &scheduler->lock );
+
+    /* the workers drain their queues before they exit */
+    tDeviceQueue * queue = scheduler->queues;
+    while ( queue != NULL )
+    {
+        for ( unsigned int i = 0; i < queue->workerCount; ++i )
+        {
+            pthread_join( queue->worker[i], NULL );
+        }
+
+        tDeviceQueue * next = queue->next;
+        pthread_cond_destroy( &queue->ready );
+        free( queue );
+        queue = next;
+    }
+    while ( scheduler->aliases != NULL )
+    {
+        tDeviceAlias * next = scheduler->aliases->next;
+        free( scheduler->aliases );
+        scheduler->aliases = next;
+    }
+
+    int result = scheduler->error;
+    pthread_cond_destroy( &scheduler->idle );
+    pthread_mutex_destroy( &scheduler->lock );
+    free( scheduler );
+    return result;
+}
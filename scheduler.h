@@ -0,0 +1,49 @@
+//
+// Per-device work queues, so each disk is kept busy at a queue depth that suits it
+//
+
+#ifndef AVCP_SCHEDULER_H
+#define AVCP_SCHEDULER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct scheduler tScheduler;
+
+/* does the work for one job, and releases it. Returns zero, or an errno value */
+typedef int (*tJobRunner)( void * job );
+
+/* starts the I/O a job will need (e.g. with posix_fadvise()), without waiting for it. It may
+ * keep what it opens in the job. Called at most once per job, before the job is run */
+typedef void (*tJobPrefetch)( void * job );
+
+/* called by each worker thread as it exits, to release anything it kept between jobs */
+typedef void (*tWorkerExit)( void );
+
+/* 'workersPerDevice' of zero means choose per device: one for a spinning disk, more otherwise.
+ * If 'physicalOrder' is set, the jobs for a spinning disk are run in order of their position
+ * on it, rather than the order they were queued in */
+tScheduler * newScheduler( tJobRunner runner, tWorkerExit workerExit, unsigned int workersPerDevice,
+                           int physicalOrder );
+
+/* before running a job, prefetch the next 'depth' jobs in its queue (zero turns it off) */
+void setPrefetch( tScheduler * scheduler, tJobPrefetch prefetch, unsigned int depth );
+
+/* non-zero if jobs for this device are run in physical order, so are worth giving a position */
+int isOrderedDevice( tScheduler * scheduler, dev_t device );
+
+/* queue a job for the workers of the device it's on. 'sequence' is the job's place in the input
+ * order, and 'position' the physical offset of its data (only used if the device is ordered).
+ * Blocks while too many jobs are pending.
+ * Returns non-zero (the first error a job reported) once the remaining work should be abandoned,
+ * in which case the job wasn't queued, and is still the caller's */
+int scheduleJob( tScheduler * scheduler, dev_t device, unsigned long sequence, uint64_t position, void * job );
+
+/* wait for every job to complete, then release the scheduler. Returns the first error reported */
+int finishScheduler( tScheduler * scheduler );
+
+/* how many jobs to run at once on a filesystem's device: one for a spinning disk (or where that
+ * can't be told), more for an SSD, and more again for a network filesystem */
+unsigned int deviceConcurrency( dev_t device );
+
+#endif //AVCP_SCHEDULER_H
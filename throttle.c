@@ -0,0 +1,244 @@
+//
+// Background mode: keep avcp's reading from starving anything else that's using the disks
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "avcp.h"
+#include "throttle.h"
+
+/* from linux/ioprio.h, which glibc doesn't wrap */
+#define kIOPrioWhoProcess   1
+#define kIOPrioClassBE      2
+#define kIOPrioClassIdle    3
+#define kIOPrioClassShift   13
+#define kIOPrioLowestBE     7
+
+#define kNanoseconds        1000000000ULL
+
+/* how far ahead of the limit a reader may get, so small reads aren't each made to wait */
+#define kBurstNanoseconds   (kNanoseconds / 4)
+
+/* how often pressure is looked at. Its shortest average is over ten seconds, so more often
+ * would only react to the same stall twice */
+#define kPressureInterval   (2 * kNanoseconds)
+
+/* the 'some' avg10 percentage (time at least one task was stalled) above which the limit is
+ * halved, and below which it's raised again */
+#define kPressureHigh       10.0
+#define kPressureLow        2.0
+
+/* the limit never drops below a sixteenth of what was asked for, and climbs back an eighth at a time */
+#define kMinimumShift       4
+#define kRecoveryShift      3
+
+/* shared with the worker processes, so the limit covers everyone's reads together */
+typedef struct {
+    unsigned long       limit;          ///> bytes per second, as asked for
+    uint64_t            started;        ///> nanoseconds, CLOCK_MONOTONIC
+    int                 pressure;       ///> /proc/pressure is there to read
+    atomic_ullong       empty;          ///> when the bucket will next be empty
+    atomic_ulong        rate;           ///> the limit now, after any backing off
+    atomic_ullong       checked;        ///> when pressure was last looked at
+    atomic_ullong       bytes;
+    atomic_ullong       waited;         ///> nanoseconds spent sleeping, over every reader
+    atomic_ulong        backoffs;
+    atomic_ulong        lowest;         ///> the lowest the rate went
+} tThrottle;
+
+static tThrottle * gThrottle = NULL;
+
+static uint64_t nowNanoseconds( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (uint64_t)now.tv_sec * kNanoseconds + now.tv_nsec;
+}
+
+/**
+ * @brief the 'some' avg10 figure from one of the /proc/pressure files
+ * @return the percentage, or -1 if it couldn't be read
+ */
+static double readPressure( const char * path )
+{
+    double avg10 = -1;
+    FILE * file  = fopen( path, "r" );
+
+    if ( file != NULL )
+    {
+        if ( fscanf( file, "some avg10=%lf", &avg10 ) != 1 )
+        {
+            avg10 = -1;
+        }
+        fclose( file );
+    }
+    return avg10;
+}
+
+/**
+ * @brief if it's time, look at the pressure, and move the rate accordingly. Whichever reader
+ * gets here first does it, in whichever process it's in
+ */
+static void checkPressure( uint64_t now )
+{
+    unsigned long long checked = atomic_load( &gThrottle->checked );
+
+    if ( !gThrottle->pressure || now - checked < kPressureInterval
+      || !atomic_compare_exchange_strong( &gThrottle->checked, &checked, now ) )
+    {
+        return;
+    }
+
+    double io     = readPressure( "/proc/pressure/io" );
+    double memory = readPressure( "/proc/pressure/memory" );
+    double worst  = ( io > memory ) ? io : memory;
+
+    unsigned long rate    = atomic_load( &gThrottle->rate );
+    unsigned long minimum = gThrottle->limit >> kMinimumShift;
+
+    if ( worst > kPressureHigh && rate > minimum )
+    {
+        rate /= 2;
+        if ( rate < minimum )
+        {
+            rate = minimum;
+        }
+        atomic_store( &gThrottle->rate, rate );
+        atomic_fetch_add( &gThrottle->backoffs, 1 );
+        if ( rate < atomic_load( &gThrottle->lowest ))
+        {
+            atomic_store( &gThrottle->lowest, rate );
+        }
+    }
+    else if ( worst >= 0 && worst < kPressureLow && rate < gThrottle->limit )
+    {
+        rate += gThrottle->limit >> kRecoveryShift;
+        if ( rate > gThrottle->limit )
+        {
+            rate = gThrottle->limit;
+        }
+        atomic_store( &gThrottle->rate, rate );
+    }
+}
+
+/**
+ * @brief idle class if we can, otherwise the lowest best-effort priority
+ */
+static int lowerPriority( void )
+{
+    if ( syscall( SYS_ioprio_set, kIOPrioWhoProcess, 0, kIOPrioClassIdle << kIOPrioClassShift ) == 0 )
+    {
+        return 0;
+    }
+    if ( syscall( SYS_ioprio_set, kIOPrioWhoProcess, 0,
+                  (kIOPrioClassBE << kIOPrioClassShift) | kIOPrioLowestBE ) == 0 )
+    {
+        return 0;
+    }
+    return errno;
+}
+
+int startThrottle( unsigned long bytesPerSecond )
+{
+    int result = lowerPriority();
+    if ( result != 0 )
+    {
+        errno = result;
+        errorf( "unable to lower the I/O priority" );
+    }
+
+    /* workers forked after this share it */
+    void * shared = mmap( NULL, sizeof( tThrottle ), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+    if ( shared == MAP_FAILED )
+    {
+        return errno;
+    }
+    gThrottle = shared;
+
+    gThrottle->limit    = bytesPerSecond;
+    gThrottle->started  = nowNanoseconds();
+    gThrottle->pressure = ( readPressure( "/proc/pressure/io" ) >= 0 );
+    atomic_store( &gThrottle->rate,   bytesPerSecond );
+    atomic_store( &gThrottle->lowest, bytesPerSecond );
+    atomic_store( &gThrottle->empty,  gThrottle->started );
+    atomic_store( &gThrottle->checked, gThrottle->started );
+
+    if ( !gThrottle->pressure )
+    {
+        debugf( "no /proc/pressure, so the read limit won't adapt to contention" );
+    }
+    return 0;
+}
+
+int isThrottled( void )
+{
+    return ( gThrottle != NULL );
+}
+
+void throttleRead( size_t bytes )
+{
+    if ( gThrottle == NULL || bytes == 0 )
+    {
+        return;
+    }
+
+    uint64_t now = nowNanoseconds();
+    checkPressure( now );
+    atomic_fetch_add( &gThrottle->bytes, bytes );
+
+    uint64_t cost  = (uint64_t)bytes * kNanoseconds / atomic_load( &gThrottle->rate );
+    unsigned long long empty = atomic_load( &gThrottle->empty );
+    uint64_t until;
+    do {
+        /* a bucket that's been idle is full, but no fuller */
+        uint64_t from = ( empty > now ) ? empty : now;
+        until = from + cost;
+    } while ( !atomic_compare_exchange_weak( &gThrottle->empty, &empty, until ));
+
+    if ( until > now + kBurstNanoseconds )
+    {
+        uint64_t wake = until - kBurstNanoseconds;
+        struct timespec when = { .tv_sec = wake / kNanoseconds, .tv_nsec = wake % kNanoseconds };
+
+        atomic_fetch_add( &gThrottle->waited, wake - now );
+        while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL ) == EINTR )
+        {
+            /* keep waiting */
+        }
+    }
+}
+
+void reportThrottle( FILE * output )
+{
+    if ( gThrottle == NULL )
+    {
+        return;
+    }
+
+    const double megabyte = 1024 * 1024;
+    double elapsed = (double)(nowNanoseconds() - gThrottle->started) / kNanoseconds;
+    double bytes   = atomic_load( &gThrottle->bytes );
+
+    fprintf( output, "read %.1f MB in %.1f s, %.1f MB/s against a limit of %.1f MB/s, waiting %.1f s in all\n",
+             bytes / megabyte, elapsed, (elapsed > 0) ? bytes / megabyte / elapsed : 0,
+             gThrottle->limit / megabyte, (double)atomic_load( &gThrottle->waited ) / kNanoseconds );
+
+    unsigned long backoffs = atomic_load( &gThrottle->backoffs );
+    if ( backoffs > 0 )
+    {
+        fprintf( output, "backed off %lu times for I/O or memory pressure, to as low as %.1f MB/s\n",
+                 backoffs, atomic_load( &gThrottle->lowest ) / megabyte );
+    }
+}
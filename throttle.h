@@ -0,0 +1,27 @@
+//
+// Background mode: keep avcp's reading from starving anything else that's using the disks
+//
+
+#ifndef AVCP_THROTTLE_H
+#define AVCP_THROTTLE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/* drop this process to the idle I/O priority class, and limit the bytes read per second, over this
+ * process and the probe workers, to 'bytesPerSecond'. The limit is lowered while the system is
+ * under I/O or memory pressure, and raised again once it's clear. Call it before any threads are
+ * started or workers forked, so they inherit it. Returns zero, or an errno */
+int startThrottle( unsigned long bytesPerSecond );
+
+/* whether startThrottle() has been called, so reads are limited */
+int isThrottled( void );
+
+/* account for 'bytes' just read, and if that's more than the limit allows, wait until it isn't.
+ * Does nothing if startThrottle() wasn't called */
+void throttleRead( size_t bytes );
+
+/* the throughput achieved against the limit, and how often pressure lowered it */
+void reportThrottle( FILE * output );
+
+#endif //AVCP_THROTTLE_H
@@ -0,0 +1,262 @@
+//
+// MPEG transport stream reception error scanner
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "avcp.h"
+#include "throttle.h"
+#include "tsscan.h"
+
+#define kTSPacketSize   188
+#define kTSSyncByte     0x47
+#define kTSPidCount     8192
+#define kTSNullPid      0x1FFF
+
+/* read in big chunks, a whole number of packets at a time */
+#define kTSReadPackets  (8 * 1024)
+#define kTSReadSize     (kTSReadPackets * kTSPacketSize)
+
+/* PCR is a 27MHz clock, with a 33-bit base and a 9-bit extension */
+#define kPcrHz          27000000LL
+#define kPcrWrap        ((1LL << 33) * 300)
+/* the spec requires a PCR at least every 100ms - allow a generous margin before calling it a jump */
+#define kPcrMaxGap      (kPcrHz / 2)
+
+#define kNoContinuity   0xFF
+
+typedef struct {
+    uint8_t  continuity[kTSPidCount];   /* last continuity counter seen, or kNoContinuity */
+    int64_t  pcr[kTSPidCount];          /* last PCR seen, or -1 */
+    int      pcrPid;                    /* PID used to measure the elapsed time, or -1 */
+    int64_t  pcrTicks;                  /* elapsed time on pcrPid, in 27MHz ticks */
+} tScanState;
+
+/**
+ * @brief examine a single 188-byte transport packet, and update the counts
+ */
+static void checkPacket( tFileInfo * file, tScanState * state, const uint8_t * packet )
+{
+    unsigned int pid = ((packet[1] & 0x1F) << 8) | packet[2];
+
+    if ( pid == kTSNullPid )
+    {
+        return; /* stuffing - nothing to see here */
+    }
+
+    if ( packet[1] & 0x80 )
+    {
+        /* the demodulator flagged this packet as uncorrectable,
+         * so don't trust anything else in the header */
+        ++file->errors.transport;
+        return;
+    }
+
+    unsigned int adaptation    = (packet[3] >> 4) & 0x03;
+    unsigned int continuity    = packet[3] & 0x0F;
+    int          discontinuity = 0;
+
+    if ( (adaptation & 0x02) && packet[4] > 0 )
+    {
+        uint8_t flags = packet[5];
+
+        discontinuity = (flags & 0x80) != 0;
+
+        if ( (flags & 0x10) && packet[4] >= 7 )
+        {
+            int64_t base = ((int64_t)packet[6] << 25)
+                         | ((int64_t)packet[7] << 17)
+                         | ((int64_t)packet[8] << 9)
+                         | ((int64_t)packet[9] << 1)
+                         | (packet[10] >> 7);
+            int64_t pcr  = base * 300 + (((packet[10] & 0x01) << 8) | packet[11]);
+
+            if ( state->pcrPid < 0 )
+            {
+                state->pcrPid = pid;
+            }
+
+            if ( state->pcr[pid] >= 0 && !discontinuity )
+            {
+                int64_t delta = pcr - state->pcr[pid];
+                if ( delta < 0 )
+                {
+                    delta += kPcrWrap;
+                }
+
+                if ( delta > kPcrMaxGap )
+                {
+                    ++file->errors.pcr;
+                }
+                else if ( (int)pid == state->pcrPid )
+                {
+                    state->pcrTicks += delta;
+                }
+            }
+            state->pcr[pid] = pcr;
+        }
+    }
+
+    /* the continuity counter only increments on packets carrying a payload */
+    if ( adaptation & 0x01 )
+    {
+        uint8_t last = state->continuity[pid];
+
+        if ( last != kNoContinuity && !discontinuity
+          && continuity != ((last + 1) & 0x0F)
+          && continuity != last ) /* a single duplicate packet is permitted */
+        {
+            ++file->errors.continuity;
+        }
+        state->continuity[pid] = continuity;
+    }
+}
+
+/**
+ * @brief find the next offset in the buffer that looks like the start of a packet
+ * @return offset of the next plausible sync byte, or 'length' if there isn't one
+ */
+static size_t resync( const uint8_t * buffer, size_t offset, size_t length )
+{
+    while ( offset < length )
+    {
+        /* glibc's memchr is already vectorized, so let it do the heavy lifting */
+        const uint8_t * p = memchr( &buffer[offset], kTSSyncByte, length - offset );
+        if ( p == NULL )
+        {
+            return length;
+        }
+        offset = p - buffer;
+
+        /* a lone 0x47 is common in payloads, so insist that the next packet lines up too.
+         * If it's beyond what we have in the buffer, give it the benefit of the doubt */
+        if ( offset + kTSPacketSize >= length || buffer[offset + kTSPacketSize] == kTSSyncByte )
+        {
+            return offset;
+        }
+        ++offset;
+    }
+    return length;
+}
+
+int scanTransportStream( tFileInfo * file )
+{
+    int result = 0;
+
+    /* use the descriptor the file is already open on, if there is one */
+    int fd = file->fd;
+    if ( fd < 0 )
+    {
+        fd = open( file->name, O_RDONLY | O_CLOEXEC );
+        if ( fd < 0 )
+        {
+            errorf( "unable to open \'%s\'", file->name );
+            return errno;
+        }
+    }
+
+    /* we'll read it exactly once, front to back, and never look at it again */
+    posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+    tScanState * state = malloc( sizeof( tScanState ));
+    uint8_t * buffer = NULL;
+    if ( state == NULL || posix_memalign( (void **)&buffer, 4096, kTSReadSize + kTSPacketSize ) != 0 )
+    {
+        free( state );
+        if ( fd != file->fd )
+        {
+            close( fd );
+        }
+        return ENOMEM;
+    }
+
+    memset( state->continuity, kNoContinuity, sizeof( state->continuity ));
+    for ( unsigned int i = 0; i < kTSPidCount; ++i )
+    {
+        state->pcr[i] = -1;
+    }
+    state->pcrPid   = -1;
+    state->pcrTicks = 0;
+
+    memset( &file->errors, 0, sizeof( file->errors ));
+
+    size_t  carried = 0;   /* bytes of a partial packet left over from the previous read */
+    int     inSync  = 1;
+    ssize_t count;
+    off_t   position = 0;  /* pread(), as the descriptor may be shared, and already read from */
+
+    while ( (count = pread( fd, &buffer[carried], kTSReadSize, position )) > 0 )
+    {
+        throttleRead( count );
+        position += count;
+        size_t length = carried + count;
+        size_t offset = 0;
+
+        while ( offset + kTSPacketSize <= length )
+        {
+            if ( buffer[offset] != kTSSyncByte )
+            {
+                if ( inSync )
+                {
+                    ++file->errors.sync;
+                    inSync = 0;
+                }
+                offset = resync( buffer, offset, length );
+                continue;
+            }
+            inSync = 1;
+
+            ++file->errors.packets;
+            checkPacket( file, state, &buffer[offset] );
+            offset += kTSPacketSize;
+        }
+
+        /* move the tail to the front, for the next read to complete it */
+        carried = length - offset;
+        memmove( buffer, &buffer[offset], carried );
+    }
+
+    if ( count < 0 )
+    {
+        errorf( "unable to read \'%s\'", file->name );
+        result = errno;
+    }
+
+    /* prefer the container's idea of the duration, but fall back to the elapsed PCR time */
+    unsigned long seconds = file->container.duration;
+    if ( seconds == 0 )
+    {
+        seconds = state->pcrTicks / kPcrHz;
+    }
+
+    unsigned long total = file->errors.sync + file->errors.transport
+                        + file->errors.continuity + file->errors.pcr;
+    if ( seconds > 0 )
+    {
+        file->errors.perMinute = (total * 60 * 1000) / seconds;
+    }
+    else if ( total > 0 )
+    {
+        /* no idea how long it is, but it's clearly not clean */
+        file->errors.perMinute = total * 60 * 1000;
+    }
+
+    free( buffer );
+    free( state );
+    if ( fd != file->fd )
+    {
+        close( fd );
+    }
+
+    return result;
+}
@@ -0,0 +1,13 @@
+//
+// MPEG transport stream reception error scanner
+//
+
+#ifndef AVCP_TSSCAN_H
+#define AVCP_TSSCAN_H
+
+#include "filemediainfo.h"
+
+/* read the whole transport stream, and populate file->errors */
+int scanTransportStream( tFileInfo * file );
+
+#endif //AVCP_TSSCAN_H